@@ -1,7 +1,9 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <time.h>
 
 typedef struct {
     int start;
@@ -28,12 +30,227 @@ void *factorial_part(void *arg) {
     return NULL;
 }
 
+// ---- пакетный режим: запросы "k mod" построчно из файла или stdin ----
+
+#define BATCH_BLOCK 4096          // запросов, читаемых за один раз
+
+typedef struct {
+    long long k;
+    long long mod;
+    int first_chunk;
+    int chunks;
+} Query;
+
+typedef struct {
+    int query;
+    long long start;
+    long long end;
+    long long partial;            // слот результата, пишет только один поток
+    long long started_ns;
+    long long finished_ns;
+} Chunk;
+
+typedef struct {
+    int first_chunk;              // единица работы: подряд идущие куски
+    int last_chunk;
+} WorkItem;
+
+typedef struct {
+    Query *queries;
+    Chunk *chunks;
+    WorkItem *items;
+    int items_num;
+    int next_item;                // раздаётся атомарно
+    int done;
+    pthread_barrier_t start;
+    pthread_barrier_t finish;
+} Batch;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// модуль может быть больше 2^32, поэтому произведение считаем в 128 битах
+static unsigned long long mul_mod(unsigned long long a, unsigned long long b,
+                                  unsigned long long mod) {
+    return (unsigned long long)((unsigned __int128)a * b % mod);
+}
+
+static void run_chunk(Chunk *c, long long mod) {
+    c->started_ns = now_ns();
+    unsigned long long local_result = 1 % mod;
+    for (long long i = c->start; i <= c->end; i++) {
+        local_result = mul_mod(local_result, (unsigned long long)(i % mod), mod);
+    }
+    c->partial = (long long)local_result;
+    c->finished_ns = now_ns();
+}
+
+// поток пула живёт всю программу и обрабатывает блок за блоком
+void *batch_worker(void *arg) {
+    Batch *b = (Batch *)arg;
+    while (1) {
+        pthread_barrier_wait(&b->start);
+        if (b->done) break;
+
+        int item;
+        while ((item = __atomic_fetch_add(&b->next_item, 1, __ATOMIC_RELAXED)) <
+               b->items_num) {
+            for (int c = b->items[item].first_chunk; c <= b->items[item].last_chunk; c++) {
+                Chunk *chunk = &b->chunks[c];
+                run_chunk(chunk, b->queries[chunk->query].mod);
+            }
+        }
+        pthread_barrier_wait(&b->finish);
+    }
+    return NULL;
+}
+
+// Большие запросы (k >= split) режутся на pnum кусков, маленькие пакуются
+// в одну единицу работы, пока суммарный k не дорастёт до split.
+static void plan_block(Batch *b, int queries_num, int pnum, long long split) {
+    int chunks_num = 0;
+    int items_num = 0;
+    long long packed = 0;
+
+    for (int q = 0; q < queries_num; q++) {
+        Query *query = &b->queries[q];
+        int parts = query->k >= split ? pnum : 1;
+        if (parts > query->k) parts = query->k > 0 ? (int)query->k : 1;
+
+        query->first_chunk = chunks_num;
+        query->chunks = parts;
+
+        long long step = query->k / parts;
+        long long current = 1;
+        for (int p = 0; p < parts; p++) {
+            Chunk *c = &b->chunks[chunks_num];
+            c->query = q;
+            c->start = current;
+            c->end = (p == parts - 1) ? query->k : current + step - 1;
+            current = c->end + 1;
+
+            if (parts > 1) {
+                b->items[items_num].first_chunk = chunks_num;
+                b->items[items_num].last_chunk = chunks_num;
+                items_num++;
+                packed = 0;
+            } else if (packed > 0 && packed + query->k <= split) {
+                b->items[items_num - 1].last_chunk = chunks_num;
+                packed += query->k;
+            } else {
+                b->items[items_num].first_chunk = chunks_num;
+                b->items[items_num].last_chunk = chunks_num;
+                items_num++;
+                packed = query->k > 0 ? query->k : 1;
+            }
+            chunks_num++;
+        }
+    }
+
+    b->items_num = items_num;
+    b->next_item = 0;
+}
+
+static int read_query(FILE *in, Query *q) {
+    while (1) {
+        int n = fscanf(in, "%lld %lld", &q->k, &q->mod);
+        if (n == 2) {
+            if (q->k >= 0 && q->mod > 0) return 1;
+            fprintf(stderr, "Skipping invalid query: %lld %lld\n", q->k, q->mod);
+            continue;
+        }
+        if (n == EOF) return 0;
+        // мусор в строке - пропускаем до конца строки
+        int ch;
+        while ((ch = fgetc(in)) != EOF && ch != '\n') {
+        }
+        if (ch == EOF) return 0;
+    }
+}
+
+int run_batch(const char *path, int pnum, long long split) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror("Cannot open batch file");
+        return 1;
+    }
+
+    Batch b;
+    memset(&b, 0, sizeof(b));
+    b.queries = malloc(sizeof(Query) * BATCH_BLOCK);
+    b.chunks = malloc(sizeof(Chunk) * BATCH_BLOCK * pnum);
+    b.items = malloc(sizeof(WorkItem) * BATCH_BLOCK * pnum);
+    pthread_barrier_init(&b.start, NULL, pnum + 1);
+    pthread_barrier_init(&b.finish, NULL, pnum + 1);
+
+    pthread_t threads[pnum];
+    for (int i = 0; i < pnum; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &b) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    long long total_queries = 0;
+    long long batch_start = now_ns();
+    while (1) {
+        int queries_num = 0;
+        while (queries_num < BATCH_BLOCK && read_query(in, &b.queries[queries_num]))
+            queries_num++;
+        if (queries_num == 0) break;
+
+        plan_block(&b, queries_num, pnum, split);
+        pthread_barrier_wait(&b.start);
+        pthread_barrier_wait(&b.finish);
+
+        // после барьера все слоты заполнены - собираем без блокировок
+        for (int q = 0; q < queries_num; q++) {
+            Query *query = &b.queries[q];
+            long long res = 1 % query->mod;
+            long long first = -1, last = 0;
+            for (int c = query->first_chunk; c < query->first_chunk + query->chunks; c++) {
+                Chunk *chunk = &b.chunks[c];
+                res = (long long)mul_mod(res, chunk->partial, query->mod);
+                if (first < 0 || chunk->started_ns < first) first = chunk->started_ns;
+                if (chunk->finished_ns > last) last = chunk->finished_ns;
+            }
+            printf("Factorial(%lld) mod %lld = %lld (latency %.1f us)\n", query->k,
+                   query->mod, res, (last - first) / 1000.0);
+        }
+        total_queries += queries_num;
+    }
+    double elapsed_ms = (now_ns() - batch_start) / 1e6;
+
+    b.done = 1;
+    pthread_barrier_wait(&b.start);
+    for (int i = 0; i < pnum; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    fprintf(stderr, "Batch: %lld queries in %.1f ms\n", total_queries, elapsed_ms);
+
+    pthread_barrier_destroy(&b.start);
+    pthread_barrier_destroy(&b.finish);
+    free(b.queries);
+    free(b.chunks);
+    free(b.items);
+    if (in != stdin) fclose(in);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int k = -1, pnum = -1, mod = -1;
+    const char *batch_path = NULL;
+    long long split = 100000;
     int option_index = 0;
     static struct option long_options[] = {
         {"pnum", required_argument, 0, 0},
         {"mod", required_argument, 0, 0},
+        {"batch", required_argument, 0, 0},
+        {"split", required_argument, 0, 0},
         {0, 0, 0, 0}
     };
 
@@ -50,13 +267,26 @@ int main(int argc, char *argv[]) {
                     pnum = atoi(optarg);
                 else if (option_index == 1)
                     mod = atoi(optarg);
+                else if (option_index == 2)
+                    batch_path = optarg;
+                else if (option_index == 3)
+                    split = atoll(optarg);
                 break;
             default:
                 printf("Usage: %s -k <num> --pnum=<threads> --mod=<mod>\n", argv[0]);
+                printf("       %s --batch=<file|-> --pnum=<threads> [--split=<k>]\n", argv[0]);
                 return 1;
         }
     }
 
+    if (batch_path) {
+        if (pnum <= 0 || split <= 0) {
+            printf("Usage: %s --batch=<file|-> --pnum=<threads> [--split=<k>]\n", argv[0]);
+            return 1;
+        }
+        return run_batch(batch_path, pnum, split);
+    }
+
     if (k <= 0 || pnum <= 0 || mod <= 0) {
         printf("Invalid arguments!\n");
         printf("Usage: %s -k <num> --pnum=<threads> --mod=<mod>\n", argv[0]);
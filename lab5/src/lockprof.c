@@ -0,0 +1,432 @@
+// Профилировщик блокировок pthread_mutex, подключаемый через LD_PRELOAD:
+//
+//   LD_PRELOAD=./liblockprof.so ./factorial_parallel -k 100000 --pnum=4 --mod=7
+//
+// Для каждого мьютекса считает число захватов, число конфликтов (захват не
+// удался с первой попытки), гистограммы времени ожидания и удержания, а также
+// наблюдаемые рёбра порядка захвата (A удерживается, берётся B). Отчёт
+// печатается при завершении процесса и по сигналу (по умолчанию SIGUSR2).
+//
+// Переменные окружения:
+//   LOCKPROF_OUT    - файл для отчёта (по умолчанию stderr)
+//   LOCKPROF_SIGNAL - номер сигнала для отчёта (0 - не ставить обработчик)
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LP_MUTEX_SLOTS 1024
+#define LP_EDGE_SLOTS 4096
+#define LP_BUCKETS 32
+#define LP_MAX_HELD 16
+
+#define LP_TLS __thread __attribute__((tls_model("initial-exec")))
+
+typedef struct {
+    uintptr_t key;              // адрес мьютекса, 0 - слот свободен
+    uint64_t acquires;
+    uint64_t contended;
+    uint64_t waiting;           // потоков, ждущих прямо сейчас
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_wait_ns;
+    uint64_t max_hold_ns;
+    uint64_t wait_hist[LP_BUCKETS];
+    uint64_t hold_hist[LP_BUCKETS];
+} MutexStat;
+
+typedef struct {
+    uintptr_t from;
+    uintptr_t to;               // 0 - слот свободен
+    uint64_t count;
+} LockEdge;
+
+typedef struct {
+    pthread_mutex_t *mutex;
+    MutexStat *stat;
+    uint64_t since;
+} HeldLock;
+
+static int (*real_lock)(pthread_mutex_t *);
+static int (*real_trylock)(pthread_mutex_t *);
+static int (*real_unlock)(pthread_mutex_t *);
+static int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int (*real_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *,
+                                  const struct timespec *);
+
+static MutexStat mutexes[LP_MUTEX_SLOTS];
+static MutexStat overflow_stat;
+static LockEdge edges[LP_EDGE_SLOTS];
+static uint64_t edges_dropped;
+static int out_fd = 2;
+
+static LP_TLS HeldLock held[LP_MAX_HELD];
+static LP_TLS int held_num;
+
+#define ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// корзина i содержит значения [2^i, 2^(i+1)) нс, корзина 0 - ещё и ноль
+static int bucket_of(uint64_t ns) {
+    if (ns == 0) return 0;
+    int b = 63 - __builtin_clzll(ns);
+    return b < LP_BUCKETS ? b : LP_BUCKETS - 1;
+}
+
+static void update_max(uint64_t *p, uint64_t v) {
+    uint64_t cur = LOAD(p);
+    while (v > cur &&
+           !__atomic_compare_exchange_n(p, &cur, v, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint64_t hash_ptr(uintptr_t p) {
+    return (uint64_t)(p >> 3) * 0x9E3779B97F4A7C15ull;
+}
+
+static MutexStat *stat_for(pthread_mutex_t *m) {
+    uintptr_t key = (uintptr_t)m;
+    uint64_t h = hash_ptr(key);
+    for (int probe = 0; probe < LP_MUTEX_SLOTS; probe++) {
+        MutexStat *s = &mutexes[(h + probe) % LP_MUTEX_SLOTS];
+        uintptr_t cur = LOAD(&s->key);
+        if (cur == key) return s;
+        if (cur == 0) {
+            uintptr_t expected = 0;
+            if (__atomic_compare_exchange_n(&s->key, &expected, key, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                expected == key)
+                return s;
+        }
+    }
+    return &overflow_stat;
+}
+
+static void record_edge(uintptr_t from, uintptr_t to) {
+    uint64_t h = hash_ptr(from) ^ (hash_ptr(to) >> 17);
+    for (int probe = 0; probe < 64; probe++) {
+        LockEdge *e = &edges[(h + probe) % LP_EDGE_SLOTS];
+        uintptr_t cur = LOAD(&e->to);
+        if (cur == 0) {
+            uintptr_t expected = 0;
+            if (__atomic_compare_exchange_n(&e->to, &expected, to, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&e->from, from, __ATOMIC_RELEASE);
+                ADD(&e->count, 1);
+                return;
+            }
+            cur = expected;
+        }
+        // from публикуется после to - короткое окно, когда from ещё 0
+        uintptr_t cur_from;
+        while ((cur_from = __atomic_load_n(&e->from, __ATOMIC_ACQUIRE)) == 0) {
+        }
+        if (cur == to && cur_from == from) {
+            ADD(&e->count, 1);
+            return;
+        }
+    }
+    ADD(&edges_dropped, 1);
+}
+
+static void resolve(void) {
+    real_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    real_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    real_unlock = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+    real_cond_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
+    real_cond_timedwait = dlsym(RTLD_NEXT, "pthread_cond_timedwait");
+}
+
+// рёбра пишутся до попытки захвата, чтобы зависший в дедлоке поток
+// тоже успел оставить след в графе порядка
+static void record_order(pthread_mutex_t *m) {
+    for (int i = 0; i < held_num && i < LP_MAX_HELD; i++) {
+        if (held[i].mutex != m) record_edge((uintptr_t)held[i].mutex, (uintptr_t)m);
+    }
+}
+
+static void on_acquired(pthread_mutex_t *m, MutexStat *s, uint64_t t) {
+    if (held_num < LP_MAX_HELD) {
+        held[held_num].mutex = m;
+        held[held_num].stat = s;
+        held[held_num].since = t;
+    }
+    held_num++;
+}
+
+static void on_release(pthread_mutex_t *m) {
+    int top = held_num < LP_MAX_HELD ? held_num : LP_MAX_HELD;
+    for (int i = top - 1; i >= 0; i--) {
+        if (held[i].mutex != m) continue;
+        uint64_t hold = now_ns() - held[i].since;
+        MutexStat *s = held[i].stat;
+        ADD(&s->hold_ns, hold);
+        ADD(&s->hold_hist[bucket_of(hold)], 1);
+        update_max(&s->max_hold_ns, hold);
+        memmove(&held[i], &held[i + 1], (top - i - 1) * sizeof(HeldLock));
+        held_num--;
+        return;
+    }
+    // отпускается мьютекс, захват которого мы не видели (или стек переполнен)
+    if (held_num > LP_MAX_HELD) held_num--;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *m) {
+    if (!real_lock) resolve();
+
+    MutexStat *s = stat_for(m);
+    ADD(&s->acquires, 1);
+    record_order(m);
+
+    int err = real_trylock(m);
+    if (err == 0) {
+        ADD(&s->wait_hist[0], 1);
+        on_acquired(m, s, now_ns());
+        return 0;
+    }
+
+    ADD(&s->contended, 1);
+    ADD(&s->waiting, 1);
+    uint64_t start = now_ns();
+    err = real_lock(m);
+    uint64_t t = now_ns();
+    ADD(&s->waiting, (uint64_t)-1);
+
+    uint64_t wait = t - start;
+    ADD(&s->wait_ns, wait);
+    ADD(&s->wait_hist[bucket_of(wait)], 1);
+    update_max(&s->max_wait_ns, wait);
+    if (err == 0) on_acquired(m, s, t);
+    return err;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *m) {
+    if (!real_trylock) resolve();
+
+    int err = real_trylock(m);
+    if (err == 0) {
+        MutexStat *s = stat_for(m);
+        ADD(&s->acquires, 1);
+        ADD(&s->wait_hist[0], 1);
+        record_order(m);
+        on_acquired(m, s, now_ns());
+    }
+    return err;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *m) {
+    if (!real_unlock) resolve();
+
+    on_release(m);
+    return real_unlock(m);
+}
+
+// cond_wait отпускает и снова берёт мьютекс внутри glibc, минуя обёртки выше
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m) {
+    if (!real_cond_wait) resolve();
+
+    on_release(m);
+    int err = real_cond_wait(c, m);
+    on_acquired(m, stat_for(m), now_ns());
+    return err;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                           const struct timespec *abstime) {
+    if (!real_cond_timedwait) resolve();
+
+    on_release(m);
+    int err = real_cond_timedwait(c, m, abstime);
+    on_acquired(m, stat_for(m), now_ns());
+    return err;
+}
+
+// Отчёт собирается в статическом буфере и пишется одним write().
+// Буфер общий для потока отчётов и деструктора, поэтому под мьютексом.
+static char report_buf[1 << 16];
+static size_t report_len;
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int report_pipe[2] = {-1, -1};
+
+static void emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char *fmt, ...) {
+    va_list ap;
+    if (report_len >= sizeof(report_buf)) return;
+    va_start(ap, fmt);
+    int n = vsnprintf(report_buf + report_len, sizeof(report_buf) - report_len,
+                      fmt, ap);
+    va_end(ap);
+    if (n > 0) report_len += (size_t)n;
+    if (report_len > sizeof(report_buf)) report_len = sizeof(report_buf);
+}
+
+static const char *name_of(uintptr_t p, char *buf, size_t size) {
+    Dl_info info;
+    if (dladdr((void *)p, &info) && info.dli_sname &&
+        (uintptr_t)info.dli_saddr == p) {
+        snprintf(buf, size, "%s", info.dli_sname);
+    } else {
+        snprintf(buf, size, "%#lx", (unsigned long)p);
+    }
+    return buf;
+}
+
+// верхняя граница корзины, в которую попадает квантиль q
+static uint64_t hist_quantile(const uint64_t *hist, double q) {
+    uint64_t total = 0;
+    for (int i = 0; i < LP_BUCKETS; i++) total += LOAD(&hist[i]);
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)total);
+    uint64_t seen = 0;
+    for (int i = 0; i < LP_BUCKETS; i++) {
+        seen += LOAD(&hist[i]);
+        if (seen > rank) return 2ull << i;
+    }
+    return 2ull << (LP_BUCKETS - 1);
+}
+
+static void emit_hist(const char *label, const uint64_t *hist) {
+    emit("    %s:", label);
+    for (int i = 0; i < LP_BUCKETS; i++) {
+        uint64_t n = LOAD(&hist[i]);
+        if (n) emit(" <%llu:%llu", 2ull << i, (unsigned long long)n);
+    }
+    emit("\n");
+}
+
+static void emit_stat(const char *name, MutexStat *s) {
+    uint64_t acquires = LOAD(&s->acquires);
+    uint64_t contended = LOAD(&s->contended);
+    emit("%s: acquires=%llu contended=%llu (%.1f%%) waiting=%llu\n", name,
+         (unsigned long long)acquires, (unsigned long long)contended,
+         acquires ? 100.0 * contended / acquires : 0.0,
+         (unsigned long long)LOAD(&s->waiting));
+    emit("    wait: total=%lluns max=%lluns p50<%lluns p99<%lluns\n",
+         (unsigned long long)LOAD(&s->wait_ns),
+         (unsigned long long)LOAD(&s->max_wait_ns),
+         (unsigned long long)hist_quantile(s->wait_hist, 0.5),
+         (unsigned long long)hist_quantile(s->wait_hist, 0.99));
+    emit("    hold: total=%lluns max=%lluns p50<%lluns p99<%lluns\n",
+         (unsigned long long)LOAD(&s->hold_ns),
+         (unsigned long long)LOAD(&s->max_hold_ns),
+         (unsigned long long)hist_quantile(s->hold_hist, 0.5),
+         (unsigned long long)hist_quantile(s->hold_hist, 0.99));
+    emit_hist("wait hist (ns)", s->wait_hist);
+    emit_hist("hold hist (ns)", s->hold_hist);
+}
+
+static int has_edge(uintptr_t from, uintptr_t to) {
+    for (int i = 0; i < LP_EDGE_SLOTS; i++) {
+        if (LOAD(&edges[i].to) == to && LOAD(&edges[i].from) == from) return 1;
+    }
+    return 0;
+}
+
+static void lockprof_report(void) {
+    char a[128], b[128];
+    // настоящий lock: свой мьютекс профилировщику учитывать незачем
+    real_lock(&report_mutex);
+    report_len = 0;
+
+    emit("=== lockprof report (pid %d) ===\n", (int)getpid());
+    for (int i = 0; i < LP_MUTEX_SLOTS; i++) {
+        uintptr_t key = LOAD(&mutexes[i].key);
+        if (key) emit_stat(name_of(key, a, sizeof(a)), &mutexes[i]);
+    }
+    if (LOAD(&overflow_stat.acquires)) emit_stat("<overflow>", &overflow_stat);
+
+    emit("lock order edges (held -> acquired):\n");
+    for (int i = 0; i < LP_EDGE_SLOTS; i++) {
+        uintptr_t to = LOAD(&edges[i].to);
+        uintptr_t from = LOAD(&edges[i].from);
+        if (!to || !from) continue;
+        int inverted = has_edge(to, from);
+        emit("  %s -> %s x%llu%s\n", name_of(from, a, sizeof(a)),
+             name_of(to, b, sizeof(b)),
+             (unsigned long long)LOAD(&edges[i].count),
+             inverted ? "  [ORDER INVERSION: possible deadlock]" : "");
+    }
+    if (LOAD(&edges_dropped))
+        emit("  (%llu edges dropped, table full)\n",
+             (unsigned long long)LOAD(&edges_dropped));
+
+    const char *p = report_buf;
+    size_t left = report_len;
+    while (left > 0) {
+        ssize_t n = write(out_fd, p, left);
+        if (n <= 0) break;
+        p += n;
+        left -= (size_t)n;
+    }
+    real_unlock(&report_mutex);
+}
+
+// vsnprintf, dladdr и обход таблиц в обработчике сигнала небезопасны:
+// обработчик только будит поток отчётов через self-pipe
+static void on_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    char c = 0;
+    ssize_t n = write(report_pipe[1], &c, 1);  // полный канал - отчёт и так будет
+    (void)n;
+    errno = saved;
+}
+
+static void *report_thread(void *arg) {
+    (void)arg;
+    char buf[64];
+    while (1) {
+        ssize_t n = read(report_pipe[0], buf, sizeof(buf));
+        if (n > 0) {
+            lockprof_report();
+        } else if (n == 0 || errno != EINTR) {
+            return NULL;
+        }
+    }
+}
+
+__attribute__((constructor)) static void lockprof_init(void) {
+    resolve();
+
+    const char *path = getenv("LOCKPROF_OUT");
+    if (path && *path) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0) out_fd = fd;
+    }
+
+    int sig = SIGUSR2;
+    const char *sig_env = getenv("LOCKPROF_SIGNAL");
+    if (sig_env) sig = atoi(sig_env);
+    pthread_t thread;
+    if (sig > 0 && pipe2(report_pipe, O_CLOEXEC) == 0 &&
+        fcntl(report_pipe[1], F_SETFL, O_NONBLOCK) == 0 &&
+        pthread_create(&thread, NULL, report_thread, NULL) == 0) {
+        pthread_detach(thread);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, NULL);
+    }
+}
+
+__attribute__((destructor)) static void lockprof_fini(void) {
+    lockprof_report();
+}
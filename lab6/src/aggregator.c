@@ -0,0 +1,211 @@
+#include "aggregator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define CONNECT_TIMEOUT_NS 2000000000ULL
+/* a piece is tried on this many servers before the request fails */
+#define MAX_ATTEMPTS 3
+/* ranges are not cut into pieces smaller than this */
+#define MIN_PIECE 4096
+
+struct Fanout {
+  struct Aggregator *agg;
+  struct FactorialRequest req;
+  uint64_t results[MAX_MODS];
+  int pending;
+  bool failed;
+  FanoutDoneFn cb;
+  void *ctx;
+};
+
+struct Piece {
+  struct Fanout *fanout;
+  uint64_t begin;
+  uint64_t end;
+  int attempts;
+};
+
+static void OnPiece(void *ctx, uint64_t id, int status,
+                    const uint64_t *results, uint32_t results_num);
+
+static int NextReady(struct Aggregator *agg) {
+  for (int tries = 0; tries < agg->net.servers_num; tries++) {
+    int server = agg->next_server;
+    agg->next_server = (agg->next_server + 1) % agg->net.servers_num;
+    if (agg->net.servers[server].state == SERVER_READY)
+      return server;
+  }
+  return -1;
+}
+
+static bool SubmitPiece(struct Piece *piece, int server) {
+  struct Aggregator *agg = piece->fanout->agg;
+  struct FactorialRequest req = piece->fanout->req;
+  req.begin = piece->begin;
+  req.end = piece->end;
+  agg->pieces++;
+  return DispatcherSubmit(&agg->net, server, &req, agg->timeout_ns, OnPiece,
+                          piece) != 0;
+}
+
+static void FinishPiece(struct Fanout *fanout) {
+  if (--fanout->pending > 0)
+    return;
+  fanout->cb(fanout->ctx, !fanout->failed, fanout->results,
+             fanout->req.mods_num);
+  free(fanout);
+}
+
+static void OnPiece(void *ctx, uint64_t id, int status,
+                    const uint64_t *results, uint32_t results_num) {
+  (void)id;
+  struct Piece *piece = (struct Piece *)ctx;
+  struct Fanout *fanout = piece->fanout;
+  struct Aggregator *agg = fanout->agg;
+
+  if (status == DISPATCH_OK && results_num == fanout->req.mods_num) {
+    for (uint32_t j = 0; j < results_num; j++)
+      fanout->results[j] =
+          MulModulo(fanout->results[j], results[j], fanout->req.mods[j]);
+    free(piece);
+    FinishPiece(fanout);
+    return;
+  }
+
+  if (++piece->attempts < MAX_ATTEMPTS) {
+    int server = NextReady(agg);
+    if (server >= 0 && SubmitPiece(piece, server)) {
+      agg->retries++;
+      return;
+    }
+  }
+  fprintf(stderr, "Piece [%lu, %lu] failed after %d attempts\n", piece->begin,
+          piece->end, piece->attempts);
+  fanout->failed = true;
+  agg->failures++;
+  free(piece);
+  FinishPiece(fanout);
+}
+
+int AggregatorInit(struct Aggregator *agg, const char *path,
+                   uint64_t timeout_ns) {
+  memset(agg, 0, sizeof(*agg));
+  agg->timeout_ns = timeout_ns;
+  if (DispatcherInit(&agg->net, CONNECT_TIMEOUT_NS) < 0)
+    return -1;
+  /* leaves that restart rejoin on their own */
+  DispatcherEnableRecovery(&agg->net);
+  if (DispatcherAddServersFromFile(&agg->net, path) <= 0) {
+    fprintf(stderr, "No downstream servers in %s\n", path);
+    return -1;
+  }
+
+  for (int i = 0; i < agg->net.servers_num; i++)
+    DispatcherConnect(&agg->net, i);
+  int ready = 0;
+  int pending = agg->net.servers_num;
+  while (pending > 0) {
+    DispatcherPoll(&agg->net, 10);
+    ready = pending = 0;
+    for (int i = 0; i < agg->net.servers_num; i++) {
+      enum ServerConnState state = agg->net.servers[i].state;
+      ready += state == SERVER_READY;
+      pending += state == SERVER_CONNECTING || state == SERVER_HANDSHAKE;
+    }
+  }
+  if (ready == 0) {
+    fprintf(stderr, "No downstream server could be reached\n");
+    return -1;
+  }
+  return 0;
+}
+
+int AggregatorFd(const struct Aggregator *agg) { return agg->net.epoll_fd; }
+
+void AggregatorPoll(struct Aggregator *agg) { DispatcherPoll(&agg->net, 0); }
+
+uint32_t AggregatorThreads(const struct Aggregator *agg) {
+  uint32_t tnum = 0;
+  for (int i = 0; i < agg->net.servers_num; i++)
+    if (agg->net.servers[i].state == SERVER_READY)
+      tnum += agg->net.servers[i].tnum;
+  return tnum;
+}
+
+uint64_t AggregatorRate(const struct Aggregator *agg) {
+  uint64_t rate = 0;
+  for (int i = 0; i < agg->net.servers_num; i++)
+    if (agg->net.servers[i].state == SERVER_READY)
+      rate += agg->net.servers[i].mults_per_sec;
+  return rate;
+}
+
+bool AggregatorSubmit(struct Aggregator *agg,
+                      const struct FactorialRequest *req, FanoutDoneFn cb,
+                      void *ctx) {
+  uint64_t range = req->begin <= req->end ? req->end - req->begin + 1 : 0;
+  int ready = 0;
+  for (int i = 0; i < agg->net.servers_num; i++)
+    ready += agg->net.servers[i].state == SERVER_READY;
+  if (ready == 0)
+    return false;
+  uint64_t by_size = range / MIN_PIECE ? range / MIN_PIECE : 1;
+  int pieces_num = by_size < (uint64_t)ready ? (int)by_size : ready;
+
+  int servers[pieces_num];
+  double weights[pieces_num];
+  double total = 0;
+  for (int i = 0; i < pieces_num; i++) {
+    servers[i] = NextReady(agg);
+    uint64_t rate = agg->net.servers[servers[i]].mults_per_sec;
+    weights[i] = rate ? (double)rate : 1.0;
+    total += weights[i];
+  }
+
+  struct Fanout *fanout = malloc(sizeof(struct Fanout));
+  fanout->agg = agg;
+  fanout->req = *req;
+  for (uint32_t j = 0; j < req->mods_num; j++)
+    fanout->results[j] = 1 % req->mods[j];
+  fanout->failed = false;
+  fanout->cb = cb;
+  fanout->ctx = ctx;
+  /* the extra count keeps cb from running before all pieces are out */
+  fanout->pending = pieces_num + 1;
+  agg->fanouts++;
+
+  uint64_t current = req->begin;
+  uint64_t remaining = range;
+  for (int i = 0; i < pieces_num; i++) {
+    struct Piece *piece = malloc(sizeof(struct Piece));
+    piece->fanout = fanout;
+    piece->attempts = 0;
+    piece->begin = current;
+    if (i == pieces_num - 1) {
+      piece->end = req->end;
+    } else {
+      /* at least one factor each, leaving one for every later piece */
+      uint64_t len = (uint64_t)(range * (weights[i] / total));
+      uint64_t max_len = remaining - (uint64_t)(pieces_num - 1 - i);
+      len = len < 1 ? 1 : (len > max_len ? max_len : len);
+      piece->end = current + len - 1;
+      remaining -= len;
+    }
+    current = piece->end + 1;
+    if (!SubmitPiece(piece, servers[i])) {
+      fanout->failed = true;
+      free(piece);
+      fanout->pending--;
+    }
+  }
+
+  if (--fanout->pending == 0) {
+    free(fanout);
+    return false;
+  }
+  return true;
+}
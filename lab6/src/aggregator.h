@@ -0,0 +1,49 @@
+#ifndef AGGREGATOR_H
+#define AGGREGATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dispatcher.h"
+#include "protocol.h"
+
+/* Aggregator role of the server: a request is split across downstream
+ * servers (which may be aggregators themselves) in proportion to their
+ * advertised capacity, and the partial products are multiplied back
+ * together. A piece whose server fails or times out is retried on the
+ * next ready server. Runs on the server's event loop thread. */
+
+typedef void (*FanoutDoneFn)(void *ctx, bool ok, const uint64_t *results,
+                             size_t results_num);
+
+struct Aggregator {
+  struct Dispatcher net;
+  int next_server;
+  uint64_t timeout_ns;
+
+  uint64_t fanouts;
+  uint64_t pieces;
+  uint64_t retries;
+  uint64_t failures;
+};
+
+/* Connects to every server in path and waits for the handshakes. Returns
+ * -1 if the file can't be read or no downstream server is reachable. */
+int AggregatorInit(struct Aggregator *agg, const char *path,
+                   uint64_t timeout_ns);
+/* Readable whenever AggregatorPoll has work to do. */
+int AggregatorFd(const struct Aggregator *agg);
+void AggregatorPoll(struct Aggregator *agg);
+
+/* Totals over ready downstream servers, advertised upstream in OP_HELLO. */
+uint32_t AggregatorThreads(const struct Aggregator *agg);
+uint64_t AggregatorRate(const struct Aggregator *agg);
+
+/* Starts a fan-out; cb runs from a later AggregatorPoll. Returns false
+ * (and never calls cb) if no downstream server is ready. */
+bool AggregatorSubmit(struct Aggregator *agg,
+                      const struct FactorialRequest *req, FanoutDoneFn cb,
+                      void *ctx);
+
+#endif
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Starts a local cluster of servers, writes a matching bench_servers.txt,
+# drives it with loadgen and shuts everything down again.
+#
+# Usage: ./bench.sh SERVERS TNUM [loadgen options...]
+# BENCH_PORT (default 21000) is the first port; servers use consecutive ones.
+
+servers=${1:-4}
+tnum=${2:-2}
+shift 2
+base_port=${BENCH_PORT:-21000}
+logs=$(mktemp -d)
+pids=()
+
+cleanup() {
+    if [ ${#pids[@]} -gt 0 ]; then
+        kill "${pids[@]}" 2>/dev/null
+        wait "${pids[@]}" 2>/dev/null
+    fi
+    rm -rf "$logs"
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+: > bench_servers.txt
+for ((i = 0; i < servers; i++)); do
+    port=$((base_port + i))
+    ./server --port $port --tnum $tnum > "$logs/server$i.log" 2>&1 &
+    pids+=($!)
+    echo "127.0.0.1:$port" >> bench_servers.txt
+done
+
+# a server listens only after measuring its capacity, so wait for the ports
+for ((i = 0; i < servers; i++)); do
+    port=$((base_port + i))
+    for ((try = 0; try < 100; try++)); do
+        (echo > /dev/tcp/127.0.0.1/$port) 2>/dev/null && break
+        if ! kill -0 ${pids[$i]} 2>/dev/null; then
+            echo "server on port $port exited:" >&2
+            cat "$logs/server$i.log" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+done
+
+echo "$servers servers x $tnum threads on ports $base_port-$((base_port + servers - 1))"
+# run in the background so a signal reaches the trap without waiting for it
+./loadgen --servers bench_servers.txt "$@" &
+pids+=($!)
+wait $!
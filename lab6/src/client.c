@@ -6,26 +6,12 @@
 
 #include <errno.h>
 #include <getopt.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <netinet/ip.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <pthread.h>
+#include <math.h>
 #include "common.h"
-
-struct Server {
-  char ip[255];
-  int port;
-};
-
-typedef struct {
-  struct Server server;
-  uint64_t begin;
-  uint64_t end;
-  uint64_t mod;
-  uint64_t result;
-} ServerTask;
+#include "dispatcher.h"
+#include "protocol.h"
+#include "reduce.h"
+#include "stats.h"
 
 bool ConvertStringToUI64(const char *str, uint64_t *val) {
   char *end = NULL;
@@ -42,65 +28,388 @@ bool ConvertStringToUI64(const char *str, uint64_t *val) {
   return true;
 }
 
-void *RunServerTask(void *args) {
-  ServerTask *task = (ServerTask *)args;
-  struct hostent *hostname = gethostbyname(task->server.ip);
-  if (hostname == NULL) {
-    fprintf(stderr, "gethostbyname failed with %s\n", task->server.ip);
-    pthread_exit(NULL);
+/* Parses a comma-separated list of moduli, e.g. "7,11,13". */
+int ParseModsList(const char *str, uint64_t *mods) {
+  int mods_num = 0;
+  const char *p = str;
+  while (*p) {
+    if (mods_num == MAX_MODS) {
+      fprintf(stderr, "At most %d moduli are supported\n", MAX_MODS);
+      return -1;
+    }
+    char *end = NULL;
+    errno = 0;
+    unsigned long long m = strtoull(p, &end, 10);
+    if (errno != 0 || end == p || m == 0 || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "Bad moduli list: %s\n", str);
+      return -1;
+    }
+    mods[mods_num++] = m;
+    p = *end == ',' ? end + 1 : end;
   }
+  return mods_num;
+}
+
+enum ChunkState { CHUNK_PENDING, CHUNK_INFLIGHT, CHUNK_DONE };
+
+/* a server that rejected a chunk gets no new ones for this long, so the
+ * chunk goes elsewhere instead of straight back to it */
+#define REJECT_BACKOFF_NS 500000000ULL
 
-  struct sockaddr_in server;
-  server.sin_family = AF_INET;
-  server.sin_port = htons(task->server.port);
-  server.sin_addr.s_addr = *((unsigned long *)hostname->h_addr);
+typedef struct {
+  uint64_t begin;
+  uint64_t end;
+  enum ChunkState state;
+  int copies;          /* requests for this chunk currently outstanding */
+  int owners[2];       /* servers holding those requests, -1 if free */
+  uint64_t ids[2];     /* their request ids */
+  bool hedged;
+  int first_owner;     /* server that got the chunk first */
+  uint64_t first_sent_ns;
+  int rejections;       /* distinct servers that rejected the chunk */
+  bool *rejected_by;    /* indexed by server, rejected_cap entries */
+  int rejected_cap;
+  uint64_t results[MAX_MODS];
+} Chunk;
+
+typedef struct {
+  int window;
+  bool idle;           /* window not full and nothing was left to take */
+  int chunks_won;
+  int hedges_sent;
+  uint64_t assigned;
+  uint64_t backoff_until_ns;
+} ServerLoad;
+
+/* Servers pull chunks as they finish them instead of getting one fixed
+ * range each. Segments are idempotent, so once nothing is left to hand out,
+ * idle servers re-issue chunks still outstanding elsewhere and the first
+ * answer wins. Everything runs on one thread inside DispatcherPoll. */
+typedef struct {
+  struct Dispatcher net;
+  ServerLoad *loads;   /* grows as the servers file gains entries */
+  int loads_cap;
+  Chunk *chunks;
+  int chunks_num;
+  int next_chunk;
+  int hedge_from;      /* chunks below this index are all done */
+  int *retry;          /* chunks given back after a failure or timeout */
+  int retry_num;
+  int done_num;
+  bool finished;
+  bool hedge;
+  int hedges_sent;
+  int hedges_won;
+  int hedges_cancelled;
+  int timeouts;
+  int rejected_chunks; /* chunks rejected by at least one server */
+  bool rejected;       /* a chunk was rejected by every server */
+  uint64_t timeout_ns;
+  const uint64_t *mods;
+  uint32_t mods_num;
+  /* --reduce: chunks are element ranges of this array instead */
+  const struct ReduceRequest *reduce;
+  uint32_t results_num; /* words per answer */
+  struct Histogram chunk_latency;
+} Scheduler;
+
+/* Request context: which chunk went to which server. */
+typedef struct {
+  Scheduler *sched;
+  int chunk;
+  int server;
+} Attempt;
+
+/* Fresh work first, then chunks given back, then (when hedging) the oldest
+ * chunk in flight on another server that has no duplicate yet. Chunks are
+ * handed out in index order, so the oldest is the lowest index. */
+int TakeChunk(Scheduler *s, int server, bool *is_hedge) {
+  *is_hedge = false;
+  if (s->retry_num > 0)
+    return s->retry[--s->retry_num];
+  if (s->next_chunk < s->chunks_num)
+    return s->next_chunk++;
+  if (!s->hedge)
+    return -1;
+
+  while (s->hedge_from < s->chunks_num &&
+         s->chunks[s->hedge_from].state == CHUNK_DONE)
+    s->hedge_from++;
+  for (int c = s->hedge_from; c < s->chunks_num; c++) {
+    Chunk *chunk = &s->chunks[c];
+    if (chunk->state == CHUNK_INFLIGHT && chunk->copies == 1 &&
+        chunk->owners[0] != server && chunk->owners[1] != server) {
+      *is_hedge = true;
+      return c;
+    }
+  }
+  return -1;
+}
 
-  int sck = socket(AF_INET, SOCK_STREAM, 0);
-  if (sck < 0) {
-    fprintf(stderr, "Socket creation failed!\n");
-    pthread_exit(NULL);
+void OnResponse(void *ctx, uint64_t id, int status, const uint64_t *results,
+                uint32_t results_num);
+
+/* Keeps about tnum requests outstanding on a ready server. */
+void FillWindow(Scheduler *s, int server) {
+  ServerLoad *load = &s->loads[server];
+  load->idle = false;
+  if (load->backoff_until_ns != 0) {
+    if (NowNs() < load->backoff_until_ns) {
+      load->idle = true;
+      return;
+    }
+    load->backoff_until_ns = 0;
   }
+  while (!s->finished && s->net.servers[server].state == SERVER_READY &&
+         s->net.servers[server].inflight < load->window) {
+    bool is_hedge;
+    int c = TakeChunk(s, server, &is_hedge);
+    if (c < 0) {
+      load->idle = true;
+      return;
+    }
+    Chunk *chunk = &s->chunks[c];
+    Attempt *attempt = malloc(sizeof(Attempt));
+    attempt->sched = s;
+    attempt->chunk = c;
+    attempt->server = server;
+    uint64_t id;
+    if (s->reduce) {
+      struct ReduceRequest req = *s->reduce;
+      req.offset = chunk->begin;
+      req.length = chunk->end - chunk->begin + 1;
+      id = DispatcherSubmitReduce(&s->net, server, &req, s->timeout_ns,
+                                  OnResponse, attempt);
+    } else {
+      struct FactorialRequest req;
+      req.begin = chunk->begin;
+      req.end = chunk->end;
+      req.mods_num = s->mods_num;
+      req.timeout_ms = 0;
+      memcpy(req.mods, s->mods, sizeof(uint64_t) * s->mods_num);
+      id = DispatcherSubmit(&s->net, server, &req, s->timeout_ns, OnResponse,
+                            attempt);
+    }
+    if (!id) {
+      free(attempt);
+      if (chunk->state == CHUNK_PENDING)
+        s->retry[s->retry_num++] = c;
+      return;
+    }
 
-  if (connect(sck, (struct sockaddr *)&server, sizeof(server)) < 0) {
-    fprintf(stderr, "Connection to %s:%d failed\n", task->server.ip, task->server.port);
-    close(sck);
-    pthread_exit(NULL);
+    chunk->state = CHUNK_INFLIGHT;
+    int slot = chunk->owners[0] < 0 ? 0 : 1;
+    chunk->owners[slot] = server;
+    chunk->ids[slot] = id;
+    chunk->copies++;
+    if (is_hedge) {
+      chunk->hedged = true;
+      s->hedges_sent++;
+      load->hedges_sent++;
+    } else {
+      chunk->first_owner = server;
+      chunk->first_sent_ns = NowNs();
+    }
   }
+}
 
-  char msg[sizeof(uint64_t) * 3];
-  memcpy(msg, &task->begin, sizeof(uint64_t));
-  memcpy(msg + sizeof(uint64_t), &task->end, sizeof(uint64_t));
-  memcpy(msg + 2 * sizeof(uint64_t), &task->mod, sizeof(uint64_t));
+/* Gives servers that ran dry another look after work became available. */
+void WakeIdle(Scheduler *s) {
+  for (int i = 0; i < s->net.servers_num && !s->finished; i++)
+    if (s->loads[i].idle)
+      FillWindow(s, i);
+}
 
-  if (send(sck, msg, sizeof(msg), 0) < 0) {
-    fprintf(stderr, "Send failed\n");
-    close(sck);
-    pthread_exit(NULL);
+/* True when every server still in the running has rejected the chunk.
+ * Failed servers don't count; if none is left, AnyServerLeft decides. */
+bool RejectedEverywhere(Scheduler *s, const Chunk *chunk) {
+  bool any = false;
+  for (int i = 0; i < s->net.servers_num; i++) {
+    struct DispatchServer *ds = &s->net.servers[i];
+    if (ds->state == SERVER_FAILED || ds->removed)
+      continue;
+    if (i >= chunk->rejected_cap || !chunk->rejected_by[i])
+      return false;
+    any = true;
   }
+  return any;
+}
 
-  char response[sizeof(uint64_t)];
-  if (recv(sck, response, sizeof(response), 0) < 0) {
-    fprintf(stderr, "Receive failed\n");
-    close(sck);
-    pthread_exit(NULL);
+/* Ends the run once some chunk has nowhere left to go. Called on every
+ * rejection and whenever a server fails or leaves the servers file. */
+void CheckRejected(Scheduler *s) {
+  for (int c = 0; c < s->chunks_num && s->rejected_chunks > 0 && !s->finished;
+       c++) {
+    Chunk *chunk = &s->chunks[c];
+    if (chunk->state == CHUNK_DONE || chunk->rejections == 0 ||
+        !RejectedEverywhere(s, chunk))
+      continue;
+    fprintf(stderr, "Chunk [%lu, %lu] was rejected by every server\n",
+            chunk->begin, chunk->end);
+    s->rejected = true;
+    s->finished = true;
   }
+}
 
-  memcpy(&task->result, response, sizeof(uint64_t));
-  close(sck);
-  pthread_exit(NULL);
+void NoteRejection(Scheduler *s, Chunk *chunk, int server) {
+  if (server >= chunk->rejected_cap) {
+    int cap = s->loads_cap;
+    chunk->rejected_by = realloc(chunk->rejected_by, cap * sizeof(bool));
+    memset(chunk->rejected_by + chunk->rejected_cap, 0,
+           (cap - chunk->rejected_cap) * sizeof(bool));
+    chunk->rejected_cap = cap;
+  }
+  if (!chunk->rejected_by[server]) {
+    chunk->rejected_by[server] = true;
+    if (chunk->rejections++ == 0)
+      s->rejected_chunks++;
+  }
+}
+
+/* Resumes servers whose backoff after a rejection has run out. */
+void WakeBackedOff(Scheduler *s) {
+  uint64_t now = NowNs();
+  for (int i = 0; i < s->net.servers_num && !s->finished; i++) {
+    uint64_t until = s->loads[i].backoff_until_ns;
+    if (until != 0 && now >= until)
+      FillWindow(s, i);
+  }
+}
+
+void OnResponse(void *ctx, uint64_t id, int status, const uint64_t *results,
+                uint32_t results_num) {
+  (void)id;
+  Attempt *attempt = (Attempt *)ctx;
+  Scheduler *s = attempt->sched;
+  int server = attempt->server;
+  Chunk *chunk = &s->chunks[attempt->chunk];
+  free(attempt);
+
+  chunk->owners[chunk->owners[0] == server ? 0 : 1] = -1;
+  chunk->copies--;
+
+  if (status == DISPATCH_OK && results_num == s->results_num) {
+    if (chunk->state != CHUNK_DONE) {
+      /* first answer wins; a late duplicate is simply dropped */
+      chunk->state = CHUNK_DONE;
+      memcpy(chunk->results, results, sizeof(uint64_t) * s->results_num);
+      HistRecord(&s->chunk_latency, NowNs() - chunk->first_sent_ns);
+      if (chunk->hedged && chunk->first_owner != server)
+        s->hedges_won++;
+      s->loads[server].chunks_won++;
+      s->loads[server].assigned += chunk->end - chunk->begin + 1;
+      if (++s->done_num == s->chunks_num)
+        s->finished = true;
+      /* the losing duplicate would only keep its server busy */
+      if (chunk->copies > 0) {
+        int other = chunk->owners[0] >= 0 ? 0 : 1;
+        int loser = chunk->owners[other];
+        free(DispatcherCancel(&s->net, loser, chunk->ids[other]));
+        chunk->owners[other] = -1;
+        chunk->copies--;
+        s->hedges_cancelled++;
+        FillWindow(s, loser);
+      }
+    }
+    FillWindow(s, server);
+    return;
+  }
+
+  struct DispatchServer *ds = &s->net.servers[server];
+  if (status == DISPATCH_TIMEOUT) {
+    s->timeouts++;
+    fprintf(stderr, "Chunk [%lu, %lu] timed out on %s:%d\n", chunk->begin,
+            chunk->end, ds->host, ds->port);
+  } else if (status != DISPATCH_FAILED) {
+    fprintf(stderr, "Chunk [%lu, %lu] rejected by %s:%d\n", chunk->begin,
+            chunk->end, ds->host, ds->port);
+    /* e.g. a shard that every server is missing, or aggregators that have
+     * lost all their leaves */
+    NoteRejection(s, chunk, server);
+    CheckRejected(s);
+    if (s->finished)
+      return;
+    s->loads[server].backoff_until_ns = NowNs() + REJECT_BACKOFF_NS;
+  }
+  if (chunk->state == CHUNK_INFLIGHT && chunk->copies == 0) {
+    chunk->state = CHUNK_PENDING;
+    s->retry[s->retry_num++] = (int)(chunk - s->chunks);
+  }
+  FillWindow(s, server);
+  WakeIdle(s);
+}
+
+void OnServerAdded(void *ctx, int server) {
+  Scheduler *s = (Scheduler *)ctx;
+  if (server < s->loads_cap)
+    return;
+  int cap = s->loads_cap ? s->loads_cap * 2 : 16;
+  s->loads = realloc(s->loads, cap * sizeof(ServerLoad));
+  memset(s->loads + s->loads_cap, 0,
+         (cap - s->loads_cap) * sizeof(ServerLoad));
+  s->loads_cap = cap;
+}
+
+void OnServerReady(void *ctx, int server) {
+  Scheduler *s = (Scheduler *)ctx;
+  uint32_t tnum = s->net.servers[server].tnum;
+  s->loads[server].window = tnum > 2 ? (int)tnum : 2;
+  FillWindow(s, server);
+}
+
+void OnServerFailed(void *ctx, int server) {
+  Scheduler *s = (Scheduler *)ctx;
+  s->loads[server].idle = false;
+  /* the server may have been the last one a rejected chunk could go to;
+   * servers dropped from the file are failed too */
+  CheckRejected(s);
+}
+
+/* A failed server comes back after a backoff, so only give up once none
+ * has been ready for as long as a chunk may take. */
+bool AnyServerLeft(Scheduler *s, uint64_t *last_ready_ns) {
+  uint64_t now = NowNs();
+  bool waiting = false;
+  for (int i = 0; i < s->net.servers_num; i++) {
+    struct DispatchServer *ds = &s->net.servers[i];
+    if (ds->state == SERVER_READY) {
+      *last_ready_ns = now;
+      return true;
+    }
+    waiting = waiting || ds->state != SERVER_FAILED || ds->retry_at_ns != 0;
+  }
+  return waiting && now - *last_ready_ns < s->timeout_ns;
 }
 
 int main(int argc, char **argv) {
   uint64_t k = -1;
   uint64_t mod = -1;
   char servers_path[255] = {'\0'};
+  uint64_t mods[MAX_MODS];
+  int mods_num = 0;
+  int chunks = 16;
+  bool hedge = true;
+  int timeout_ms = 30000;
+  int connect_timeout_ms = 500;
+  struct ReduceRequest reduce;
+  memset(&reduce, 0, sizeof(reduce));
+  reduce.seed = 1;
+  uint64_t length = -1;
 
   while (true) {
-    int current_optind = optind ? optind : 1;
-
     static struct option options[] = {{"k", required_argument, 0, 0},
                                       {"mod", required_argument, 0, 0},
                                       {"servers", required_argument, 0, 0},
+                                      {"mods", required_argument, 0, 0},
+                                      {"chunks", required_argument, 0, 0},
+                                      {"no-hedge", no_argument, 0, 0},
+                                      {"timeout-ms", required_argument, 0, 0},
+                                      {"connect-timeout-ms", required_argument,
+                                       0, 0},
+                                      {"reduce", required_argument, 0, 0},
+                                      {"length", required_argument, 0, 0},
+                                      {"seed", required_argument, 0, 0},
+                                      {"shard", required_argument, 0, 0},
                                       {0, 0, 0, 0}};
 
     int option_index = 0;
@@ -121,6 +430,48 @@ int main(int argc, char **argv) {
       case 2:
         memcpy(servers_path, optarg, strlen(optarg));
         break;
+      case 3:
+        mods_num = ParseModsList(optarg, mods);
+        if (mods_num < 0)
+          return 1;
+        break;
+      case 4:
+        chunks = atoi(optarg);
+        break;
+      case 5:
+        hedge = false;
+        break;
+      case 6:
+        timeout_ms = atoi(optarg);
+        break;
+      case 7:
+        connect_timeout_ms = atoi(optarg);
+        break;
+      case 8:
+        reduce.kind = strcmp(optarg, "minmax") == 0 ? REDUCE_MINMAX
+                      : strcmp(optarg, "sum") == 0  ? REDUCE_SUM
+                      : strcmp(optarg, "stats") == 0
+                          ? REDUCE_STATS
+                          : 0;
+        if (reduce.kind == 0) {
+          fprintf(stderr, "--reduce is one of minmax, sum, stats\n");
+          return 1;
+        }
+        break;
+      case 9:
+        ConvertStringToUI64(optarg, &length);
+        break;
+      case 10:
+        ConvertStringToUI64(optarg, &reduce.seed);
+        break;
+      case 11:
+        if (strlen(optarg) >= SHARD_NAME_MAX) {
+          fprintf(stderr, "Shard name is too long\n");
+          return 1;
+        }
+        reduce.source = REDUCE_SHARD;
+        strcpy(reduce.shard, optarg);
+        break;
       default:
         printf("Index %d is out of options\n", option_index);
       }
@@ -134,56 +485,157 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (k == -1 || mod == -1 || !strlen(servers_path)) {
-    fprintf(stderr, "Using: %s --k 1000 --mod 5 --servers /path/to/file\n",
-            argv[0]);
+  bool reducing = reduce.kind != 0;
+  bool factorial_ok = k != (uint64_t)-1 &&
+                      (mod != (uint64_t)-1 || mods_num > 0);
+  if ((reducing ? length == (uint64_t)-1 : !factorial_ok) ||
+      !strlen(servers_path) || chunks <= 0 || timeout_ms <= 0 ||
+      connect_timeout_ms <= 0) {
+    fprintf(stderr,
+            "Using: %s --k 1000 --mod 5 --servers /path/to/file "
+            "[--chunks 16] [--no-hedge]\n"
+            "       [--timeout-ms 30000] [--connect-timeout-ms 500]\n"
+            "       %s --k 1000 --mods 5,7,11 --servers /path/to/file\n"
+            "       %s --reduce minmax|sum|stats --length N [--seed 1] "
+            "[--shard NAME]\n"
+            "          --servers /path/to/file\n"
+            "--reduce spreads an int32 array over the servers: generated "
+            "from --seed, or\nread from the file NAME in each server's "
+            "--shard-dir\n",
+            argv[0], argv[0], argv[0]);
     return 1;
   }
+  /* the same chunking covers factors [1, k] or elements [0, length) */
+  uint64_t first = reducing ? 0 : 1;
+  uint64_t total = reducing ? length : k;
+  if (mods_num == 0) {
+    mods[0] = mod;
+    mods_num = 1;
+  }
 
-  FILE *file = fopen(servers_path, "r");
-  if (!file) {
-    perror("Cannot open servers file");
+  Scheduler s;
+  memset(&s, 0, sizeof(s));
+  if (DispatcherInit(&s.net, connect_timeout_ms * 1000000ULL) < 0)
+    return 1;
+  DispatcherEnableRecovery(&s.net);
+  s.net.on_added = OnServerAdded;
+  s.net.on_ready = OnServerReady;
+  s.net.on_failed = OnServerFailed;
+  s.net.ctx = &s;
+  int servers_num = DispatcherAddServersFromFile(&s.net, servers_path);
+  if (servers_num <= 0) {
+    if (servers_num == 0)
+      fprintf(stderr, "No servers found in file\n");
+    DispatcherDestroy(&s.net);
     return 1;
   }
 
-  struct Server *servers = malloc(sizeof(struct Server) * 100);
-  int servers_num = 0;
-  while (fscanf(file, "%254[^:]:%d\n", servers[servers_num].ip, &servers[servers_num].port) == 2) {
-    servers_num++;
+  /* [1, k] is cut into `chunks` pieces per server that the servers pull as
+   * they finish; a window of about tnum requests keeps each pool busy */
+  uint64_t chunks_total = (uint64_t)chunks * servers_num;
+  s.chunks_num = (int)(chunks_total < total ? chunks_total : total);
+  s.chunks = calloc(s.chunks_num ? s.chunks_num : 1, sizeof(Chunk));
+  s.retry = calloc(s.chunks_num ? s.chunks_num : 1, sizeof(int));
+  s.finished = s.chunks_num == 0;
+  s.hedge = hedge;
+  s.timeout_ns = timeout_ms * 1000000ULL;
+  s.mods = mods;
+  s.mods_num = mods_num;
+  s.reduce = reducing ? &reduce : NULL;
+  s.results_num = reducing ? REDUCE_RESULTS : (uint32_t)mods_num;
+  /* servers added to the file later join in; removed ones are dropped */
+  DispatcherWatchServersFile(&s.net, servers_path, 1);
+
+  uint64_t step = s.chunks_num ? total / s.chunks_num : 0;
+  uint64_t current = first;
+  for (int c = 0; c < s.chunks_num; c++) {
+    s.chunks[c].begin = current;
+    s.chunks[c].end =
+        (c == s.chunks_num - 1) ? first + total - 1 : current + step - 1;
+    s.chunks[c].owners[0] = s.chunks[c].owners[1] = -1;
+    current = s.chunks[c].end + 1;
   }
-  fclose(file);
 
-  if (servers_num == 0) {
-    fprintf(stderr, "No servers found in file\n");
-    free(servers);
-    return 1;
+  uint64_t start = NowNs();
+  for (int i = 0; i < servers_num; i++)
+    DispatcherConnect(&s.net, i);
+  uint64_t last_ready_ns = start;
+  while (!s.finished && AnyServerLeft(&s, &last_ready_ns)) {
+    if (DispatcherPoll(&s.net, 100) < 0)
+      break;
+    WakeBackedOff(&s);
   }
-
-  pthread_t threads[servers_num];
-  ServerTask tasks[servers_num];
-
-  uint64_t step = k / servers_num;
-  uint64_t current = 1;
-
-  for (int i = 0; i < servers_num; i++) {
-    tasks[i].server = servers[i];
-    tasks[i].begin = current;
-    tasks[i].end = (i == servers_num - 1) ? k : (current + step - 1);
-    tasks[i].mod = mod;
-    tasks[i].result = 1;
-    current = tasks[i].end + 1;
-
-    pthread_create(&threads[i], NULL, RunServerTask, (void *)&tasks[i]);
+  bool ok = s.done_num == s.chunks_num;
+  s.finished = true;
+  double elapsed_sec = (NowNs() - start) / 1e9;
+
+  uint64_t totals[MAX_MODS];
+  for (int j = 0; j < mods_num && !reducing; j++) {
+    totals[j] = 1 % mods[j];
+    for (int c = 0; c < s.chunks_num && ok; c++)
+      totals[j] = MulModulo(totals[j], s.chunks[c].results[j], mods[j]);
   }
-
-  uint64_t total = 1;
-  for (int i = 0; i < servers_num; i++) {
-    pthread_join(threads[i], NULL);
-    total = MultModulo(total, tasks[i].result, mod);
+  /* merged in chunk order, so the result doesn't depend on who answered */
+  struct ReduceStats stats;
+  ReduceStatsInit(&stats);
+  for (int c = 0; c < s.chunks_num && ok && reducing; c++) {
+    struct ReduceStats part;
+    DecodeReduceStats(s.chunks[c].results, &part);
+    ReduceMerge(&stats, &part);
   }
 
-  printf("Factorial(%llu) mod %llu = %llu\n", k, mod, total);
+  if (ok) {
+    int failed = 0;
+    printf("%-24s %6s %14s %14s %8s %8s %7s\n", "server", "tnum",
+           "advertised/s", "observed/s", "share", "chunks", "hedges");
+    for (int i = 0; i < s.net.servers_num; i++) {
+      struct DispatchServer *ds = &s.net.servers[i];
+      if (ds->state == SERVER_FAILED && !ds->removed)
+        failed++;
+      char name[300];
+      snprintf(name, sizeof(name), "%s:%d", ds->host, ds->port);
+      printf("%-24s %6u %14lu %14.0f %7.1f%% %8d %7d%s\n", name, ds->tnum,
+             ds->mults_per_sec, s.loads[i].assigned / elapsed_sec,
+             total ? 100.0 * s.loads[i].assigned / total : 0.0,
+             s.loads[i].chunks_won,
+             s.loads[i].hedges_sent,
+             ds->removed                   ? " (removed)"
+             : ds->state == SERVER_FAILED ? " (failed)"
+                                          : "");
+    }
+    char latency[256];
+    HistFormatUs(&s.chunk_latency, "chunk latency", latency, sizeof(latency));
+    printf("%d chunks in %.3fs, %d hedged (%d won by the duplicate, %d "
+           "cancelled), %d timed out, %d of %d servers failed\n%s",
+           s.chunks_num, elapsed_sec, s.hedges_sent, s.hedges_won,
+           s.hedges_cancelled, s.timeouts, failed, s.net.servers_num,
+           latency);
+  }
 
-  free(servers);
+  /* anything still outstanding is dropped with the sockets; the servers
+   * see the disconnect and stop working on it */
+  DispatcherDestroy(&s.net);
+  for (int c = 0; c < s.chunks_num; c++)
+    free(s.chunks[c].rejected_by);
+  free(s.chunks);
+  free(s.retry);
+  free(s.loads);
+
+  if (!ok) {
+    if (!s.rejected)
+      fprintf(stderr,
+              "Some servers failed, the result would be incomplete\n");
+    return 1;
+  }
+  if (reduce.kind == REDUCE_MINMAX || reduce.kind == REDUCE_STATS)
+    printf("min: %ld\nmax: %ld\n", stats.min, stats.max);
+  if (reduce.kind == REDUCE_SUM || reduce.kind == REDUCE_STATS)
+    printf("sum: %ld\n", stats.sum);
+  if (reduce.kind == REDUCE_STATS)
+    printf("count: %lu\nmean: %.6f\nstddev: %.6f\n", stats.count,
+           stats.mean,
+           stats.count ? sqrt(stats.m2 / stats.count) : 0.0);
+  for (int j = 0; j < mods_num && !reducing; j++)
+    printf("Factorial(%lu) mod %lu = %lu\n", k, mods[j], totals[j]);
   return 0;
 }
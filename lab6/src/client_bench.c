@@ -0,0 +1,160 @@
+/* Closed-loop throughput test for libfactorial_client: keeps --inflight
+ * requests outstanding from one thread for --duration seconds. Each request
+ * covers the next k numbers, so server-side caching doesn't help. */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "factorial_client.h"
+#include "stats.h"
+
+typedef struct {
+  struct FactorialClient *client;
+  uint64_t k;
+  uint64_t mod;
+  uint64_t next_begin;
+  uint64_t stop_ns;
+  uint64_t completed;
+  uint64_t failed;
+  struct Histogram latency;
+} Bench;
+
+/* Each slot owns one outstanding request and resubmits when it returns. */
+typedef struct {
+  Bench *bench;
+  uint64_t sent_ns;
+} Slot;
+
+void OnDone(void *ctx, uint64_t handle, int status, const uint64_t *results,
+            size_t results_num);
+
+bool SubmitSlot(Slot *slot) {
+  Bench *b = slot->bench;
+  slot->sent_ns = NowNs();
+  uint64_t begin = b->next_begin;
+  b->next_begin += b->k;
+  return FactorialClientSubmit(b->client, begin, begin + b->k - 1, &b->mod, 1,
+                               OnDone, slot) != 0;
+}
+
+void OnDone(void *ctx, uint64_t handle, int status, const uint64_t *results,
+            size_t results_num) {
+  (void)handle;
+  (void)results;
+  (void)results_num;
+  Slot *slot = (Slot *)ctx;
+  Bench *b = slot->bench;
+  uint64_t now = NowNs();
+  HistRecord(&b->latency, now - slot->sent_ns);
+  if (status == FACTORIAL_OK)
+    b->completed++;
+  else
+    b->failed++;
+  if (now < b->stop_ns)
+    SubmitSlot(slot);
+}
+
+int main(int argc, char **argv) {
+  char servers_path[255] = {'\0'};
+  int inflight = 4096;
+  double duration = 5;
+  static Bench b;
+  b.k = 1000;
+  b.mod = 1000000007;
+  b.next_begin = 1;
+  struct FactorialClientOptions options;
+  FactorialClientDefaults(&options);
+
+  while (true) {
+    static struct option long_options[] = {
+        {"servers", required_argument, 0, 0},
+        {"inflight", required_argument, 0, 0},
+        {"duration", required_argument, 0, 0},
+        {"k", required_argument, 0, 0},
+        {"conns", required_argument, 0, 0},
+        {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0: {
+      switch (option_index) {
+      case 0:
+        snprintf(servers_path, sizeof(servers_path), "%s", optarg);
+        break;
+      case 1:
+        inflight = atoi(optarg);
+        break;
+      case 2:
+        duration = atof(optarg);
+        break;
+      case 3:
+        b.k = strtoull(optarg, NULL, 10);
+        break;
+      case 4:
+        options.conns_per_server = atoi(optarg);
+        break;
+      default:
+        printf("Index %d is out of options\n", option_index);
+      }
+    } break;
+
+    case '?':
+      printf("Arguments error\n");
+      break;
+    default:
+      fprintf(stderr, "getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  if (!strlen(servers_path) || inflight <= 0 || duration <= 0 || b.k == 0) {
+    fprintf(stderr,
+            "Using: %s --servers /path/to/file [--inflight 4096] "
+            "[--duration 5]\n"
+            "       [--k 1000] [--conns 1]\n"
+            "Keeps --inflight requests for products of k consecutive numbers "
+            "mod 1000000007\noutstanding from one thread\n",
+            argv[0]);
+    return 1;
+  }
+
+  b.client = FactorialClientCreate(&options);
+  if (b.client == NULL ||
+      FactorialClientAddServersFromFile(b.client, servers_path) <= 0)
+    return 1;
+  int ready = FactorialClientConnect(b.client, 2000);
+  if (ready == 0) {
+    fprintf(stderr, "No server could be reached\n");
+    return 1;
+  }
+
+  Slot *slots = calloc(inflight, sizeof(Slot));
+  uint64_t start = NowNs();
+  b.stop_ns = start + (uint64_t)(duration * 1e9);
+  for (int i = 0; i < inflight; i++) {
+    slots[i].bench = &b;
+    if (!SubmitSlot(&slots[i])) {
+      fprintf(stderr, "Submit failed\n");
+      return 1;
+    }
+  }
+  FactorialClientWaitAll(b.client, -1);
+  double elapsed = (NowNs() - start) / 1e9;
+
+  char latency[256];
+  HistFormatUs(&b.latency, "latency", latency, sizeof(latency));
+  printf("%d connections, %d in flight, k=%lu: %lu completed (%.0f/s), "
+         "%lu failed in %.2fs\n%s",
+         ready, inflight, b.k, b.completed, b.completed / elapsed, b.failed,
+         elapsed, latency);
+
+  FactorialClientDestroy(b.client);
+  free(slots);
+  return 0;
+}
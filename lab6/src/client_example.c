@@ -0,0 +1,49 @@
+/* Smallest use of libfactorial_client: one request waited on by handle and
+ * a few more answered through a callback. */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "factorial_client.h"
+
+void PrintResult(void *ctx, uint64_t handle, int status,
+                 const uint64_t *results, size_t results_num) {
+  (void)handle;
+  uint64_t k = *(uint64_t *)ctx;
+  if (status != FACTORIAL_OK) {
+    printf("%lu! failed with status %d\n", k, status);
+    return;
+  }
+  for (size_t j = 0; j < results_num; j++)
+    printf("%lu! = %lu (mod modulus #%zu)\n", k, results[j], j);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Using: %s /path/to/servers.txt\n", argv[0]);
+    return 1;
+  }
+
+  struct FactorialClient *client = FactorialClientCreate(NULL);
+  if (client == NULL || FactorialClientAddServersFromFile(client, argv[1]) <= 0)
+    return 1;
+  if (FactorialClientConnect(client, 2000) == 0) {
+    fprintf(stderr, "No server could be reached\n");
+    return 1;
+  }
+
+  uint64_t mod = 1000000007;
+  uint64_t handle = FactorialClientSubmit(client, 1, 1000000, &mod, 1, NULL,
+                                          NULL);
+  uint64_t result;
+  if (FactorialClientWait(client, handle, &result, 1, -1) == FACTORIAL_OK)
+    printf("1000000! mod %lu = %lu\n", mod, result);
+
+  static uint64_t ks[] = {10, 1000, 100000};
+  uint64_t mods[] = {1000000007, 998244353};
+  for (size_t i = 0; i < sizeof(ks) / sizeof(ks[0]); i++)
+    FactorialClientSubmit(client, 1, ks[i], mods, 2, PrintResult, &ks[i]);
+  FactorialClientWaitAll(client, -1);
+
+  FactorialClientDestroy(client);
+  return 0;
+}
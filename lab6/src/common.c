@@ -1,13 +1,143 @@
 #include "common.h"
 
+#include <stdbool.h>
+
+#define MULTI_LANES 8
+#define LANE_MOD_LIMIT (1ull << 31)
+
+uint64_t MulModulo(uint64_t a, uint64_t b, uint64_t mod) {
+  return (uint64_t)((unsigned __int128)a * b % mod);
+}
+
 uint64_t MultModulo(uint64_t a, uint64_t b, uint64_t mod) {
-  uint64_t result = 0;
-  a = a % mod;
-  while (b > 0) {
-    if (b % 2 == 1)
-      result = (result + a) % mod;
-    a = (a * 2) % mod;
-    b /= 2;
-  }
-  return result % mod;
+  return MulModulo(a, b, mod);
+}
+
+/* a, b < mod <= 2^32 keeps a * b inside 64 bits; wider moduli need 128 */
+static inline __attribute__((always_inline)) uint64_t
+MulMod(uint64_t a, uint64_t b, uint64_t mod, const bool small) {
+  if (small)
+    return a * b % mod;
+  return (uint64_t)((unsigned __int128)a * b % mod);
+}
+
+/* Lane l multiplies i = begin + l, begin + l + L, ...; x[l] keeps that i
+ * already reduced mod m so the factors never need their own division.
+ * L and small are constants at every call site, so the lane loop unrolls
+ * into L independent dependency chains. */
+static inline __attribute__((always_inline)) uint64_t
+FactorialChains(uint64_t begin, uint64_t count, uint64_t mod, const int L,
+                const bool small) {
+  uint64_t acc[MAX_LANES];
+  uint64_t x[MAX_LANES];
+  uint64_t step = (uint64_t)L % mod;
+
+  for (int l = 0; l < L; l++) {
+    acc[l] = 1 % mod;
+    x[l] = (begin % mod + (uint64_t)l % mod) % mod;
+  }
+
+  uint64_t n = 0;
+  for (; n + L <= count; n += L) {
+    for (int l = 0; l < L; l++) {
+      acc[l] = MulMod(acc[l], x[l], mod, small);
+      x[l] += step;
+      x[l] -= (x[l] >= mod) ? mod : 0;
+    }
+  }
+  for (int l = 0; n < count; l++, n++)
+    acc[0] = MulMod(acc[0], x[l], mod, small);
+
+  uint64_t ans = acc[0];
+  for (int l = 1; l < L; l++)
+    ans = MulMod(ans, acc[l], mod, small);
+  return ans;
+}
+
+uint64_t FactorialInterleaved(uint64_t begin, uint64_t end, uint64_t mod,
+                              int lanes) {
+  uint64_t count = begin <= end ? end - begin + 1 : 0;
+  bool small = mod <= (1ull << 32);
+
+  if (lanes >= 8)
+    return small ? FactorialChains(begin, count, mod, 8, true)
+                 : FactorialChains(begin, count, mod, 8, false);
+  if (lanes >= 4)
+    return small ? FactorialChains(begin, count, mod, 4, true)
+                 : FactorialChains(begin, count, mod, 4, false);
+  if (lanes >= 2)
+    return small ? FactorialChains(begin, count, mod, 2, true)
+                 : FactorialChains(begin, count, mod, 2, false);
+  return small ? FactorialChains(begin, count, mod, 1, true)
+               : FactorialChains(begin, count, mod, 1, false);
+}
+
+typedef int32_t LaneInt __attribute__((vector_size(MULTI_LANES * 4)));
+typedef int64_t LaneWide __attribute__((vector_size(MULTI_LANES * 8)));
+typedef double LaneReal __attribute__((vector_size(MULTI_LANES * 8)));
+
+/* One accumulator per lane in a GCC vector: every lane does the same
+ * operations, which lowers to AVX2/AVX-512 when enabled and to scalar code
+ * otherwise. acc * x < 2^62 is exact in 64 bits; the quotient is estimated
+ * in double precision (off by at most one) and the remainder corrected
+ * branch-free. x tracks i mod m incrementally to avoid a division per i. */
+static void FactorialLanes(uint64_t begin, uint64_t count, const int32_t *mods,
+                           int32_t *results) {
+  LaneInt acc, x, m;
+  LaneReal inv;
+
+  for (int l = 0; l < MULTI_LANES; l++) {
+    m[l] = mods[l];
+    acc[l] = 1 % mods[l];
+    x[l] = (int32_t)(begin % (uint64_t)mods[l]);
+    inv[l] = 1.0 / mods[l];
+  }
+  LaneWide m_wide = __builtin_convertvector(m, LaneWide);
+
+  for (uint64_t n = 0; n < count; n++) {
+    LaneWide p = __builtin_convertvector(acc, LaneWide) *
+                 __builtin_convertvector(x, LaneWide);
+    LaneReal qr = __builtin_convertvector(acc, LaneReal) *
+                  __builtin_convertvector(x, LaneReal) * inv;
+    LaneWide q = __builtin_convertvector(__builtin_convertvector(qr, LaneInt),
+                                         LaneWide);
+    LaneWide r = p - q * m_wide;
+    r += (r < 0) & m_wide;
+    r -= (r >= m_wide) & m_wide;
+    acc = __builtin_convertvector(r, LaneInt);
+    x += 1;
+    x &= ~(x == m);
+  }
+
+  for (int l = 0; l < MULTI_LANES; l++)
+    results[l] = acc[l];
+}
+
+void FactorialMulti(uint64_t begin, uint64_t end, const uint64_t *mods,
+                    size_t mods_num, uint64_t *results) {
+  uint64_t count = begin <= end ? end - begin + 1 : 0;
+  int32_t lane_mods[MULTI_LANES];
+  int32_t lane_results[MULTI_LANES];
+  size_t lane_owner[MULTI_LANES];
+  int lanes = 0;
+
+  for (size_t j = 0; j <= mods_num; j++) {
+    if (j < mods_num && mods[j] < LANE_MOD_LIMIT && mods[j] > 0) {
+      lane_mods[lanes] = (int32_t)mods[j];
+      lane_owner[lanes] = j;
+      lanes++;
+    } else if (j < mods_num) {
+      results[j] = FactorialInterleaved(begin, end, mods[j], MAX_LANES);
+    }
+
+    if (lanes == MULTI_LANES || (j == mods_num && lanes > 0)) {
+      /* unused lanes get a harmless modulus and are ignored */
+      for (int l = lanes; l < MULTI_LANES; l++)
+        lane_mods[l] = 1;
+      FactorialLanes(begin, count, lane_mods, lane_results);
+      for (int l = 0; l < lanes; l++)
+        results[lane_owner[l]] = (uint64_t)lane_results[l];
+      lanes = 0;
+    }
+  }
 }
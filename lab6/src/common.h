@@ -1,8 +1,29 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define MAX_MODS 64
+#define MAX_LANES 8
+
+/* a * b mod mod, exact for any 64-bit modulus (the product is taken in
+ * 128 bits). */
+uint64_t MulModulo(uint64_t a, uint64_t b, uint64_t mod);
+/* Same as MulModulo; kept for the callers of the original helper. */
 uint64_t MultModulo(uint64_t a, uint64_t b, uint64_t mod);
 
-#endif
\ No newline at end of file
+/* Computes prod(i for i in [begin, end]) mod mod with `lanes` (1..8)
+ * independent partial products over strided i, combined at the end, so the
+ * modular multiplies of different chains can overlap in the pipeline. */
+uint64_t FactorialInterleaved(uint64_t begin, uint64_t end, uint64_t mod,
+                              int lanes);
+
+/* Computes prod(i for i in [begin, end]) mod mods[j] for every j. Moduli
+ * below 2^31 share a single sweep over i in a lane-parallel kernel that the
+ * compiler can vectorize; larger ones each go through FactorialInterleaved
+ * with MAX_LANES chains. */
+void FactorialMulti(uint64_t begin, uint64_t end, const uint64_t *mods,
+                    size_t mods_num, uint64_t *results);
+
+#endif
@@ -0,0 +1,171 @@
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t Mix(uint64_t hash, uint64_t value) {
+  hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  hash ^= hash >> 31;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  return hash ^ (hash >> 29);
+}
+
+void KeyInit(struct RequestKey *key, const struct FactorialRequest *req) {
+  key->begin = req->begin;
+  key->end = req->end;
+  key->mods_num = req->mods_num;
+  memcpy(key->mods, req->mods, sizeof(uint64_t) * req->mods_num);
+  uint64_t hash = Mix(Mix(req->mods_num, req->begin), req->end);
+  for (uint32_t j = 0; j < req->mods_num; j++)
+    hash = Mix(hash, req->mods[j]);
+  key->hash = hash;
+}
+
+bool KeyEqual(const struct RequestKey *a, const struct RequestKey *b) {
+  return a->hash == b->hash && a->begin == b->begin && a->end == b->end &&
+         a->mods_num == b->mods_num &&
+         memcmp(a->mods, b->mods, sizeof(uint64_t) * a->mods_num) == 0;
+}
+
+void InflightInit(struct InflightTable *table) {
+  table->buckets_num = 256;
+  table->buckets = calloc(table->buckets_num, sizeof(struct InflightEntry *));
+  table->size = 0;
+}
+
+static void InflightGrow(struct InflightTable *table) {
+  size_t buckets_num = table->buckets_num * 2;
+  struct InflightEntry **buckets =
+      calloc(buckets_num, sizeof(struct InflightEntry *));
+  for (size_t b = 0; b < table->buckets_num; b++) {
+    struct InflightEntry *entry = table->buckets[b];
+    while (entry) {
+      struct InflightEntry *next = entry->next;
+      size_t slot = entry->key->hash & (buckets_num - 1);
+      entry->next = buckets[slot];
+      buckets[slot] = entry;
+      entry = next;
+    }
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->buckets_num = buckets_num;
+}
+
+void *InflightFind(struct InflightTable *table, const struct RequestKey *key) {
+  struct InflightEntry *entry =
+      table->buckets[key->hash & (table->buckets_num - 1)];
+  for (; entry; entry = entry->next)
+    if (KeyEqual(entry->key, key))
+      return entry->leader;
+  return NULL;
+}
+
+void InflightInsert(struct InflightTable *table, const struct RequestKey *key,
+                    void *leader) {
+  if (table->size >= table->buckets_num)
+    InflightGrow(table);
+  struct InflightEntry *entry = malloc(sizeof(struct InflightEntry));
+  size_t slot = key->hash & (table->buckets_num - 1);
+  entry->key = key;
+  entry->leader = leader;
+  entry->next = table->buckets[slot];
+  table->buckets[slot] = entry;
+  table->size++;
+}
+
+void InflightRemove(struct InflightTable *table, const struct RequestKey *key) {
+  struct InflightEntry **link =
+      &table->buckets[key->hash & (table->buckets_num - 1)];
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->key == key) {
+      struct InflightEntry *entry = *link;
+      *link = entry->next;
+      free(entry);
+      table->size--;
+      return;
+    }
+  }
+}
+
+void CacheInit(struct ResultCache *cache, size_t capacity) {
+  memset(cache, 0, sizeof(*cache));
+  cache->capacity = capacity;
+  if (capacity == 0)
+    return;
+  cache->buckets_num = 16;
+  while (cache->buckets_num < capacity)
+    cache->buckets_num *= 2;
+  cache->buckets = calloc(cache->buckets_num, sizeof(struct CacheEntry *));
+}
+
+static void LruUnlink(struct ResultCache *cache, struct CacheEntry *entry) {
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+}
+
+static void LruPushFront(struct ResultCache *cache, struct CacheEntry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = entry;
+  else
+    cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+static struct CacheEntry **FindLink(struct ResultCache *cache,
+                                    const struct RequestKey *key) {
+  struct CacheEntry **link =
+      &cache->buckets[key->hash & (cache->buckets_num - 1)];
+  while (*link && !KeyEqual(&(*link)->key, key))
+    link = &(*link)->hash_next;
+  return link;
+}
+
+bool CacheLookup(struct ResultCache *cache, const struct RequestKey *key,
+                 uint64_t *results) {
+  if (cache->capacity == 0)
+    return false;
+  struct CacheEntry *entry = *FindLink(cache, key);
+  if (!entry)
+    return false;
+  memcpy(results, entry->results, sizeof(uint64_t) * key->mods_num);
+  LruUnlink(cache, entry);
+  LruPushFront(cache, entry);
+  return true;
+}
+
+void CacheInsert(struct ResultCache *cache, const struct RequestKey *key,
+                 const uint64_t *results) {
+  if (cache->capacity == 0)
+    return;
+  struct CacheEntry **link = FindLink(cache, key);
+  struct CacheEntry *entry = *link;
+  if (entry) {
+    LruUnlink(cache, entry);
+  } else if (cache->size == cache->capacity) {
+    /* reuse the oldest entry's memory for the new key */
+    entry = cache->lru_tail;
+    LruUnlink(cache, entry);
+    *FindLink(cache, &entry->key) = entry->hash_next;
+    cache->evictions++;
+    link = FindLink(cache, key);
+  } else {
+    entry = malloc(sizeof(struct CacheEntry));
+    cache->size++;
+  }
+  if (*link != entry) {
+    entry->key = *key;
+    entry->hash_next = *link;
+    *link = entry;
+  }
+  memcpy(entry->results, results, sizeof(uint64_t) * key->mods_num);
+  LruPushFront(cache, entry);
+}
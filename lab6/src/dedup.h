@@ -0,0 +1,70 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+
+/* Identity of a factorial request: the range and the moduli in order. */
+struct RequestKey {
+  uint64_t begin;
+  uint64_t end;
+  uint32_t mods_num;
+  uint64_t mods[MAX_MODS];
+  uint64_t hash;
+};
+
+void KeyInit(struct RequestKey *key, const struct FactorialRequest *req);
+bool KeyEqual(const struct RequestKey *a, const struct RequestKey *b);
+
+/* Requests being computed right now, so identical ones arriving meanwhile
+ * can wait for the same result. The value is the caller's leader request. */
+struct InflightEntry {
+  const struct RequestKey *key; /* owned by the leader */
+  void *leader;
+  struct InflightEntry *next;
+};
+
+struct InflightTable {
+  struct InflightEntry **buckets;
+  size_t buckets_num;
+  size_t size;
+};
+
+void InflightInit(struct InflightTable *table);
+void *InflightFind(struct InflightTable *table, const struct RequestKey *key);
+void InflightInsert(struct InflightTable *table, const struct RequestKey *key,
+                    void *leader);
+void InflightRemove(struct InflightTable *table, const struct RequestKey *key);
+
+/* Bounded map of recent results; the least recently used entry is evicted
+ * when full. A capacity of 0 disables caching. */
+struct CacheEntry {
+  struct RequestKey key;
+  uint64_t results[MAX_MODS];
+  struct CacheEntry *hash_next;
+  struct CacheEntry *lru_prev;
+  struct CacheEntry *lru_next;
+};
+
+struct ResultCache {
+  size_t capacity;
+  size_t size;
+  struct CacheEntry **buckets;
+  size_t buckets_num;
+  struct CacheEntry *lru_head; /* most recently used */
+  struct CacheEntry *lru_tail;
+  uint64_t evictions;
+};
+
+void CacheInit(struct ResultCache *cache, size_t capacity);
+/* Copies key->mods_num results out and marks the entry recently used. */
+bool CacheLookup(struct ResultCache *cache, const struct RequestKey *key,
+                 uint64_t *results);
+void CacheInsert(struct ResultCache *cache, const struct RequestKey *key,
+                 const uint64_t *results);
+
+#endif
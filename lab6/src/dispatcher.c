@@ -0,0 +1,889 @@
+#include "dispatcher.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+#define MAX_EVENTS 256
+/* deadlines are checked at this granularity rather than kept in a heap */
+#define SCAN_INTERVAL_NS 5000000ULL
+#define REQUEST_FRAME_MAX (FRAME_HEADER_SIZE + 24 + 8 * MAX_MODS)
+#define NS_PER_MS 1000000ULL
+/* how long to poll a response ring before sleeping on it */
+#define SHM_SPIN_NS 20000ULL
+/* how often a watched servers file is checked for changes */
+#define WATCH_INTERVAL_NS 1000000000ULL
+
+static uint64_t HashHost(const char *host) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (; *host; host++)
+    hash = (hash ^ (uint8_t)*host) * 1099511628211ULL;
+  return hash;
+}
+
+static struct AddrCacheEntry *FindSlot(struct AddrCacheEntry *cache,
+                                       size_t cap, const char *host) {
+  size_t mask = cap - 1;
+  for (size_t i = HashHost(host) & mask;; i = (i + 1) & mask)
+    if (cache[i].host[0] == '\0' || strcmp(cache[i].host, host) == 0)
+      return &cache[i];
+}
+
+static void GrowCache(struct Dispatcher *d) {
+  size_t cap = d->cache_cap ? d->cache_cap * 2 : 64;
+  struct AddrCacheEntry *cache = calloc(cap, sizeof(*cache));
+  for (size_t i = 0; i < d->cache_cap; i++)
+    if (d->cache[i].host[0] != '\0')
+      *FindSlot(cache, cap, d->cache[i].host) = d->cache[i];
+  free(d->cache);
+  d->cache = cache;
+  d->cache_cap = cap;
+}
+
+/* A servers file usually lists the same few hosts on many ports, so every
+ * name goes through getaddrinfo once, failures included. */
+static bool Resolve(struct Dispatcher *d, const char *host,
+                    struct in_addr *addr) {
+  if (2 * (d->cache_num + 1) > d->cache_cap)
+    GrowCache(d);
+  struct AddrCacheEntry *entry = FindSlot(d->cache, d->cache_cap, host);
+  if (entry->host[0] == '\0') {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    int rc = getaddrinfo(host, NULL, &hints, &res);
+    entry->ok = rc == 0;
+    if (entry->ok)
+      entry->addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    else
+      fprintf(stderr, "getaddrinfo failed for %s: %s\n", host,
+              gai_strerror(rc));
+    if (res)
+      freeaddrinfo(res);
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    d->cache_num++;
+  }
+  *addr = entry->addr;
+  return entry->ok;
+}
+
+static void Reserve(struct DispatchServer *s, size_t len) {
+  if (s->out_len + len <= s->out_cap)
+    return;
+  size_t cap = s->out_cap ? s->out_cap * 2 : 256;
+  while (cap < s->out_len + len)
+    cap *= 2;
+  s->out = realloc(s->out, cap);
+  s->out_cap = cap;
+}
+
+static void UpdateInterest(struct Dispatcher *d, int server) {
+  struct DispatchServer *s = &d->servers[server];
+  bool want_write = s->state == SERVER_CONNECTING || s->out_len > 0;
+  if (want_write == s->want_write)
+    return;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+  ev.data.u32 = (uint32_t)server;
+  epoll_ctl(d->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+  s->want_write = want_write;
+}
+
+static void ReleaseShm(struct DispatchServer *s) {
+  if (s->shm_name[0] != '\0')
+    ShmUnlink(s->shm_name);
+  s->shm_name[0] = '\0';
+  if (s->shm)
+    ShmClose(s->shm);
+  s->shm = NULL;
+  s->shm_ready = false;
+}
+
+static void FailRequests(struct DispatchRequest *req, int status) {
+  while (req) {
+    struct DispatchRequest *next = req->next;
+    req->cb(req->ctx, req->id, status, NULL, 0);
+    free(req);
+    req = next;
+  }
+}
+
+/* Exponential in the failures since the server last answered a request,
+ * with jitter so servers that went down together don't all retry at once. */
+static void ScheduleRetry(struct Dispatcher *d, struct DispatchServer *s) {
+  s->retry_at_ns = 0;
+  if (d->backoff_min_ns == 0 || s->removed)
+    return;
+  uint64_t backoff = d->backoff_max_ns;
+  if (s->failures < 32 && d->backoff_min_ns << s->failures < backoff)
+    backoff = d->backoff_min_ns << s->failures;
+  uint64_t now = NowNs();
+  backoff = backoff / 2 + now % (backoff / 2 + 1);
+  s->failures++;
+  s->retry_at_ns = now + backoff;
+  fprintf(stderr, "Retrying %s:%d in %lums\n", s->host, s->port,
+          (unsigned long)(backoff / NS_PER_MS));
+}
+
+/* Closes the connection and fails everything still outstanding on it. The
+ * server is marked failed first, so callbacks can't submit to it again. */
+static void FailServer(struct Dispatcher *d, int server) {
+  struct DispatchServer *s = &d->servers[server];
+  if (s->state == SERVER_FAILED)
+    return;
+  s->state = SERVER_FAILED;
+  if (s->fd >= 0)
+    close(s->fd);
+  s->fd = -1;
+  s->out_len = 0;
+  s->errors = 0;
+  s->ping_deadline_ns = 0;
+  s->ping_unsent = 0;
+  ReleaseShm(s);
+  ScheduleRetry(d, s);
+  s->failed += s->inflight;
+  struct DispatchRequest *req = s->inflight_head;
+  s->inflight_head = s->inflight_tail = NULL;
+  s->inflight = 0;
+
+  FailRequests(req, DISPATCH_FAILED);
+  if (d->on_failed)
+    d->on_failed(d->ctx, server);
+}
+
+static void FlushServer(struct Dispatcher *d, int server) {
+  struct DispatchServer *s = &d->servers[server];
+  if (s->state != SERVER_HANDSHAKE && s->state != SERVER_READY)
+    return;
+  size_t sent = 0;
+  while (sent < s->out_len) {
+    ssize_t n = send(s->fd, s->out + sent, s->out_len - sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      fprintf(stderr, "Send to %s:%d failed\n", s->host, s->port);
+      FailServer(d, server);
+      return;
+    }
+    sent += (size_t)n;
+  }
+  memmove(s->out, s->out + sent, s->out_len - sent);
+  s->out_len -= sent;
+  if (s->ping_unsent > 0) {
+    /* the ping's deadline runs from when it has left, not from when it
+     * was queued */
+    if (sent >= s->ping_unsent) {
+      s->ping_unsent = 0;
+      s->ping_deadline_ns = NowNs() + d->connect_timeout_ns;
+    } else {
+      s->ping_unsent -= sent;
+    }
+  }
+  UpdateInterest(d, server);
+}
+
+static struct DispatchRequest *TakeRequest(struct DispatchServer *s,
+                                           uint64_t id) {
+  struct DispatchRequest **link = &s->inflight_head;
+  struct DispatchRequest *prev = NULL;
+  while (*link && (*link)->id != id) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  struct DispatchRequest *req = *link;
+  if (!req)
+    return NULL;
+  *link = req->next;
+  if (s->inflight_tail == req)
+    s->inflight_tail = prev;
+  s->inflight--;
+  return req;
+}
+
+/* Offers the server a segment; it answers on TCP, see HandleFrame. */
+static bool OfferShm(struct Dispatcher *d, int server) {
+  struct DispatchServer *s = &d->servers[server];
+  s->shm = ShmCreate(s->shm_name, sizeof(s->shm_name));
+  if (s->shm == NULL) {
+    s->shm_name[0] = '\0';
+    return false;
+  }
+  Reserve(s, FRAME_HEADER_SIZE + 8 + SHM_NAME_MAX);
+  s->out_len +=
+      EncodeShmAttach(s->out + s->out_len, 0, s->shm_name, s->shm->nonce);
+  UpdateInterest(d, server);
+  return true;
+}
+
+static void SetReady(struct Dispatcher *d, int server) {
+  d->servers[server].state = SERVER_READY;
+  d->servers[server].last_recv_ns = NowNs();
+  if (d->on_ready)
+    d->on_ready(d->ctx, server);
+}
+
+/* Returns false if the frame was malformed and the server has been failed. */
+static bool HandleFrame(struct Dispatcher *d, int server,
+                        const struct FrameHeader *header,
+                        const uint8_t *payload) {
+  struct DispatchServer *s = &d->servers[server];
+  if (header->op == (OP_HELLO | OP_RESPONSE) && s->state == SERVER_READY &&
+      s->ping_deadline_ns != 0) {
+    /* a health check; capacity may have changed (aggregators) */
+    DecodeHelloResponse(payload, header->length, &s->tnum, &s->mults_per_sec);
+    s->ping_deadline_ns = 0;
+    return true;
+  }
+  if (header->op == (OP_HELLO | OP_RESPONSE)) {
+    if (s->state != SERVER_HANDSHAKE || header->status != STATUS_OK ||
+        !DecodeHelloResponse(payload, header->length, &s->tnum,
+                             &s->mults_per_sec)) {
+      fprintf(stderr, "Handshake with %s:%d failed\n", s->host, s->port);
+      FailServer(d, server);
+      return false;
+    }
+    if (!s->want_shm || !OfferShm(d, server))
+      SetReady(d, server);
+    return true;
+  }
+  if (header->op == (OP_SHM_ATTACH | OP_RESPONSE)) {
+    if (s->state != SERVER_HANDSHAKE || s->shm == NULL) {
+      fprintf(stderr, "Unexpected attach answer from %s:%d\n", s->host,
+              s->port);
+      FailServer(d, server);
+      return false;
+    }
+    /* both sides have it mapped now, so the name is no longer needed */
+    ShmUnlink(s->shm_name);
+    s->shm_name[0] = '\0';
+    if (header->status == STATUS_OK) {
+      s->shm_ready = true;
+    } else {
+      fprintf(stderr, "%s:%d can't use shared memory, staying on TCP\n",
+              s->host, s->port);
+      ReleaseShm(s);
+    }
+    SetReady(d, server);
+    return true;
+  }
+  if (header->op != (OP_FACTORIAL | OP_RESPONSE) &&
+      header->op != (OP_REDUCE | OP_RESPONSE)) {
+    fprintf(stderr, "Unexpected op %u from %s:%d\n", header->op, s->host,
+            s->port);
+    FailServer(d, server);
+    return false;
+  }
+
+  /* an id we don't know has already timed out: drop the late answer */
+  struct DispatchRequest *req = TakeRequest(s, header->id);
+  if (!req)
+    return true;
+  uint64_t results[FRAME_MAX_PAYLOAD / 8];
+  uint32_t results_num = header->length / 8;
+  for (uint32_t j = 0; j < results_num; j++)
+    results[j] = GetU64(payload + 8 * j);
+  s->completed++;
+  s->errors = 0;
+  if (header->status == STATUS_OK)
+    s->failures = 0;
+  req->cb(req->ctx, req->id,
+          header->status == STATUS_OK ? DISPATCH_OK : DISPATCH_REJECTED,
+          results, results_num);
+  free(req);
+  return true;
+}
+
+static void HandleReadable(struct Dispatcher *d, int server) {
+  while (true) {
+    struct DispatchServer *s = &d->servers[server];
+    ssize_t n = recv(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      fprintf(stderr, "Receive from %s:%d failed\n", s->host, s->port);
+      FailServer(d, server);
+      return;
+    }
+    s->in_len += (size_t)n;
+    s->last_recv_ns = NowNs();
+
+    size_t used = 0;
+    while (s->in_len - used >= FRAME_HEADER_SIZE) {
+      struct FrameHeader header;
+      if (!DecodeHeader(s->in + used, &header)) {
+        fprintf(stderr, "Bad frame from %s:%d\n", s->host, s->port);
+        FailServer(d, server);
+        return;
+      }
+      size_t frame_len = FRAME_HEADER_SIZE + header.length;
+      if (s->in_len - used < frame_len)
+        break;
+      if (!HandleFrame(d, server, &header, s->in + used + FRAME_HEADER_SIZE))
+        return;
+      used += frame_len;
+      /* a callback may have given up on this server */
+      if (s->state == SERVER_FAILED)
+        return;
+    }
+    memmove(s->in, s->in + used, s->in_len - used);
+    s->in_len -= used;
+  }
+}
+
+static void HandleConnected(struct Dispatcher *d, int server) {
+  struct DispatchServer *s = &d->servers[server];
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  if (err != 0) {
+    fprintf(stderr, "Connection to %s:%d failed: %s\n", s->host, s->port,
+            strerror(err));
+    FailServer(d, server);
+    return;
+  }
+  s->state = SERVER_HANDSHAKE;
+  FlushServer(d, server);
+}
+
+/* Sends an OP_HELLO to a server that has been silent for a health check
+ * interval, and fails it if the last one went unanswered. No ping is sent
+ * while requests are still waiting to go out: a server that is slow to take
+ * them is busy, and a ping queued behind them would expire before the
+ * server ever saw it. */
+static bool CheckHealth(struct Dispatcher *d, int server, uint64_t now) {
+  struct DispatchServer *s = &d->servers[server];
+  if (d->health_interval_ns == 0 || s->state != SERVER_READY)
+    return true;
+  if (s->ping_unsent > 0)
+    return true;
+  if (s->ping_deadline_ns != 0) {
+    if (now < s->ping_deadline_ns)
+      return true;
+    fprintf(stderr, "%s:%d failed its health check\n", s->host, s->port);
+    FailServer(d, server);
+    return false;
+  }
+  if (now - s->last_recv_ns >= d->health_interval_ns && s->out_len == 0) {
+    Reserve(s, FRAME_HEADER_SIZE);
+    s->out_len += EncodeHelloRequest(s->out + s->out_len, 0);
+    s->ping_unsent = s->out_len;
+    FlushServer(d, server);
+  }
+  return s->state != SERVER_FAILED;
+}
+
+static void ExpireDeadlines(struct Dispatcher *d, uint64_t now) {
+  for (int i = 0; i < d->servers_num; i++) {
+    struct DispatchServer *s = &d->servers[i];
+    if (s->state == SERVER_FAILED) {
+      if (s->retry_at_ns != 0 && now >= s->retry_at_ns)
+        DispatcherConnect(d, i);
+      continue;
+    }
+    if ((s->state == SERVER_CONNECTING || s->state == SERVER_HANDSHAKE) &&
+        now >= s->connect_deadline_ns) {
+      fprintf(stderr, "Connection to %s:%d timed out\n", s->host, s->port);
+      FailServer(d, i);
+      continue;
+    }
+
+    /* unlink first, then run the callbacks: they may submit to this server */
+    struct DispatchRequest *expired = NULL;
+    struct DispatchRequest **link = &s->inflight_head;
+    struct DispatchRequest *prev = NULL;
+    while (*link) {
+      struct DispatchRequest *req = *link;
+      if (now < req->deadline_ns) {
+        prev = req;
+        link = &req->next;
+        continue;
+      }
+      *link = req->next;
+      if (s->inflight_tail == req)
+        s->inflight_tail = prev;
+      s->inflight--;
+      s->timeouts++;
+      s->errors++;
+      req->next = expired;
+      expired = req;
+    }
+    /* the circuit opens before the callbacks run, so the work they hand
+     * back goes to other servers */
+    int threshold = s->failures > 0 ? 1 : d->breaker_errors;
+    if (expired && d->breaker_errors > 0 && s->errors >= threshold) {
+      fprintf(stderr, "%s:%d failed after %d timeouts in a row\n", s->host,
+              s->port, s->errors);
+      FailServer(d, i);
+    }
+    FailRequests(expired, DISPATCH_TIMEOUT);
+    if (s->state != SERVER_FAILED)
+      CheckHealth(d, i, now);
+  }
+}
+
+int DispatcherInit(struct Dispatcher *d, uint64_t connect_timeout_ns) {
+  memset(d, 0, sizeof(*d));
+  d->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (d->epoll_fd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+  d->next_id = 1;
+  d->connect_timeout_ns = connect_timeout_ns;
+  return 0;
+}
+
+void DispatcherEnableRecovery(struct Dispatcher *d) {
+  d->backoff_min_ns = 100 * NS_PER_MS;
+  d->backoff_max_ns = 5000 * NS_PER_MS;
+  d->breaker_errors = 3;
+  d->health_interval_ns = 1000 * NS_PER_MS;
+}
+
+void DispatcherDestroy(struct Dispatcher *d) {
+  for (int i = 0; i < d->servers_num; i++) {
+    struct DispatchServer *s = &d->servers[i];
+    if (s->fd >= 0)
+      close(s->fd);
+    ReleaseShm(s);
+    for (struct DispatchRequest *req = s->inflight_head; req;) {
+      struct DispatchRequest *next = req->next;
+      free(req);
+      req = next;
+    }
+    free(s->out);
+  }
+  free(d->servers);
+  free(d->cache);
+  close(d->epoll_fd);
+  memset(d, 0, sizeof(*d));
+}
+
+int DispatcherAddServer(struct Dispatcher *d, const char *host, int port) {
+  if (d->servers_num == d->servers_cap) {
+    d->servers_cap = d->servers_cap ? d->servers_cap * 2 : 16;
+    d->servers = realloc(d->servers, d->servers_cap * sizeof(*d->servers));
+  }
+  struct DispatchServer *s = &d->servers[d->servers_num];
+  memset(s, 0, sizeof(*s));
+  snprintf(s->host, sizeof(s->host), "%s", host);
+  s->port = port;
+  s->fd = -1;
+  s->state = SERVER_IDLE;
+  int server = d->servers_num++;
+  if (d->on_added)
+    d->on_added(d->ctx, server);
+  return server;
+}
+
+struct ServerEntry {
+  char host[256];
+  int port;
+  bool shm;
+};
+
+/* Returns the number of valid lines (entries malloc'ed) or -1. */
+static int ReadServersFile(const char *path, struct ServerEntry **entries) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror("Cannot open servers file");
+    return -1;
+  }
+  int num = 0;
+  int cap = 16;
+  *entries = malloc(sizeof(struct ServerEntry) * cap);
+  char line[512];
+  int line_num = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_num++;
+    const char *text = line + strspn(line, " \t\r\n");
+    if (*text == '\0')
+      continue;
+    if (num == cap) {
+      cap *= 2;
+      *entries = realloc(*entries, sizeof(struct ServerEntry) * cap);
+    }
+    struct ServerEntry *entry = &(*entries)[num];
+    entry->shm = strncmp(text, "shm:", 4) == 0;
+    if (entry->shm)
+      text += 4;
+    if (sscanf(text, "%255[^:]:%d", entry->host, &entry->port) != 2 ||
+        entry->port <= 0 || entry->port > 65535) {
+      fprintf(stderr, "%s:%d: expected [shm:]host:port\n", path, line_num);
+      continue;
+    }
+    num++;
+  }
+  fclose(file);
+  return num;
+}
+
+static int AddEntry(struct Dispatcher *d, const struct ServerEntry *entry) {
+  int server = DispatcherAddServer(d, entry->host, entry->port);
+  d->servers[server].want_shm = entry->shm;
+  d->servers[server].from_file = true;
+  return server;
+}
+
+int DispatcherAddServersFromFile(struct Dispatcher *d, const char *path) {
+  struct ServerEntry *entries;
+  int num = ReadServersFile(path, &entries);
+  if (num < 0)
+    return -1;
+  for (int i = 0; i < num; i++)
+    AddEntry(d, &entries[i]);
+  free(entries);
+  return d->servers_num;
+}
+
+static bool SameEntry(const struct DispatchServer *s,
+                      const struct ServerEntry *entry) {
+  return s->from_file && s->port == entry->port && s->want_shm == entry->shm &&
+         strcmp(s->host, entry->host) == 0;
+}
+
+/* Server slots are never freed, since callers index their own state by
+ * them: a removed server stays failed and is reused if its line returns. */
+static void ReloadServersFile(struct Dispatcher *d) {
+  struct ServerEntry *entries;
+  int num = ReadServersFile(d->watch_path, &entries);
+  if (num < 0)
+    return;
+  if (num == 0) {
+    /* most likely caught halfway through being rewritten */
+    fprintf(stderr, "%s is empty, keeping the current servers\n",
+            d->watch_path);
+    free(entries);
+    return;
+  }
+
+  int old_num = d->servers_num;
+  bool *kept = calloc(old_num ? old_num : 1, sizeof(bool));
+  int added = 0;
+  int removed = 0;
+  for (int e = 0; e < num; e++) {
+    for (int copy = 0; copy < d->watch_copies; copy++) {
+      /* a live server first, then one that was removed earlier */
+      int match = -1;
+      for (int pass = 0; pass < 2 && match < 0; pass++)
+        for (int i = 0; i < old_num && match < 0; i++)
+          if (!kept[i] && d->servers[i].removed == (pass == 1) &&
+              SameEntry(&d->servers[i], &entries[e]))
+            match = i;
+      if (match >= 0) {
+        kept[match] = true;
+        if (d->servers[match].removed) {
+          d->servers[match].removed = false;
+          d->servers[match].failures = 0;
+          DispatcherConnect(d, match);
+          added++;
+        }
+        continue;
+      }
+      DispatcherConnect(d, AddEntry(d, &entries[e]));
+      added++;
+    }
+  }
+  for (int i = 0; i < old_num; i++) {
+    struct DispatchServer *s = &d->servers[i];
+    if (kept[i] || !s->from_file || s->removed)
+      continue;
+    s->removed = true;
+    s->retry_at_ns = 0;
+    FailServer(d, i);
+    removed++;
+  }
+  if (added > 0 || removed > 0)
+    fprintf(stderr, "Reloaded %s: %d servers added, %d removed\n",
+            d->watch_path, added, removed);
+  free(kept);
+  free(entries);
+}
+
+void DispatcherWatchServersFile(struct Dispatcher *d, const char *path,
+                                int copies) {
+  snprintf(d->watch_path, sizeof(d->watch_path), "%s", path);
+  d->watch_copies = copies > 0 ? copies : 1;
+  struct stat st;
+  if (stat(path, &st) == 0)
+    d->watch_mtime = st.st_mtim;
+  d->next_watch_ns = NowNs() + WATCH_INTERVAL_NS;
+}
+
+static void CheckServersFile(struct Dispatcher *d, uint64_t now) {
+  if (d->watch_path[0] == '\0' || now < d->next_watch_ns)
+    return;
+  d->next_watch_ns = now + WATCH_INTERVAL_NS;
+  struct stat st;
+  if (stat(d->watch_path, &st) < 0 ||
+      (st.st_mtim.tv_sec == d->watch_mtime.tv_sec &&
+       st.st_mtim.tv_nsec == d->watch_mtime.tv_nsec))
+    return;
+  d->watch_mtime = st.st_mtim;
+  ReloadServersFile(d);
+}
+
+void DispatcherConnect(struct Dispatcher *d, int server) {
+  struct DispatchServer *s = &d->servers[server];
+  /* a reconnect starts from scratch; FailServer ignores failed servers */
+  s->state = SERVER_IDLE;
+  s->retry_at_ns = 0;
+  s->in_len = 0;
+  s->out_len = 0;
+  s->ping_deadline_ns = 0;
+  s->ping_unsent = 0;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(s->port);
+  if (!Resolve(d, s->host, &addr.sin_addr)) {
+    FailServer(d, server);
+    return;
+  }
+
+  s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s->fd < 0) {
+    perror("socket");
+    FailServer(d, server);
+    return;
+  }
+  int one = 1;
+  setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  /* the hello goes out first, ahead of anything submitted while connecting */
+  Reserve(s, FRAME_HEADER_SIZE);
+  s->out_len += EncodeHelloRequest(s->out + s->out_len, 0);
+  s->connect_deadline_ns = NowNs() + d->connect_timeout_ns;
+
+  int rc = connect(s->fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (rc < 0 && errno != EINPROGRESS) {
+    fprintf(stderr, "Connection to %s:%d failed: %s\n", s->host, s->port,
+            strerror(errno));
+    FailServer(d, server);
+    return;
+  }
+  s->state = rc == 0 ? SERVER_HANDSHAKE : SERVER_CONNECTING;
+  s->want_write = true;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.u32 = (uint32_t)server;
+  if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+    perror("epoll_ctl");
+    FailServer(d, server);
+  }
+}
+
+static struct DispatchRequest *Track(struct Dispatcher *d,
+                                     struct DispatchServer *s,
+                                     uint64_t timeout_ns, ResponseFn cb,
+                                     void *ctx) {
+  struct DispatchRequest *entry = malloc(sizeof(*entry));
+  entry->id = d->next_id++;
+  entry->deadline_ns = NowNs() + timeout_ns;
+  entry->cb = cb;
+  entry->ctx = ctx;
+  entry->next = NULL;
+  if (s->inflight_tail)
+    s->inflight_tail->next = entry;
+  else
+    s->inflight_head = entry;
+  s->inflight_tail = entry;
+  s->inflight++;
+  return entry;
+}
+
+/* The tighter of the caller's and the request's own deadline. */
+static uint32_t WireTimeout(uint32_t requested_ms, uint64_t timeout_ns) {
+  uint64_t timeout_ms = (timeout_ns + NS_PER_MS - 1) / NS_PER_MS;
+  if (timeout_ms > UINT32_MAX)
+    timeout_ms = UINT32_MAX;
+  if (requested_ms == 0 || requested_ms > timeout_ms)
+    return (uint32_t)timeout_ms;
+  return requested_ms;
+}
+
+uint64_t DispatcherSubmit(struct Dispatcher *d, int server,
+                          const struct FactorialRequest *req,
+                          uint64_t timeout_ns, ResponseFn cb, void *ctx) {
+  struct DispatchServer *s = &d->servers[server];
+  if (s->state == SERVER_IDLE || s->state == SERVER_FAILED)
+    return 0;
+
+  struct DispatchRequest *entry = Track(d, s, timeout_ns, cb, ctx);
+  struct FactorialRequest sent = *req;
+  sent.timeout_ms = WireTimeout(req->timeout_ms, timeout_ns);
+
+  /* a full ring falls back to the TCP connection, which is still served */
+  if (s->shm_ready) {
+    uint8_t frame[REQUEST_FRAME_MAX];
+    size_t len = EncodeFactorialRequest(frame, entry->id, &sent);
+    if (ShmPush(&s->shm->requests, frame, len))
+      return entry->id;
+  }
+
+  /* frames are only buffered here; DispatcherPoll sends them in one go */
+  Reserve(s, REQUEST_FRAME_MAX);
+  s->out_len += EncodeFactorialRequest(s->out + s->out_len, entry->id, &sent);
+  UpdateInterest(d, server);
+  return entry->id;
+}
+
+uint64_t DispatcherSubmitReduce(struct Dispatcher *d, int server,
+                                const struct ReduceRequest *req,
+                                uint64_t timeout_ns, ResponseFn cb,
+                                void *ctx) {
+  struct DispatchServer *s = &d->servers[server];
+  if (s->state == SERVER_IDLE || s->state == SERVER_FAILED)
+    return 0;
+
+  struct DispatchRequest *entry = Track(d, s, timeout_ns, cb, ctx);
+  struct ReduceRequest sent = *req;
+  sent.timeout_ms = WireTimeout(req->timeout_ms, timeout_ns);
+  Reserve(s, FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+  s->out_len += EncodeReduceRequest(s->out + s->out_len, entry->id, &sent);
+  UpdateInterest(d, server);
+  return entry->id;
+}
+
+void *DispatcherCancel(struct Dispatcher *d, int server, uint64_t id) {
+  struct DispatchServer *s = &d->servers[server];
+  struct DispatchRequest *req = TakeRequest(s, id);
+  if (!req)
+    return NULL;
+  void *ctx = req->ctx;
+  free(req);
+  if (s->state != SERVER_FAILED) {
+    Reserve(s, FRAME_HEADER_SIZE);
+    s->out_len += EncodeCancel(s->out + s->out_len, id);
+    UpdateInterest(d, server);
+  }
+  return ctx;
+}
+
+static int DrainShm(struct Dispatcher *d) {
+  int handled = 0;
+  uint8_t frame[SHM_SLOT_SIZE];
+  for (int i = 0; i < d->servers_num; i++) {
+    size_t len;
+    int before = handled;
+    while (d->servers[i].shm_ready &&
+           (len = ShmPop(&d->servers[i].shm->responses, frame)) > 0) {
+      struct FrameHeader header;
+      if (!DecodeHeader(frame, &header) ||
+          FRAME_HEADER_SIZE + header.length != len) {
+        fprintf(stderr, "Bad frame from %s:%d\n", d->servers[i].host,
+                d->servers[i].port);
+        FailServer(d, i);
+        break;
+      }
+      if (!HandleFrame(d, i, &header, frame + FRAME_HEADER_SIZE))
+        break;
+      handled++;
+    }
+    if (handled > before)
+      d->servers[i].last_recv_ns = NowNs();
+  }
+  return handled;
+}
+
+/* Only one ring can be slept on. With a single busy local server and no
+ * TCP traffic that is the fast path; otherwise rings are polled and epoll
+ * waits at most a millisecond. */
+static int WaitShm(struct Dispatcher *d, int *timeout_ms) {
+  int handled = DrainShm(d);
+  int busy = -1;
+  int busy_num = 0;
+  bool tcp_busy = false;
+  for (int i = 0; i < d->servers_num; i++) {
+    struct DispatchServer *s = &d->servers[i];
+    if (s->shm_ready && s->inflight > 0) {
+      busy = i;
+      busy_num++;
+    } else if (s->state == SERVER_CONNECTING ||
+               s->state == SERVER_HANDSHAKE ||
+               (s->state == SERVER_READY && s->inflight > 0)) {
+      tcp_busy = true;
+    }
+  }
+  if (busy_num == 0 || handled > 0 || *timeout_ms == 0) {
+    if (handled > 0)
+      *timeout_ms = 0;
+    return handled;
+  }
+
+  if (busy_num == 1 && !tcp_busy) {
+    ShmWait(&d->servers[busy].shm->responses, SHM_SPIN_NS,
+            (uint64_t)*timeout_ms * NS_PER_MS);
+  } else {
+    uint64_t spin_until = NowNs() + SHM_SPIN_NS;
+    while (NowNs() < spin_until && (handled = DrainShm(d)) == 0)
+      ;
+    if (*timeout_ms > 1)
+      *timeout_ms = 1;
+  }
+  handled += DrainShm(d);
+  if (handled > 0)
+    *timeout_ms = 0;
+  return handled;
+}
+
+int DispatcherPoll(struct Dispatcher *d, int timeout_ms) {
+  /* wake up in time to notice expired deadlines */
+  if (timeout_ms < 0 || timeout_ms > (int)(SCAN_INTERVAL_NS / 1000000))
+    timeout_ms = (int)(SCAN_INTERVAL_NS / 1000000);
+
+  int handled = WaitShm(d, &timeout_ms);
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(d->epoll_fd, events, MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR)
+      return handled;
+    perror("epoll_wait");
+    return -1;
+  }
+
+  for (int e = 0; e < n; e++) {
+    int server = (int)events[e].data.u32;
+    uint32_t mask = events[e].events;
+    switch (d->servers[server].state) {
+    case SERVER_CONNECTING:
+      HandleConnected(d, server);
+      break;
+    case SERVER_HANDSHAKE:
+    case SERVER_READY:
+      if (mask & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        HandleReadable(d, server);
+      if ((mask & EPOLLOUT) && d->servers[server].state != SERVER_FAILED)
+        FlushServer(d, server);
+      break;
+    default:
+      break;
+    }
+  }
+
+  uint64_t now = NowNs();
+  if (now >= d->next_scan_ns) {
+    ExpireDeadlines(d, now);
+    CheckServersFile(d, now);
+    d->next_scan_ns = now + SCAN_INTERVAL_NS;
+  }
+  return n + handled;
+}
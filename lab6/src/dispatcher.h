@@ -0,0 +1,174 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "shmring.h"
+
+/* Single-threaded, epoll-driven connection manager for many factorial
+ * servers: non-blocking connects, the OP_HELLO handshake, pipelined
+ * requests matched by id, and per-request deadlines. Everything happens
+ * inside DispatcherPoll, which invokes the callbacks below. */
+
+#define DISPATCH_OK 0
+#define DISPATCH_FAILED -1   /* connection to the server broke */
+#define DISPATCH_TIMEOUT -2  /* deadline passed; a late answer is ignored */
+#define DISPATCH_REJECTED -3 /* server answered with a non-OK status */
+
+enum ServerConnState {
+  SERVER_IDLE,
+  SERVER_CONNECTING,
+  SERVER_HANDSHAKE,
+  SERVER_READY,
+  SERVER_FAILED
+};
+
+typedef void (*ResponseFn)(void *ctx, uint64_t id, int status,
+                           const uint64_t *results, uint32_t results_num);
+typedef void (*ServerEventFn)(void *ctx, int server);
+
+struct DispatchRequest {
+  uint64_t id;
+  uint64_t deadline_ns;
+  ResponseFn cb;
+  void *ctx;
+  struct DispatchRequest *next;
+};
+
+struct DispatchServer {
+  char host[256];
+  int port;
+  enum ServerConnState state;
+  int fd;
+  uint64_t connect_deadline_ns;
+
+  uint32_t tnum;
+  uint64_t mults_per_sec;
+
+  /* "shm:host:port": after the handshake, requests and responses move to
+   * a shared-memory segment if the server can map it */
+  bool want_shm;
+  bool shm_ready;
+  struct ShmSegment *shm;
+  char shm_name[SHM_NAME_MAX]; /* until the server has attached */
+
+  uint8_t *out;
+  size_t out_len;
+  size_t out_cap;
+  bool want_write;
+  uint8_t in[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+  size_t in_len;
+
+  struct DispatchRequest *inflight_head;
+  struct DispatchRequest *inflight_tail;
+  int inflight;
+
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t timeouts;
+
+  /* circuit breaker, see DispatcherEnableRecovery */
+  int failures;              /* failures since a request last succeeded */
+  int errors;                /* consecutive timed-out requests */
+  uint64_t retry_at_ns;      /* while failed: reconnect then (0: never) */
+  uint64_t last_recv_ns;
+  uint64_t ping_deadline_ns; /* health check outstanding until then */
+  size_t ping_unsent;        /* bytes of out up to the end of a queued ping */
+  bool from_file;
+  bool removed;              /* no longer in the watched servers file */
+};
+
+/* host -> IPv4 address, so each distinct name is resolved only once */
+struct AddrCacheEntry {
+  char host[256];
+  bool ok;
+  struct in_addr addr;
+};
+
+struct Dispatcher {
+  int epoll_fd;
+  struct DispatchServer *servers;
+  int servers_num;
+  int servers_cap;
+  uint64_t next_id;
+  uint64_t connect_timeout_ns;
+  uint64_t next_scan_ns;
+
+  /* recovery, all off after DispatcherInit */
+  uint64_t backoff_min_ns;     /* 0: a failed server stays failed */
+  uint64_t backoff_max_ns;
+  int breaker_errors;          /* timeouts in a row that fail a server */
+  uint64_t health_interval_ns; /* 0: no health checks */
+
+  char watch_path[255];
+  int watch_copies;
+  struct timespec watch_mtime;
+  uint64_t next_watch_ns;
+
+  ServerEventFn on_added;
+  ServerEventFn on_ready;
+  ServerEventFn on_failed;
+  void *ctx;
+
+  struct AddrCacheEntry *cache;
+  size_t cache_num;
+  size_t cache_cap;
+};
+
+int DispatcherInit(struct Dispatcher *d, uint64_t connect_timeout_ns);
+void DispatcherDestroy(struct Dispatcher *d);
+
+/* Turns a failure into a circuit breaker instead of a permanent state: a
+ * failed server is reconnected after an exponential backoff with jitter,
+ * several timeouts in a row fail it like a broken connection (a single
+ * one if it has failed before without answering since), and a server that
+ * has been silent for a while must answer an OP_HELLO within the connect
+ * timeout. Failing a server fails its requests with DISPATCH_FAILED, so
+ * callers can move the work elsewhere right away. */
+void DispatcherEnableRecovery(struct Dispatcher *d);
+
+/* Returns the server index. Connecting starts with DispatcherConnect. */
+int DispatcherAddServer(struct Dispatcher *d, const char *host, int port);
+/* Adds every "host:port" or "shm:host:port" line of the file; returns the
+ * server count or -1 if the file can't be read. Malformed lines are
+ * reported and skipped. */
+int DispatcherAddServersFromFile(struct Dispatcher *d, const char *path);
+void DispatcherConnect(struct Dispatcher *d, int server);
+/* Re-reads path whenever it changes: new entries are added and connected,
+ * entries that are gone are failed for good. Each line stands for copies
+ * servers, as when the file was added that many times. */
+void DispatcherWatchServersFile(struct Dispatcher *d, const char *path,
+                                int copies);
+
+/* Queues a request on a server that is connecting or ready. Returns the
+ * request id, or 0 if the server has failed. cb runs from DispatcherPoll
+ * exactly once: with the results, on failure, or at the deadline. The
+ * deadline also goes out in the request, so the server gives up then too. */
+uint64_t DispatcherSubmit(struct Dispatcher *d, int server,
+                          const struct FactorialRequest *req,
+                          uint64_t timeout_ns, ResponseFn cb, void *ctx);
+
+/* Same for OP_REDUCE; results are the REDUCE_RESULTS words of
+ * EncodeReduceStats. Always sent over TCP, shm sessions only compute
+ * factorials. */
+uint64_t DispatcherSubmitReduce(struct Dispatcher *d, int server,
+                                const struct ReduceRequest *req,
+                                uint64_t timeout_ns, ResponseFn cb,
+                                void *ctx);
+
+/* Forgets a request and tells the server to stop working on it. The
+ * callback will not run; returns its ctx (NULL if the request already
+ * finished) so the caller can release it. */
+void *DispatcherCancel(struct Dispatcher *d, int server, uint64_t id);
+
+/* Waits up to timeout_ms for network events and expired deadlines and
+ * runs the callbacks. Returns -1 on an epoll error. */
+int DispatcherPoll(struct Dispatcher *d, int timeout_ms);
+
+#endif
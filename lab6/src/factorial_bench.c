@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include "common.h"
+
+/* The original server loop: one MultModulo chain. */
+uint64_t FactorialSerial(uint64_t begin, uint64_t end, uint64_t mod) {
+  uint64_t ans = 1;
+  for (uint64_t i = begin; i <= end; i++) {
+    ans = MultModulo(ans, i, mod);
+  }
+  return ans;
+}
+
+double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  uint64_t k = 10000000;
+
+  while (true) {
+    static struct option options[] = {{"k", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    if (c == 0 && option_index == 0) {
+      k = strtoull(optarg, NULL, 10);
+    } else {
+      fprintf(stderr, "Using: %s --k 10000000\n", argv[0]);
+      return 1;
+    }
+  }
+
+  const uint64_t mods[] = {1009, 1000003, 2147483647, 4294967291ull,
+                           1000000000039ull, 4611686018427387847ull,
+                           18446744073709551557ull};
+  const int lanes[] = {1, 2, 4, 8};
+
+  printf("%-20s %12s", "mod", "serial ns/i");
+  for (size_t l = 0; l < sizeof(lanes) / sizeof(lanes[0]); l++)
+    printf("   lanes=%d ns/i", lanes[l]);
+  printf("\n");
+
+  for (size_t m = 0; m < sizeof(mods) / sizeof(mods[0]); m++) {
+    double start = Now();
+    uint64_t expected = FactorialSerial(1, k, mods[m]);
+    printf("%-20lu %12.2f", mods[m], (Now() - start) * 1e9 / k);
+
+    for (size_t l = 0; l < sizeof(lanes) / sizeof(lanes[0]); l++) {
+      start = Now();
+      uint64_t got = FactorialInterleaved(1, k, mods[m], lanes[l]);
+      printf(" %15.2f", (Now() - start) * 1e9 / k);
+      if (got != expected) {
+        printf("\nMismatch: lanes=%d got %lu expected %lu\n", lanes[l], got,
+               expected);
+        return 1;
+      }
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,348 @@
+#include "factorial_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dispatcher.h"
+#include "stats.h"
+
+#define NS_PER_MS 1000000ULL
+
+/* One submitted request, found by handle while it is outstanding and,
+ * without a callback, until FactorialClientWait collects it. */
+struct Call {
+  struct FactorialClient *client;
+  uint64_t handle;
+  struct FactorialRequest req;
+  uint64_t deadline_ns;
+  int server;
+  uint64_t id; /* dispatcher id of the current attempt */
+  int attempts;
+  FactorialDoneFn cb;
+  void *ctx;
+  bool done;
+  int status;
+  uint64_t results[MAX_MODS];
+  struct Call *next;
+};
+
+struct FactorialClient {
+  struct Dispatcher net;
+  struct FactorialClientOptions options;
+  uint64_t next_handle;
+  size_t pending;
+  int finished; /* callbacks run by the current Poll */
+
+  struct Call **buckets;
+  size_t buckets_num;
+  size_t calls_num;
+};
+
+static size_t Bucket(const struct FactorialClient *c, uint64_t handle) {
+  return (size_t)(handle * 0x9e3779b97f4a7c15ULL >> 20) & (c->buckets_num - 1);
+}
+
+static void InsertCall(struct FactorialClient *c, struct Call *call) {
+  if (c->calls_num + 1 > c->buckets_num) {
+    size_t buckets_num = c->buckets_num ? c->buckets_num * 2 : 1024;
+    struct Call **buckets = calloc(buckets_num, sizeof(*buckets));
+    size_t old_num = c->buckets_num;
+    struct Call **old = c->buckets;
+    c->buckets = buckets;
+    c->buckets_num = buckets_num;
+    for (size_t i = 0; i < old_num; i++) {
+      while (old[i]) {
+        struct Call *moved = old[i];
+        old[i] = moved->next;
+        size_t b = Bucket(c, moved->handle);
+        moved->next = buckets[b];
+        buckets[b] = moved;
+      }
+    }
+    free(old);
+  }
+  size_t b = Bucket(c, call->handle);
+  call->next = c->buckets[b];
+  c->buckets[b] = call;
+  c->calls_num++;
+}
+
+static struct Call *FindCall(struct FactorialClient *c, uint64_t handle) {
+  if (c->buckets_num == 0)
+    return NULL;
+  struct Call *call = c->buckets[Bucket(c, handle)];
+  while (call && call->handle != handle)
+    call = call->next;
+  return call;
+}
+
+static void RemoveCall(struct FactorialClient *c, struct Call *call) {
+  struct Call **link = &c->buckets[Bucket(c, call->handle)];
+  while (*link != call)
+    link = &(*link)->next;
+  *link = call->next;
+  c->calls_num--;
+}
+
+/* Fewest requests in flight per advertised thread. */
+static int PickServer(struct FactorialClient *c) {
+  int best = -1;
+  double best_load = 0;
+  for (int i = 0; i < c->net.servers_num; i++) {
+    struct DispatchServer *s = &c->net.servers[i];
+    if (s->state != SERVER_READY)
+      continue;
+    double load = (s->inflight + 1.0) / (s->tnum ? s->tnum : 1);
+    if (best < 0 || load < best_load) {
+      best = i;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+static void OnResponse(void *ctx, uint64_t id, int status,
+                       const uint64_t *results, uint32_t results_num);
+
+static bool Send(struct Call *call) {
+  struct FactorialClient *c = call->client;
+  uint64_t now = NowNs();
+  int server = PickServer(c);
+  if (server < 0 || now >= call->deadline_ns)
+    return false;
+  call->attempts++;
+  call->server = server;
+  call->id = DispatcherSubmit(&c->net, server, &call->req,
+                              call->deadline_ns - now, OnResponse, call);
+  return call->id != 0;
+}
+
+static void Finish(struct Call *call, int status, const uint64_t *results,
+                   size_t results_num) {
+  struct FactorialClient *c = call->client;
+  c->pending--;
+  c->finished++;
+  if (results_num > call->req.mods_num)
+    results_num = call->req.mods_num;
+  if (call->cb) {
+    /* unlinked first: the callback may submit or cancel */
+    RemoveCall(c, call);
+    call->cb(call->ctx, call->handle, status, results, results_num);
+    free(call);
+    return;
+  }
+  call->done = true;
+  call->status = status;
+  if (results_num > 0)
+    memcpy(call->results, results, sizeof(uint64_t) * results_num);
+}
+
+static void OnResponse(void *ctx, uint64_t id, int status,
+                       const uint64_t *results, uint32_t results_num) {
+  (void)id;
+  struct Call *call = (struct Call *)ctx;
+  if (status == DISPATCH_OK && results_num == call->req.mods_num) {
+    Finish(call, FACTORIAL_OK, results, results_num);
+    return;
+  }
+  /* a broken connection says nothing about the request: try elsewhere */
+  if (status == DISPATCH_FAILED &&
+      call->attempts < call->client->options.max_attempts && Send(call))
+    return;
+  int result = status == DISPATCH_TIMEOUT    ? FACTORIAL_TIMEOUT
+               : status == DISPATCH_FAILED ? FACTORIAL_FAILED
+                                           : FACTORIAL_REJECTED;
+  Finish(call, result, NULL, 0);
+}
+
+void FactorialClientDefaults(struct FactorialClientOptions *options) {
+  options->conns_per_server = 1;
+  options->timeout_ms = 30000;
+  options->connect_timeout_ms = 2000;
+  options->max_attempts = 3;
+}
+
+struct FactorialClient *FactorialClientCreate(
+    const struct FactorialClientOptions *options) {
+  struct FactorialClient *c = calloc(1, sizeof(struct FactorialClient));
+  if (c == NULL)
+    return NULL;
+  if (options)
+    c->options = *options;
+  else
+    FactorialClientDefaults(&c->options);
+  if (c->options.conns_per_server < 1)
+    c->options.conns_per_server = 1;
+  if (c->options.max_attempts < 1)
+    c->options.max_attempts = 1;
+  if (DispatcherInit(&c->net, c->options.connect_timeout_ms * NS_PER_MS) < 0) {
+    free(c);
+    return NULL;
+  }
+  DispatcherEnableRecovery(&c->net);
+  c->next_handle = 1;
+  return c;
+}
+
+void FactorialClientDestroy(struct FactorialClient *c) {
+  DispatcherDestroy(&c->net);
+  for (size_t i = 0; i < c->buckets_num; i++) {
+    while (c->buckets[i]) {
+      struct Call *call = c->buckets[i];
+      c->buckets[i] = call->next;
+      free(call);
+    }
+  }
+  free(c->buckets);
+  free(c);
+}
+
+int FactorialClientAddServer(struct FactorialClient *c, const char *host,
+                             int port) {
+  bool shm = strncmp(host, "shm:", 4) == 0;
+  for (int i = 0; i < c->options.conns_per_server; i++) {
+    int server = DispatcherAddServer(&c->net, shm ? host + 4 : host, port);
+    c->net.servers[server].want_shm = shm;
+  }
+  return 0;
+}
+
+int FactorialClientAddServersFromFile(struct FactorialClient *c,
+                                      const char *path) {
+  int before = c->net.servers_num;
+  for (int i = 0; i < c->options.conns_per_server; i++)
+    if (DispatcherAddServersFromFile(&c->net, path) < 0)
+      return -1;
+  return (c->net.servers_num - before) / c->options.conns_per_server;
+}
+
+int FactorialClientConnect(struct FactorialClient *c, int timeout_ms) {
+  for (int i = 0; i < c->net.servers_num; i++)
+    if (c->net.servers[i].state == SERVER_IDLE)
+      DispatcherConnect(&c->net, i);
+
+  uint64_t deadline = NowNs() + (uint64_t)timeout_ms * NS_PER_MS;
+  while (true) {
+    int ready = 0;
+    int pending = 0;
+    for (int i = 0; i < c->net.servers_num; i++) {
+      enum ServerConnState state = c->net.servers[i].state;
+      ready += state == SERVER_READY;
+      pending += state == SERVER_CONNECTING || state == SERVER_HANDSHAKE;
+    }
+    if (pending == 0 || (timeout_ms >= 0 && NowNs() >= deadline))
+      return ready;
+    if (DispatcherPoll(&c->net, 10) < 0)
+      return ready;
+  }
+}
+
+uint64_t FactorialClientSubmit(struct FactorialClient *c, uint64_t begin,
+                               uint64_t end, const uint64_t *mods,
+                               size_t mods_num, FactorialDoneFn cb,
+                               void *ctx) {
+  if (mods_num == 0 || mods_num > MAX_MODS)
+    return 0;
+  for (size_t j = 0; j < mods_num; j++)
+    if (mods[j] == 0)
+      return 0;
+
+  struct Call *call = malloc(sizeof(struct Call));
+  if (call == NULL)
+    return 0;
+  call->client = c;
+  call->handle = c->next_handle;
+  call->req.begin = begin;
+  call->req.end = end;
+  call->req.mods_num = (uint32_t)mods_num;
+  call->req.timeout_ms = 0;
+  memcpy(call->req.mods, mods, sizeof(uint64_t) * mods_num);
+  call->deadline_ns = NowNs() + c->options.timeout_ms * NS_PER_MS;
+  call->attempts = 0;
+  call->cb = cb;
+  call->ctx = ctx;
+  call->done = false;
+  if (!Send(call)) {
+    free(call);
+    return 0;
+  }
+  c->next_handle++;
+  c->pending++;
+  InsertCall(c, call);
+  return call->handle;
+}
+
+bool FactorialClientCancel(struct FactorialClient *c, uint64_t handle) {
+  struct Call *call = FindCall(c, handle);
+  if (call == NULL)
+    return false;
+  RemoveCall(c, call);
+  bool was_pending = !call->done;
+  if (was_pending) {
+    DispatcherCancel(&c->net, call->server, call->id);
+    c->pending--;
+  }
+  free(call);
+  return was_pending;
+}
+
+int FactorialClientFd(const struct FactorialClient *c) {
+  return c->net.epoll_fd;
+}
+
+int FactorialClientPoll(struct FactorialClient *c, int timeout_ms) {
+  c->finished = 0;
+  if (DispatcherPoll(&c->net, timeout_ms) < 0)
+    return -1;
+  return c->finished;
+}
+
+size_t FactorialClientPending(const struct FactorialClient *c) {
+  return c->pending;
+}
+
+/* Milliseconds left until deadline, for a Poll timeout; -1 if unlimited. */
+static int Remaining(uint64_t deadline, bool unlimited) {
+  if (unlimited)
+    return -1;
+  uint64_t now = NowNs();
+  return now >= deadline ? 0 : (int)((deadline - now + NS_PER_MS - 1) /
+                                      NS_PER_MS);
+}
+
+int FactorialClientWait(struct FactorialClient *c, uint64_t handle,
+                        uint64_t *results, size_t results_num,
+                        int timeout_ms) {
+  struct Call *call = FindCall(c, handle);
+  if (call == NULL || call->cb)
+    return FACTORIAL_FAILED;
+  uint64_t deadline = NowNs() + (uint64_t)timeout_ms * NS_PER_MS;
+  while (!call->done) {
+    int left = Remaining(deadline, timeout_ms < 0);
+    if (left == 0)
+      return FACTORIAL_PENDING;
+    if (DispatcherPoll(&c->net, left) < 0)
+      return FACTORIAL_FAILED;
+  }
+
+  int status = call->status;
+  if (status == FACTORIAL_OK) {
+    if (results_num > call->req.mods_num)
+      results_num = call->req.mods_num;
+    memcpy(results, call->results, sizeof(uint64_t) * results_num);
+  }
+  RemoveCall(c, call);
+  free(call);
+  return status;
+}
+
+size_t FactorialClientWaitAll(struct FactorialClient *c, int timeout_ms) {
+  uint64_t deadline = NowNs() + (uint64_t)timeout_ms * NS_PER_MS;
+  while (c->pending > 0) {
+    int left = Remaining(deadline, timeout_ms < 0);
+    if (left == 0 || DispatcherPoll(&c->net, left) < 0)
+      break;
+  }
+  return c->pending;
+}
@@ -0,0 +1,97 @@
+#ifndef FACTORIAL_CLIENT_H
+#define FACTORIAL_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Embeddable asynchronous client for the factorial servers, shipped as
+ * libfactorial_client.a. One FactorialClient keeps a pool of connections
+ * (TCP, or shared memory for "shm:" entries) and pipelines any number of
+ * requests over them from a single thread. Nothing blocks except
+ * FactorialClientPoll and the Wait calls, which run the callbacks.
+ *
+ *   struct FactorialClient *c = FactorialClientCreate(NULL);
+ *   FactorialClientAddServersFromFile(c, "servers.txt");
+ *   FactorialClientConnect(c, 2000);
+ *   uint64_t mod = 1000000007;
+ *   uint64_t h = FactorialClientSubmit(c, 1, 1000000, &mod, 1, NULL, NULL);
+ *   uint64_t result;
+ *   if (FactorialClientWait(c, h, &result, 1, -1) == FACTORIAL_OK) ...
+ *   FactorialClientDestroy(c);
+ *
+ * A server whose connection breaks, that stops answering health checks,
+ * or that times out several requests in a row is reconnected in the
+ * background with exponential backoff; its requests move to other servers.
+ *
+ * To drive it from another event loop, add FactorialClientFd to it and call
+ * FactorialClientPoll(c, 0) when that fd is readable, and at least every
+ * few milliseconds while requests are outstanding (deadlines). */
+
+#define FACTORIAL_OK 0
+#define FACTORIAL_FAILED -1   /* no server could be reached for it */
+#define FACTORIAL_TIMEOUT -2  /* not answered within timeout_ms */
+#define FACTORIAL_REJECTED -3 /* a server refused or could not compute it */
+#define FACTORIAL_PENDING 1   /* FactorialClientWait timed out first */
+
+struct FactorialClient;
+
+/* cb gets one result per modulus, in the order they were submitted. */
+typedef void (*FactorialDoneFn)(void *ctx, uint64_t handle, int status,
+                                const uint64_t *results, size_t results_num);
+
+struct FactorialClientOptions {
+  int conns_per_server;        /* default 1 */
+  uint32_t timeout_ms;         /* per request, retries included; 30000 */
+  uint32_t connect_timeout_ms; /* 2000 */
+  int max_attempts;            /* servers tried when a connection drops; 3 */
+};
+
+void FactorialClientDefaults(struct FactorialClientOptions *options);
+/* options may be NULL for the defaults. Returns NULL on failure. */
+struct FactorialClient *FactorialClientCreate(
+    const struct FactorialClientOptions *options);
+/* Cancels everything outstanding without calling the callbacks. */
+void FactorialClientDestroy(struct FactorialClient *client);
+
+/* host may be prefixed with "shm:" for a server on this machine. */
+int FactorialClientAddServer(struct FactorialClient *client, const char *host,
+                             int port);
+/* Same format as the client's servers file; returns the number of entries
+ * or -1 if the file can't be read. */
+int FactorialClientAddServersFromFile(struct FactorialClient *client,
+                                      const char *path);
+/* Connects to every server added so far, waiting up to timeout_ms for the
+ * handshakes. Returns the number of usable servers. */
+int FactorialClientConnect(struct FactorialClient *client, int timeout_ms);
+
+/* Queues [begin, end] modulo each of mods (at most 64) on the least loaded
+ * server. Returns a non-zero handle, or 0 if no server is usable or the
+ * arguments are invalid. With cb set it runs exactly once from Poll/Wait;
+ * with cb NULL the result is kept until FactorialClientWait collects it. */
+uint64_t FactorialClientSubmit(struct FactorialClient *client, uint64_t begin,
+                               uint64_t end, const uint64_t *mods,
+                               size_t mods_num, FactorialDoneFn cb,
+                               void *ctx);
+/* Drops the request and tells its server to stop; the callback does not
+ * run. Returns false if the handle is unknown or already finished. */
+bool FactorialClientCancel(struct FactorialClient *client, uint64_t handle);
+
+/* Epoll descriptor that is readable when Poll has network work to do. */
+int FactorialClientFd(const struct FactorialClient *client);
+/* Runs callbacks for whatever is ready, waiting up to timeout_ms (-1 means
+ * a short internal tick). Returns the callbacks run, or -1 on error. */
+int FactorialClientPoll(struct FactorialClient *client, int timeout_ms);
+/* Requests submitted but not finished yet. */
+size_t FactorialClientPending(const struct FactorialClient *client);
+
+/* For a request submitted without a callback: polls until it finishes or
+ * timeout_ms passes (-1: no limit), copies up to results_num results and
+ * forgets the handle. Returns its status, or FACTORIAL_PENDING. */
+int FactorialClientWait(struct FactorialClient *client, uint64_t handle,
+                        uint64_t *results, size_t results_num, int timeout_ms);
+/* Polls until nothing is pending or timeout_ms passes (-1: no limit).
+ * Returns the number still pending. */
+size_t FactorialClientWaitAll(struct FactorialClient *client, int timeout_ms);
+
+#endif
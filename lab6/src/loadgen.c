@@ -0,0 +1,309 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include "common.h"
+#include "dispatcher.h"
+#include "protocol.h"
+#include "stats.h"
+
+/* Open-loop load generator: requests are issued on a fixed schedule (or a
+ * Poisson process) whether or not earlier ones have been answered, and
+ * latency is measured from the scheduled send time, so a slow server can't
+ * hide its queueing delay by slowing the generator down. */
+
+typedef struct {
+  struct Dispatcher net;
+  uint64_t rng;
+  uint64_t k_min;
+  uint64_t k_max;
+  uint64_t mods[MAX_MODS];
+  int mods_num;
+  int next_server;
+  uint64_t timeout_ns;
+
+  uint64_t sent;
+  uint64_t unsent;     /* no ready connection at the scheduled time */
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t timeouts;
+  uint64_t outstanding;
+  struct Histogram latency;
+} LoadGen;
+
+typedef struct {
+  LoadGen *gen;
+  uint64_t scheduled_ns;
+} Sample;
+
+uint64_t NextRandom(LoadGen *gen) {
+  gen->rng ^= gen->rng << 13;
+  gen->rng ^= gen->rng >> 7;
+  gen->rng ^= gen->rng << 17;
+  return gen->rng;
+}
+
+/* Uniform in (0, 1]. */
+double NextUnit(LoadGen *gen) {
+  return ((NextRandom(gen) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* k is drawn log-uniformly so every order of magnitude in the range gets
+ * the same share of requests. */
+uint64_t NextK(LoadGen *gen) {
+  if (gen->k_min == gen->k_max)
+    return gen->k_min;
+  double lo = log((double)gen->k_min);
+  double hi = log((double)gen->k_max + 1);
+  uint64_t k = (uint64_t)exp(lo + (hi - lo) * NextUnit(gen));
+  return k < gen->k_min ? gen->k_min : (k > gen->k_max ? gen->k_max : k);
+}
+
+void OnResponse(void *ctx, uint64_t id, int status, const uint64_t *results,
+                uint32_t results_num) {
+  (void)id;
+  (void)results;
+  (void)results_num;
+  Sample *sample = (Sample *)ctx;
+  LoadGen *gen = sample->gen;
+  gen->outstanding--;
+  if (status == DISPATCH_OK) {
+    gen->completed++;
+    HistRecord(&gen->latency, NowNs() - sample->scheduled_ns);
+  } else if (status == DISPATCH_TIMEOUT) {
+    gen->timeouts++;
+  } else {
+    gen->failed++;
+  }
+  free(sample);
+}
+
+/* Round-robin over connections that finished their handshake. */
+void SendOne(LoadGen *gen, uint64_t scheduled_ns) {
+  struct FactorialRequest req;
+  req.begin = 1;
+  req.end = NextK(gen);
+  req.mods[0] = gen->mods[NextRandom(gen) % gen->mods_num];
+  req.mods_num = 1;
+  req.timeout_ms = 0;
+
+  for (int tries = 0; tries < gen->net.servers_num; tries++) {
+    int server = gen->next_server;
+    gen->next_server = (gen->next_server + 1) % gen->net.servers_num;
+    if (gen->net.servers[server].state != SERVER_READY)
+      continue;
+    Sample *sample = malloc(sizeof(Sample));
+    sample->gen = gen;
+    sample->scheduled_ns = scheduled_ns;
+    if (DispatcherSubmit(&gen->net, server, &req, gen->timeout_ns, OnResponse,
+                         sample)) {
+      gen->sent++;
+      gen->outstanding++;
+      return;
+    }
+    free(sample);
+  }
+  gen->unsent++;
+}
+
+/* Parses "N" or "MIN-MAX". */
+bool ParseKRange(const char *str, uint64_t *k_min, uint64_t *k_max) {
+  char *end = NULL;
+  errno = 0;
+  *k_min = strtoull(str, &end, 10);
+  *k_max = *k_min;
+  if (*end == '-')
+    *k_max = strtoull(end + 1, &end, 10);
+  return errno == 0 && *end == '\0' && *k_min > 0 && *k_max >= *k_min;
+}
+
+/* Parses a comma-separated list of moduli, e.g. "7,11,13". */
+int ParseModsList(const char *str, uint64_t *mods) {
+  int mods_num = 0;
+  const char *p = str;
+  while (*p) {
+    if (mods_num == MAX_MODS)
+      return -1;
+    char *end = NULL;
+    errno = 0;
+    unsigned long long m = strtoull(p, &end, 10);
+    if (errno != 0 || end == p || m == 0 || (*end != ',' && *end != '\0'))
+      return -1;
+    mods[mods_num++] = m;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return mods_num;
+}
+
+int main(int argc, char **argv) {
+  char servers_path[255] = {'\0'};
+  double rate = 1000;
+  double duration = 10;
+  int conns = 1;
+  bool poisson = true;
+  int timeout_ms = 5000;
+  uint64_t seed = 42;
+
+  static LoadGen gen;
+  gen.k_min = gen.k_max = 10000;
+  gen.mods[0] = 1000000007;
+  gen.mods_num = 1;
+
+  while (true) {
+    static struct option options[] = {{"servers", required_argument, 0, 0},
+                                      {"rate", required_argument, 0, 0},
+                                      {"duration", required_argument, 0, 0},
+                                      {"k", required_argument, 0, 0},
+                                      {"mods", required_argument, 0, 0},
+                                      {"conns", required_argument, 0, 0},
+                                      {"uniform", no_argument, 0, 0},
+                                      {"timeout-ms", required_argument, 0, 0},
+                                      {"seed", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0: {
+      switch (option_index) {
+      case 0:
+        snprintf(servers_path, sizeof(servers_path), "%s", optarg);
+        break;
+      case 1:
+        rate = atof(optarg);
+        break;
+      case 2:
+        duration = atof(optarg);
+        break;
+      case 3:
+        if (!ParseKRange(optarg, &gen.k_min, &gen.k_max)) {
+          fprintf(stderr, "Bad --k, expected N or MIN-MAX: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 4:
+        gen.mods_num = ParseModsList(optarg, gen.mods);
+        if (gen.mods_num <= 0) {
+          fprintf(stderr, "Bad moduli list: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 5:
+        conns = atoi(optarg);
+        break;
+      case 6:
+        poisson = false;
+        break;
+      case 7:
+        timeout_ms = atoi(optarg);
+        break;
+      case 8:
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        printf("Index %d is out of options\n", option_index);
+      }
+    } break;
+
+    case '?':
+      printf("Arguments error\n");
+      break;
+    default:
+      fprintf(stderr, "getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  if (!strlen(servers_path) || rate <= 0 || duration <= 0 || conns <= 0 ||
+      timeout_ms <= 0) {
+    fprintf(stderr,
+            "Using: %s --servers /path/to/file [--rate 1000] [--duration 10]\n"
+            "       [--k 1000-1000000] [--mods 1000000007,998244353] "
+            "[--conns 1]\n"
+            "       [--uniform] [--timeout-ms 5000] [--seed 42]\n"
+            "Sends requests for [1, k] at --rate per second (Poisson arrivals "
+            "unless --uniform),\nk log-uniform in the range and a modulus "
+            "picked from --mods, over --conns\nconnections per server\n",
+            argv[0]);
+    return 1;
+  }
+  gen.rng = seed ? seed : 1;
+  gen.timeout_ns = timeout_ms * 1000000ULL;
+
+  if (DispatcherInit(&gen.net, 2000000000ULL) < 0)
+    return 1;
+  /* --conns adds the whole list that many times */
+  for (int i = 0; i < conns; i++)
+    if (DispatcherAddServersFromFile(&gen.net, servers_path) < 0)
+      return 1;
+  if (gen.net.servers_num == 0) {
+    fprintf(stderr, "No servers found in file\n");
+    return 1;
+  }
+
+  /* wait for every handshake before the clock starts */
+  for (int i = 0; i < gen.net.servers_num; i++)
+    DispatcherConnect(&gen.net, i);
+  int ready = 0;
+  int pending = gen.net.servers_num;
+  while (pending > 0) {
+    DispatcherPoll(&gen.net, 10);
+    ready = pending = 0;
+    for (int i = 0; i < gen.net.servers_num; i++) {
+      enum ServerConnState state = gen.net.servers[i].state;
+      ready += state == SERVER_READY;
+      pending += state == SERVER_CONNECTING || state == SERVER_HANDSHAKE;
+    }
+  }
+  if (ready == 0) {
+    fprintf(stderr, "No server could be reached\n");
+    return 1;
+  }
+
+  double interval_ns = 1e9 / rate;
+  uint64_t start = NowNs();
+  uint64_t stop = start + (uint64_t)(duration * 1e9);
+  double next_send = (double)start;
+  while (true) {
+    uint64_t now = NowNs();
+    while (next_send <= (double)now && next_send < (double)stop) {
+      SendOne(&gen, (uint64_t)next_send);
+      next_send += poisson ? -log(NextUnit(&gen)) * interval_ns : interval_ns;
+    }
+    if (now >= stop && gen.outstanding == 0)
+      break;
+    if (now >= stop + gen.timeout_ns + 1000000000ULL)
+      break;
+    int wait_ms = 0;
+    if (next_send < (double)stop && next_send > (double)now)
+      wait_ms = (int)((next_send - (double)now) / 1e6);
+    else if (next_send >= (double)stop)
+      wait_ms = 10;
+    if (DispatcherPoll(&gen.net, wait_ms) < 0)
+      break;
+  }
+  double elapsed = (NowNs() - start) / 1e9;
+
+  printf("%d connections to %d servers, %.0f req/s target for %.1fs "
+         "(%s arrivals), k in [%lu, %lu]\n",
+         ready, gen.net.servers_num / conns, rate, duration,
+         poisson ? "Poisson" : "uniform", gen.k_min, gen.k_max);
+  printf("sent %lu (%.1f/s), completed %lu (%.1f/s), %lu failed, "
+         "%lu timed out, %lu not sent\n",
+         gen.sent, gen.sent / duration, gen.completed, gen.completed / elapsed,
+         gen.failed, gen.timeouts, gen.unsent);
+  char latency[256];
+  HistFormatUs(&gen.latency, "latency", latency, sizeof(latency));
+  fputs(latency, stdout);
+
+  DispatcherDestroy(&gen.net);
+  return gen.completed == gen.sent ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void MetricsAppend(struct MetricsText *out, const char *fmt, ...) {
+  while (true) {
+    va_list args;
+    va_start(args, fmt);
+    size_t room = out->cap - out->len;
+    int n = vsnprintf(out->buf ? out->buf + out->len : NULL, room, fmt, args);
+    va_end(args);
+    if (n < 0)
+      return;
+    if ((size_t)n < room) {
+      out->len += (size_t)n;
+      return;
+    }
+    size_t cap = out->cap ? out->cap * 2 : 4096;
+    while (cap < out->len + (size_t)n + 1)
+      cap *= 2;
+    out->buf = realloc(out->buf, cap);
+    out->cap = cap;
+  }
+}
+
+void MetricsFree(struct MetricsText *out) {
+  free(out->buf);
+  out->buf = NULL;
+  out->len = out->cap = 0;
+}
+
+void PromHeader(struct MetricsText *out, const char *name, const char *type,
+                const char *help) {
+  MetricsAppend(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void PromValue(struct MetricsText *out, const char *name, const char *labels,
+               double value) {
+  /* counters print as exact integers, times with 9 significant digits */
+  const char *fmt = value == (double)(uint64_t)value ? "%.0f" : "%.9g";
+  char number[64];
+  snprintf(number, sizeof(number), fmt, value);
+  if (labels)
+    MetricsAppend(out, "%s{%s} %s\n", name, labels, number);
+  else
+    MetricsAppend(out, "%s %s\n", name, number);
+}
+
+void PromHistogram(struct MetricsText *out, const char *name,
+                   const char *labels, const struct Histogram *hist,
+                   const uint64_t *bounds, size_t bounds_num, double scale) {
+  const char *sep = labels ? "," : "";
+  labels = labels ? labels : "";
+  for (size_t i = 0; i < bounds_num; i++)
+    MetricsAppend(out, "%s_bucket{%s%sle=\"%.9g\"} %lu\n", name, labels, sep,
+                  bounds[i] * scale, HistCountAtMost(hist, bounds[i]));
+  uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+  MetricsAppend(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+                total);
+  const char *open = *labels ? "{" : "";
+  const char *close = *labels ? "}" : "";
+  MetricsAppend(out, "%s_sum%s%s%s %.9g\n", name, open, labels, close,
+                __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) * scale);
+  MetricsAppend(out, "%s_count%s%s%s %lu\n", name, open, labels, close, total);
+}
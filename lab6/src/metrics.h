@@ -0,0 +1,33 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/* Growable text buffer for a Prometheus exposition-format snapshot. */
+struct MetricsText {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+void MetricsAppend(struct MetricsText *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void MetricsFree(struct MetricsText *out);
+
+/* "# HELP" and "# TYPE" lines; type is "counter", "gauge" or "histogram". */
+void PromHeader(struct MetricsText *out, const char *name, const char *type,
+                const char *help);
+/* One sample; labels is e.g. "worker=\"3\"" or NULL. */
+void PromValue(struct MetricsText *out, const char *name, const char *labels,
+               double value);
+/* name_bucket/_sum/_count series for hist. bounds are in the histogram's
+ * own units and are multiplied by scale when printed (1e-9 turns ns into
+ * seconds). */
+void PromHistogram(struct MetricsText *out, const char *name,
+                   const char *labels, const struct Histogram *hist,
+                   const uint64_t *bounds, size_t bounds_num, double scale);
+
+#endif
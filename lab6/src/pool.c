@@ -0,0 +1,351 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reduce.h"
+
+/* Parts look at the cancel flag between blocks of this many factors, about
+ * 16k iterations per multiply chain or well under a millisecond. */
+#define CANCEL_BLOCK 65536
+
+static void *PoolWorker(void *arg) {
+  struct ThreadPool *pool = (struct ThreadPool *)arg;
+  int index = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+  struct WorkerStats *stats = &pool->stats[index];
+
+  while (true) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head == NULL && !pool->stopping)
+      pthread_cond_wait(&pool->not_empty, &pool->lock);
+    if (pool->head == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    struct Task *task = pool->head;
+    pool->head = task->next;
+    if (pool->head == NULL)
+      pool->tail = NULL;
+    __atomic_store_n(&pool->queued, pool->queued - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+
+    uint64_t start = NowNs();
+    task->fn(task->arg);
+    uint64_t elapsed = NowNs() - start;
+    __atomic_store_n(&stats->tasks, stats->tasks + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->busy_ns, stats->busy_ns + elapsed,
+                     __ATOMIC_RELAXED);
+    HistRecord(&stats->task_ns, elapsed);
+  }
+  return NULL;
+}
+
+int PoolInit(struct ThreadPool *pool, int threads_num) {
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->not_empty, NULL);
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->queued = 0;
+  pool->stopping = false;
+  pool->threads_num = threads_num;
+  pool->next_worker = 0;
+  pool->threads = malloc(sizeof(pthread_t) * threads_num);
+  if (posix_memalign((void **)&pool->stats, 64,
+                     sizeof(struct WorkerStats) * threads_num) != 0) {
+    free(pool->threads);
+    return -1;
+  }
+  memset(pool->stats, 0, sizeof(struct WorkerStats) * threads_num);
+
+  for (int i = 0; i < threads_num; i++) {
+    if (pthread_create(&pool->threads[i], NULL, PoolWorker, pool)) {
+      fprintf(stderr, "Error: pthread_create failed!\n");
+      pool->threads_num = i;
+      PoolDestroy(pool);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void PoolSubmit(struct ThreadPool *pool, struct Task *task) {
+  task->next = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail)
+    pool->tail->next = task;
+  else
+    pool->head = task;
+  pool->tail = task;
+  __atomic_store_n(&pool->queued, pool->queued + 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+size_t PoolQueueDepth(struct ThreadPool *pool) {
+  return __atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+}
+
+void PoolDestroy(struct ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->not_empty);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->threads_num; i++)
+    pthread_join(pool->threads[i], NULL);
+  free(pool->threads);
+  free(pool->stats);
+  pthread_cond_destroy(&pool->not_empty);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+struct FactorialJob *JobCreate(uint64_t begin, uint64_t end,
+                               const uint64_t *mods, size_t mods_num,
+                               int parts_num) {
+  struct FactorialJob *job =
+      malloc(sizeof(struct FactorialJob) +
+             sizeof(struct FactorialPart) * (size_t)parts_num);
+  if (job == NULL)
+    return NULL;
+
+  job->begin = begin;
+  job->end = end;
+  job->mods_num = mods_num;
+  for (size_t j = 0; j < mods_num; j++)
+    job->mods[j] = mods[j];
+  job->lanes = 4;
+  job->on_done = NULL;
+  job->ctx = NULL;
+  job->cancelled = false;
+  job->skipped = 0;
+  job->parts_num = parts_num;
+  job->pending = 0;
+  return job;
+}
+
+static void ComputeRange(struct FactorialJob *job, uint64_t begin,
+                         uint64_t end, uint64_t *results) {
+  if (job->mods_num == 1) {
+    results[0] = FactorialInterleaved(begin, end, job->mods[0], job->lanes);
+  } else {
+    FactorialMulti(begin, end, job->mods, job->mods_num, results);
+  }
+}
+
+static void ComputePart(struct FactorialJob *job, struct FactorialPart *part) {
+  if (part->begin > part->end) {
+    ComputeRange(job, part->begin, part->end, part->results);
+    return;
+  }
+  for (size_t j = 0; j < job->mods_num; j++)
+    part->results[j] = 1 % job->mods[j];
+
+  uint64_t results[MAX_MODS];
+  uint64_t current = part->begin;
+  while (true) {
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+      __atomic_fetch_add(&job->skipped, part->end - current + 1,
+                         __ATOMIC_RELAXED);
+      return;
+    }
+    uint64_t block_end = part->end - current < CANCEL_BLOCK - 1
+                             ? part->end
+                             : current + CANCEL_BLOCK - 1;
+    ComputeRange(job, current, block_end, results);
+    for (size_t j = 0; j < job->mods_num; j++)
+      part->results[j] = MulModulo(part->results[j], results[j], job->mods[j]);
+    if (block_end == part->end)
+      return;
+    current = block_end + 1;
+  }
+}
+
+void JobCancel(struct FactorialJob *job) {
+  __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+}
+
+static void FinishJob(struct FactorialJob *job) {
+  for (size_t j = 0; j < job->mods_num; j++) {
+    uint64_t total = 1 % job->mods[j];
+    for (int i = 0; i < job->parts_num; i++)
+      total = MulModulo(total, job->parts[i].results[j], job->mods[j]);
+    job->results[j] = total;
+  }
+  if (job->on_done)
+    job->on_done(job);
+}
+
+static void RunPart(void *arg) {
+  struct FactorialPart *part = (struct FactorialPart *)arg;
+  struct FactorialJob *job = part->job;
+
+  ComputePart(job, part);
+  if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    FinishJob(job);
+}
+
+void JobStart(struct ThreadPool *pool, struct FactorialJob *job,
+              uint64_t inline_max) {
+  uint64_t range = job->begin <= job->end ? job->end - job->begin + 1 : 0;
+  int parts_num = job->parts_num;
+
+  if (range < inline_max || (uint64_t)parts_num > range)
+    parts_num = 1;
+
+  uint64_t step = range / parts_num;
+  uint64_t current = job->begin;
+  for (int i = 0; i < parts_num; i++) {
+    struct FactorialPart *part = &job->parts[i];
+    part->job = job;
+    part->begin = current;
+    part->end = (i == parts_num - 1) ? job->end : (current + step - 1);
+    current = part->end + 1;
+  }
+  job->parts_num = parts_num;
+
+  if (parts_num == 1 && range < inline_max) {
+    ComputePart(job, &job->parts[0]);
+    FinishJob(job);
+    return;
+  }
+
+  job->pending = parts_num;
+  for (int i = 0; i < parts_num; i++) {
+    job->parts[i].task.fn = RunPart;
+    job->parts[i].task.arg = &job->parts[i];
+    PoolSubmit(pool, &job->parts[i].task);
+  }
+}
+
+struct SyncWaiter {
+  pthread_mutex_t lock;
+  pthread_cond_t done_cond;
+  bool done;
+};
+
+static void WakeWaiter(struct FactorialJob *job) {
+  struct SyncWaiter *waiter = (struct SyncWaiter *)job->ctx;
+  pthread_mutex_lock(&waiter->lock);
+  waiter->done = true;
+  pthread_cond_signal(&waiter->done_cond);
+  pthread_mutex_unlock(&waiter->lock);
+}
+
+void JobRunSync(struct ThreadPool *pool, struct FactorialJob *job,
+                uint64_t inline_max) {
+  struct SyncWaiter waiter;
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_cond_init(&waiter.done_cond, NULL);
+  waiter.done = false;
+
+  job->on_done = WakeWaiter;
+  job->ctx = &waiter;
+  JobStart(pool, job, inline_max);
+
+  pthread_mutex_lock(&waiter.lock);
+  while (!waiter.done)
+    pthread_cond_wait(&waiter.done_cond, &waiter.lock);
+  pthread_mutex_unlock(&waiter.lock);
+
+  pthread_cond_destroy(&waiter.done_cond);
+  pthread_mutex_destroy(&waiter.lock);
+}
+
+struct ReduceJob *ReduceJobCreate(const struct ReduceRequest *req, int fd,
+                                  int parts_num) {
+  struct ReduceJob *job = malloc(sizeof(struct ReduceJob) +
+                                 sizeof(struct ReducePart) * (size_t)parts_num);
+  if (job == NULL)
+    return NULL;
+  job->req = *req;
+  job->fd = fd;
+  ReduceStatsInit(&job->stats);
+  job->failed = false;
+  job->on_done = NULL;
+  job->ctx = NULL;
+  job->cancelled = false;
+  job->skipped = 0;
+  job->parts_num = parts_num;
+  job->pending = 0;
+  return job;
+}
+
+static void ReducePartRun(struct ReduceJob *job, struct ReducePart *part) {
+  ReduceStatsInit(&part->stats);
+  uint64_t done = 0;
+  while (done < part->length) {
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+      __atomic_fetch_add(&job->skipped, part->length - done,
+                         __ATOMIC_RELAXED);
+      return;
+    }
+    uint64_t n = part->length - done < REDUCE_BLOCK ? part->length - done
+                                                    : REDUCE_BLOCK;
+    struct ReduceStats block;
+    if (!ReduceBlock(&job->req, job->fd, part->offset + done, n, &block)) {
+      __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+      return;
+    }
+    ReduceMerge(&part->stats, &block);
+    done += n;
+  }
+}
+
+static void FinishReduce(struct ReduceJob *job) {
+  /* in part order, so the floating-point result doesn't depend on timing */
+  for (int i = 0; i < job->parts_num; i++)
+    ReduceMerge(&job->stats, &job->parts[i].stats);
+  if (job->on_done)
+    job->on_done(job);
+}
+
+static void RunReducePart(void *arg) {
+  struct ReducePart *part = (struct ReducePart *)arg;
+  struct ReduceJob *job = part->job;
+
+  ReducePartRun(job, part);
+  if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    FinishReduce(job);
+}
+
+void ReduceJobStart(struct ThreadPool *pool, struct ReduceJob *job,
+                    uint64_t inline_max) {
+  uint64_t length = job->req.length;
+  int parts_num = job->parts_num;
+  /* every part gets at least a block */
+  if (length / REDUCE_BLOCK < (uint64_t)parts_num)
+    parts_num = (int)(length / REDUCE_BLOCK);
+  if (length < inline_max || parts_num < 1)
+    parts_num = 1;
+
+  uint64_t step = length / parts_num;
+  uint64_t current = job->req.offset;
+  for (int i = 0; i < parts_num; i++) {
+    struct ReducePart *part = &job->parts[i];
+    part->job = job;
+    part->offset = current;
+    part->length = (i == parts_num - 1) ? job->req.offset + length - current
+                                        : step;
+    current += part->length;
+  }
+  job->parts_num = parts_num;
+
+  if (parts_num == 1 && length < inline_max) {
+    ReducePartRun(job, &job->parts[0]);
+    FinishReduce(job);
+    return;
+  }
+
+  job->pending = parts_num;
+  for (int i = 0; i < parts_num; i++) {
+    job->parts[i].task.fn = RunReducePart;
+    job->parts[i].task.arg = &job->parts[i];
+    PoolSubmit(pool, &job->parts[i].task);
+  }
+}
+
+void ReduceJobCancel(struct ReduceJob *job) {
+  __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,136 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "stats.h"
+
+typedef void (*TaskFn)(void *arg);
+
+struct Task {
+  TaskFn fn;
+  void *arg;
+  struct Task *next;
+};
+
+/* Written only by the owning worker, so updates need no lock; readers use
+ * relaxed loads. Aligned so neighbouring workers don't share a line. */
+struct WorkerStats {
+  uint64_t tasks;
+  uint64_t busy_ns;
+  struct Histogram task_ns;
+} __attribute__((aligned(64)));
+
+/* Fixed set of worker threads started once, fed through a FIFO queue. */
+struct ThreadPool {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  struct Task *head;
+  struct Task *tail;
+  size_t queued;
+  bool stopping;
+  int threads_num;
+  int next_worker;
+  pthread_t *threads;
+  struct WorkerStats *stats;
+};
+
+int PoolInit(struct ThreadPool *pool, int threads_num);
+/* The task node is owned by the caller and must live until fn runs. */
+void PoolSubmit(struct ThreadPool *pool, struct Task *task);
+/* Tasks waiting for a worker; a snapshot read without the lock. */
+size_t PoolQueueDepth(struct ThreadPool *pool);
+void PoolDestroy(struct ThreadPool *pool);
+
+struct FactorialJob;
+typedef void (*JobDoneFn)(struct FactorialJob *job);
+
+struct FactorialPart {
+  struct FactorialJob *job;
+  uint64_t begin;
+  uint64_t end;
+  uint64_t results[MAX_MODS];
+  struct Task task;
+};
+
+/* One request: [begin, end] modulo each of mods, split into parts that run
+ * on the pool. The worker finishing the last part combines the partial
+ * products into results and calls on_done. */
+struct FactorialJob {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t mods[MAX_MODS];
+  size_t mods_num;
+  int lanes;
+
+  uint64_t results[MAX_MODS];
+  JobDoneFn on_done;
+  void *ctx;
+
+  /* set by JobCancel; parts stop at the next block and results are
+   * garbage. skipped counts the factors left uncomputed. */
+  bool cancelled;
+  uint64_t skipped;
+
+  int parts_num;
+  int pending;
+  struct FactorialPart parts[];
+};
+
+struct FactorialJob *JobCreate(uint64_t begin, uint64_t end,
+                               const uint64_t *mods, size_t mods_num,
+                               int parts_num);
+/* Ranges shorter than inline_max run on the calling thread and on_done is
+ * called before JobStart returns. */
+void JobStart(struct ThreadPool *pool, struct FactorialJob *job,
+              uint64_t inline_max);
+/* Makes the running parts return early; on_done is still called once. Safe
+ * from any thread. */
+void JobCancel(struct FactorialJob *job);
+/* Blocks the calling thread until the job is done (sets on_done/ctx). */
+void JobRunSync(struct ThreadPool *pool, struct FactorialJob *job,
+                uint64_t inline_max);
+
+struct ReduceJob;
+typedef void (*ReduceDoneFn)(struct ReduceJob *job);
+
+struct ReducePart {
+  struct ReduceJob *job;
+  uint64_t offset;
+  uint64_t length;
+  struct ReduceStats stats;
+  struct Task task;
+};
+
+/* OP_REDUCE counterpart of FactorialJob: [offset, offset + length) split
+ * into parts whose stats the last worker merges. */
+struct ReduceJob {
+  struct ReduceRequest req;
+  int fd; /* the shard, -1 for generated data; closed by the owner */
+
+  struct ReduceStats stats;
+  bool failed; /* the shard could not be read */
+  ReduceDoneFn on_done;
+  void *ctx;
+
+  bool cancelled;
+  uint64_t skipped;
+
+  int parts_num;
+  int pending;
+  struct ReducePart parts[];
+};
+
+struct ReduceJob *ReduceJobCreate(const struct ReduceRequest *req, int fd,
+                                  int parts_num);
+/* Same contract as JobStart and JobCancel. */
+void ReduceJobStart(struct ThreadPool *pool, struct ReduceJob *job,
+                    uint64_t inline_max);
+void ReduceJobCancel(struct ReduceJob *job);
+
+#endif
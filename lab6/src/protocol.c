@@ -0,0 +1,254 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+void PutU16(uint8_t *buf, uint16_t value) {
+  buf[0] = (uint8_t)value;
+  buf[1] = (uint8_t)(value >> 8);
+}
+
+void PutU32(uint8_t *buf, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    buf[i] = (uint8_t)(value >> (8 * i));
+}
+
+void PutU64(uint8_t *buf, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    buf[i] = (uint8_t)(value >> (8 * i));
+}
+
+uint16_t GetU16(const uint8_t *buf) {
+  return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+uint32_t GetU32(const uint8_t *buf) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--)
+    value = (value << 8) | buf[i];
+  return value;
+}
+
+uint64_t GetU64(const uint8_t *buf) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+    value = (value << 8) | buf[i];
+  return value;
+}
+
+void EncodeHeader(uint8_t *buf, const struct FrameHeader *header) {
+  buf[0] = header->version;
+  buf[1] = header->op;
+  PutU16(buf + 2, header->status);
+  PutU32(buf + 4, header->length);
+  PutU64(buf + 8, header->id);
+}
+
+bool DecodeHeader(const uint8_t *buf, struct FrameHeader *header) {
+  header->version = buf[0];
+  header->op = buf[1];
+  header->status = GetU16(buf + 2);
+  header->length = GetU32(buf + 4);
+  header->id = GetU64(buf + 8);
+  return header->version == PROTOCOL_VERSION &&
+         header->length <= FRAME_MAX_PAYLOAD;
+}
+
+size_t EncodeFactorialRequest(uint8_t *buf, uint64_t id,
+                              const struct FactorialRequest *req) {
+  uint8_t *payload = buf + FRAME_HEADER_SIZE;
+  PutU64(payload, req->begin);
+  PutU64(payload + 8, req->end);
+  PutU32(payload + 16, req->mods_num);
+  PutU32(payload + 20, req->timeout_ms);
+  for (uint32_t j = 0; j < req->mods_num; j++)
+    PutU64(payload + 24 + 8 * j, req->mods[j]);
+
+  struct FrameHeader header = {PROTOCOL_VERSION, OP_FACTORIAL, STATUS_OK,
+                               24 + 8 * req->mods_num, id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE + header.length;
+}
+
+size_t EncodeResults(uint8_t *buf, uint8_t op, uint64_t id, uint16_t status,
+                     const uint64_t *results, size_t results_num) {
+  for (size_t j = 0; j < results_num; j++)
+    PutU64(buf + FRAME_HEADER_SIZE + 8 * j, results[j]);
+
+  struct FrameHeader header = {PROTOCOL_VERSION, (uint8_t)(op | OP_RESPONSE),
+                               status, (uint32_t)(8 * results_num), id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE + header.length;
+}
+
+size_t EncodeHelloRequest(uint8_t *buf, uint64_t id) {
+  struct FrameHeader header = {PROTOCOL_VERSION, OP_HELLO, STATUS_OK, 0, id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE;
+}
+
+size_t EncodeCancel(uint8_t *buf, uint64_t id) {
+  struct FrameHeader header = {PROTOCOL_VERSION, OP_CANCEL, STATUS_OK, 0, id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE;
+}
+
+size_t EncodeShmAttach(uint8_t *buf, uint64_t id, const char *name,
+                       uint64_t nonce) {
+  size_t len = strlen(name);
+  PutU64(buf + FRAME_HEADER_SIZE, nonce);
+  memcpy(buf + FRAME_HEADER_SIZE + 8, name, len);
+  struct FrameHeader header = {PROTOCOL_VERSION, OP_SHM_ATTACH, STATUS_OK,
+                               (uint32_t)(8 + len), id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE + 8 + len;
+}
+
+size_t EncodeHelloResponse(uint8_t *buf, uint64_t id, uint32_t tnum,
+                           uint64_t mults_per_sec) {
+  PutU32(buf + FRAME_HEADER_SIZE, tnum);
+  PutU32(buf + FRAME_HEADER_SIZE + 4, 0);
+  PutU64(buf + FRAME_HEADER_SIZE + 8, mults_per_sec);
+
+  struct FrameHeader header = {PROTOCOL_VERSION, OP_HELLO | OP_RESPONSE,
+                               STATUS_OK, 16, id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE + 16;
+}
+
+bool DecodeHelloResponse(const uint8_t *payload, uint32_t length,
+                         uint32_t *tnum, uint64_t *mults_per_sec) {
+  if (length != 16)
+    return false;
+  *tnum = GetU32(payload);
+  *mults_per_sec = GetU64(payload + 8);
+  return true;
+}
+
+bool DecodeShmAttach(const uint8_t *payload, uint32_t length, char *name,
+                     size_t name_size, uint64_t *nonce) {
+  if (length <= 8 || length - 8 >= name_size)
+    return false;
+  *nonce = GetU64(payload);
+  memcpy(name, payload + 8, length - 8);
+  name[length - 8] = '\0';
+  return true;
+}
+
+bool DecodeFactorialRequest(const uint8_t *payload, uint32_t length,
+                            struct FactorialRequest *req) {
+  if (length < 24)
+    return false;
+  req->begin = GetU64(payload);
+  req->end = GetU64(payload + 8);
+  req->mods_num = GetU32(payload + 16);
+  req->timeout_ms = GetU32(payload + 20);
+  if (req->mods_num == 0 || req->mods_num > MAX_MODS ||
+      length != 24 + 8 * req->mods_num)
+    return false;
+  for (uint32_t j = 0; j < req->mods_num; j++) {
+    req->mods[j] = GetU64(payload + 24 + 8 * j);
+    if (req->mods[j] == 0)
+      return false;
+  }
+  return true;
+}
+
+#define REDUCE_HEADER_SIZE 32
+
+size_t EncodeReduceRequest(uint8_t *buf, uint64_t id,
+                           const struct ReduceRequest *req) {
+  uint8_t *payload = buf + FRAME_HEADER_SIZE;
+  payload[0] = req->kind;
+  payload[1] = req->source;
+  PutU16(payload + 2, 0);
+  PutU32(payload + 4, req->timeout_ms);
+  PutU64(payload + 8, req->seed);
+  PutU64(payload + 16, req->offset);
+  PutU64(payload + 24, req->length);
+  size_t name_len = req->source == REDUCE_SHARD ? strlen(req->shard) : 0;
+  memcpy(payload + REDUCE_HEADER_SIZE, req->shard, name_len);
+
+  struct FrameHeader header = {PROTOCOL_VERSION, OP_REDUCE, STATUS_OK,
+                               (uint32_t)(REDUCE_HEADER_SIZE + name_len), id};
+  EncodeHeader(buf, &header);
+  return FRAME_HEADER_SIZE + header.length;
+}
+
+bool DecodeReduceRequest(const uint8_t *payload, uint32_t length,
+                         struct ReduceRequest *req) {
+  if (length < REDUCE_HEADER_SIZE)
+    return false;
+  req->kind = payload[0];
+  req->source = payload[1];
+  req->timeout_ms = GetU32(payload + 4);
+  req->seed = GetU64(payload + 8);
+  req->offset = GetU64(payload + 16);
+  req->length = GetU64(payload + 24);
+  size_t name_len = length - REDUCE_HEADER_SIZE;
+  if (req->kind < REDUCE_MINMAX || req->kind > REDUCE_STATS ||
+      req->offset + req->length < req->offset)
+    return false;
+  if (req->source == REDUCE_GENERATED)
+    name_len = 0;
+  else if (req->source != REDUCE_SHARD || name_len == 0 ||
+           name_len >= SHARD_NAME_MAX)
+    return false;
+  memcpy(req->shard, payload + REDUCE_HEADER_SIZE, name_len);
+  req->shard[name_len] = '\0';
+  return true;
+}
+
+void EncodeReduceStats(const struct ReduceStats *stats,
+                       uint64_t words[REDUCE_RESULTS]) {
+  words[0] = stats->count;
+  words[1] = (uint64_t)stats->min;
+  words[2] = (uint64_t)stats->max;
+  words[3] = (uint64_t)stats->sum;
+  memcpy(&words[4], &stats->mean, 8);
+  memcpy(&words[5], &stats->m2, 8);
+}
+
+void DecodeReduceStats(const uint64_t words[REDUCE_RESULTS],
+                       struct ReduceStats *stats) {
+  stats->count = words[0];
+  stats->min = (int64_t)words[1];
+  stats->max = (int64_t)words[2];
+  stats->sum = (int64_t)words[3];
+  memcpy(&stats->mean, &words[4], 8);
+  memcpy(&stats->m2, &words[5], 8);
+}
+
+bool SendAll(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+bool RecvAll(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n == 0)
+      return false;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
@@ -0,0 +1,156 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Every message is a 16-byte header followed by `length` payload bytes.
+ * All integers are little-endian regardless of host byte order.
+ *
+ *   offset  size  field
+ *   0       1     version (PROTOCOL_VERSION)
+ *   1       1     op; responses set OP_RESPONSE on top of the request op
+ *   2       2     status (responses), 0 in requests
+ *   4       4     payload length
+ *   8       8     request id, echoed back in the response
+ *
+ * OP_FACTORIAL request payload: u64 begin, u64 end, u32 mods_num,
+ * u32 timeout_ms, mods_num x u64 mod. Response payload: mods_num x u64
+ * result, in the same order as the moduli. A non-zero timeout_ms is a
+ * deadline relative to arrival: past it the server stops computing and
+ * answers STATUS_DEADLINE_EXCEEDED with no payload.
+ *
+ * OP_CANCEL has no payload; the header id names an earlier OP_FACTORIAL on
+ * the same connection whose answer is no longer wanted. It is never
+ * answered, and neither is the cancelled request.
+ *
+ * OP_SHM_ATTACH payload: u64 nonce, then the name of a shared-memory
+ * segment (see shmring.h), not NUL-terminated. The empty response's status
+ * says whether the server mapped it; if not, the client simply stays on
+ * TCP.
+ *
+ * OP_REDUCE request payload: u8 kind, u8 source, u16 reserved, u32
+ * timeout_ms, u64 seed, u64 offset, u64 length, then for REDUCE_SHARD the
+ * shard name (not NUL-terminated). It reduces the int32 elements
+ * [offset, offset + length) of an array: ReduceGenerate(seed, i) for
+ * REDUCE_GENERATED, or the little-endian file of that name in the server's
+ * --shard-dir. Response payload: REDUCE_RESULTS x u64, see
+ * EncodeReduceStats; fields the kind doesn't need are 0.
+ *
+ * OP_HELLO request has no payload. Response payload: u32 tnum, u32
+ * reserved, u64 multiplies per second measured by the server at startup. */
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define FRAME_MAX_PAYLOAD 1024
+
+#define OP_FACTORIAL 1
+#define OP_HELLO 2
+#define OP_CANCEL 3
+#define OP_SHM_ATTACH 4
+#define OP_REDUCE 5
+#define OP_RESPONSE 0x80
+
+#define STATUS_OK 0
+#define STATUS_BAD_REQUEST 1
+#define STATUS_UNKNOWN_OP 2
+#define STATUS_UNAVAILABLE 3 /* an aggregator lost its downstream servers */
+#define STATUS_DEADLINE_EXCEEDED 4
+
+struct FrameHeader {
+  uint8_t version;
+  uint8_t op;
+  uint16_t status;
+  uint32_t length;
+  uint64_t id;
+};
+
+struct FactorialRequest {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t mods[MAX_MODS];
+  uint32_t mods_num;
+  uint32_t timeout_ms; /* 0: no deadline */
+};
+
+#define REDUCE_MINMAX 1
+#define REDUCE_SUM 2
+#define REDUCE_STATS 3 /* everything in one pass */
+
+#define REDUCE_GENERATED 0
+#define REDUCE_SHARD 1
+#define SHARD_NAME_MAX 128
+
+struct ReduceRequest {
+  uint8_t kind;
+  uint8_t source;
+  uint32_t timeout_ms; /* 0: no deadline */
+  uint64_t seed;
+  uint64_t offset;
+  uint64_t length;
+  char shard[SHARD_NAME_MAX];
+};
+
+/* Partial result, merged with ReduceMerge. mean and m2 (the sum of squared
+ * deviations from the mean) combine exactly across chunks, unlike a sum of
+ * squares, which would overflow and lose precision. */
+struct ReduceStats {
+  uint64_t count;
+  int64_t min;
+  int64_t max;
+  int64_t sum;
+  double mean;
+  double m2;
+};
+
+#define REDUCE_RESULTS 6
+
+void PutU16(uint8_t *buf, uint16_t value);
+void PutU32(uint8_t *buf, uint32_t value);
+void PutU64(uint8_t *buf, uint64_t value);
+uint16_t GetU16(const uint8_t *buf);
+uint32_t GetU32(const uint8_t *buf);
+uint64_t GetU64(const uint8_t *buf);
+
+void EncodeHeader(uint8_t *buf, const struct FrameHeader *header);
+/* Returns false if the header is not a valid frame for this version. */
+bool DecodeHeader(const uint8_t *buf, struct FrameHeader *header);
+
+/* Encoders write a whole frame (header included) and return its size. */
+size_t EncodeFactorialRequest(uint8_t *buf, uint64_t id,
+                              const struct FactorialRequest *req);
+size_t EncodeResults(uint8_t *buf, uint8_t op, uint64_t id, uint16_t status,
+                     const uint64_t *results, size_t results_num);
+
+size_t EncodeHelloRequest(uint8_t *buf, uint64_t id);
+size_t EncodeCancel(uint8_t *buf, uint64_t id);
+size_t EncodeShmAttach(uint8_t *buf, uint64_t id, const char *name,
+                       uint64_t nonce);
+size_t EncodeHelloResponse(uint8_t *buf, uint64_t id, uint32_t tnum,
+                           uint64_t mults_per_sec);
+bool DecodeHelloResponse(const uint8_t *payload, uint32_t length,
+                         uint32_t *tnum, uint64_t *mults_per_sec);
+
+/* name gets the segment name NUL-terminated; false if it doesn't fit */
+bool DecodeShmAttach(const uint8_t *payload, uint32_t length, char *name,
+                     size_t name_size, uint64_t *nonce);
+bool DecodeFactorialRequest(const uint8_t *payload, uint32_t length,
+                            struct FactorialRequest *req);
+
+size_t EncodeReduceRequest(uint8_t *buf, uint64_t id,
+                           const struct ReduceRequest *req);
+bool DecodeReduceRequest(const uint8_t *payload, uint32_t length,
+                         struct ReduceRequest *req);
+/* The response travels as plain u64 words, doubles by their bit pattern. */
+void EncodeReduceStats(const struct ReduceStats *stats,
+                       uint64_t words[REDUCE_RESULTS]);
+void DecodeReduceStats(const uint64_t words[REDUCE_RESULTS],
+                       struct ReduceStats *stats);
+
+/* Blocking helpers that loop over partial transfers and EINTR. */
+bool SendAll(int fd, const void *buf, size_t len);
+bool RecvAll(int fd, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,106 @@
+#include "reduce.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+int32_t ReduceGenerate(uint64_t seed, uint64_t index) {
+  /* SplitMix64, whose state after n steps is just seed + n * gamma */
+  uint64_t z = seed + (index + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (int32_t)(z >> 33);
+}
+
+void ReduceStatsInit(struct ReduceStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void ReduceMerge(struct ReduceStats *into, const struct ReduceStats *from) {
+  if (from->count == 0)
+    return;
+  if (into->count == 0) {
+    *into = *from;
+    return;
+  }
+  /* Chan et al.: combine the means and the squared deviations */
+  double a = (double)into->count;
+  double b = (double)from->count;
+  double delta = from->mean - into->mean;
+  into->m2 += from->m2 + delta * delta * a * b / (a + b);
+  into->mean += delta * b / (a + b);
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->min < into->min)
+    into->min = from->min;
+  if (from->max > into->max)
+    into->max = from->max;
+}
+
+static bool ReadShard(int fd, uint64_t offset, size_t count,
+                      int32_t *values) {
+  uint8_t *buf = (uint8_t *)values;
+  size_t want = count * sizeof(int32_t);
+  size_t got = 0;
+  while (got < want) {
+    ssize_t n = pread(fd, buf + got, want - got,
+                      (off_t)(offset * sizeof(int32_t) + got));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    got += (size_t)n;
+  }
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  for (size_t i = 0; i < count; i++)
+    values[i] = (int32_t)GetU32(buf + 4 * i);
+#endif
+  return true;
+}
+
+bool ReduceBlock(const struct ReduceRequest *req, int fd, uint64_t offset,
+                 uint64_t length, struct ReduceStats *stats) {
+  int32_t values[REDUCE_BLOCK];
+  size_t n = (size_t)length;
+  ReduceStatsInit(stats);
+  if (n == 0)
+    return true;
+  if (req->source == REDUCE_SHARD) {
+    if (!ReadShard(fd, offset, n, values))
+      return false;
+  } else {
+    for (size_t i = 0; i < n; i++)
+      values[i] = ReduceGenerate(req->seed, offset + i);
+  }
+
+  stats->count = n;
+  if (req->kind != REDUCE_SUM) {
+    int32_t min = values[0];
+    int32_t max = values[0];
+    for (size_t i = 1; i < n; i++) {
+      min = values[i] < min ? values[i] : min;
+      max = values[i] > max ? values[i] : max;
+    }
+    stats->min = min;
+    stats->max = max;
+  }
+  if (req->kind != REDUCE_MINMAX) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+      sum += values[i];
+    stats->sum = sum;
+  }
+  if (req->kind == REDUCE_STATS) {
+    /* the block is still in cache, so a second pass is cheap and exact */
+    double mean = (double)stats->sum / n;
+    double m2 = 0;
+    for (size_t i = 0; i < n; i++) {
+      double d = values[i] - mean;
+      m2 += d * d;
+    }
+    stats->mean = mean;
+    stats->m2 = m2;
+  }
+  return true;
+}
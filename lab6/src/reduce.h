@@ -0,0 +1,31 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* Array reductions for OP_REDUCE, the distributed counterpart of the
+ * GetMinMax and Sum helpers from labs 3 and 4. The elements are int32, as
+ * there, and a chunk is reduced in blocks of REDUCE_BLOCK so work can be
+ * cancelled between them. */
+
+#define REDUCE_BLOCK 16384
+
+/* Element index of the array named by seed. Unlike srand/rand it can start
+ * anywhere, so every server generates just its own chunk; values are in
+ * [0, 2^31) like rand(). */
+int32_t ReduceGenerate(uint64_t seed, uint64_t index);
+
+/* count == 0 is the identity of ReduceMerge. */
+void ReduceStatsInit(struct ReduceStats *stats);
+void ReduceMerge(struct ReduceStats *into, const struct ReduceStats *from);
+
+/* Reduces elements [offset, offset + length) of req's array, length at
+ * most REDUCE_BLOCK. fd is the open shard for REDUCE_SHARD. Returns false
+ * if the shard could not be read. */
+bool ReduceBlock(const struct ReduceRequest *req, int fd, uint64_t offset,
+                 uint64_t length, struct ReduceStats *stats);
+
+#endif
@@ -0,0 +1,273 @@
+/* Replays traces recorded by `server --trace` against a set of servers and
+ * compares the latencies seen now with the service times recorded then.
+ *
+ * At a finite --speed requests are sent open-loop at their recorded arrival
+ * times (divided by speed) and latency is measured from the scheduled send
+ * time, so a server that falls behind is charged for the queueing it causes.
+ * With --speed max the arrival times are ignored and --inflight requests are
+ * kept outstanding. */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "factorial_client.h"
+#include "protocol.h"
+#include "stats.h"
+#include "trace.h"
+
+#define MAX_TRACES 64
+
+typedef struct {
+  struct FactorialClient *client;
+  struct TraceRecord *records;
+  size_t records_num;
+  size_t next;
+  uint64_t *sent_ns; /* per record: when it should have been sent */
+  size_t outstanding;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t slower; /* took at least twice the recorded service time */
+  struct Histogram recorded;
+  struct Histogram replayed;
+  struct Histogram send_lag;
+} Replay;
+
+int CompareArrival(const void *a, const void *b) {
+  const struct TraceRecord *x = (const struct TraceRecord *)a;
+  const struct TraceRecord *y = (const struct TraceRecord *)b;
+  return (x->arrival_ns > y->arrival_ns) - (x->arrival_ns < y->arrival_ns);
+}
+
+void OnDone(void *ctx, uint64_t handle, int status, const uint64_t *results,
+            size_t results_num);
+
+/* Only the first modulus is recorded; the rest are made up so the server
+ * does the same amount of work. */
+bool SubmitRecord(Replay *r, size_t i, uint64_t scheduled_ns) {
+  const struct TraceRecord *rec = &r->records[i];
+  uint64_t mods[MAX_MODS];
+  uint32_t mods_num = rec->mods_num;
+  if (mods_num == 0 || mods_num > MAX_MODS)
+    mods_num = 1;
+  for (uint32_t j = 0; j < mods_num; j++)
+    mods[j] = (rec->mod ? rec->mod : 1000000007) + j;
+  r->sent_ns[i] = scheduled_ns;
+  r->outstanding++;
+  if (FactorialClientSubmit(r->client, rec->begin, rec->end, mods, mods_num,
+                            OnDone, (void *)i) == 0) {
+    r->outstanding--;
+    r->failed++;
+    return false;
+  }
+  return true;
+}
+
+static Replay replay;
+
+void OnDone(void *ctx, uint64_t handle, int status, const uint64_t *results,
+            size_t results_num) {
+  (void)handle;
+  (void)results;
+  (void)results_num;
+  Replay *r = &replay;
+  size_t i = (size_t)ctx;
+  uint64_t latency = NowNs() - r->sent_ns[i];
+  r->outstanding--;
+  if (status != FACTORIAL_OK) {
+    r->failed++;
+    return;
+  }
+  r->completed++;
+  HistRecord(&r->replayed, latency);
+  if (latency >= 2 * r->records[i].service_ns)
+    r->slower++;
+}
+
+/* Sends every record whose time has come; returns ns until the next one. */
+uint64_t SendDue(Replay *r, uint64_t start, double speed) {
+  uint64_t now = NowNs();
+  while (r->next < r->records_num) {
+    uint64_t due = start + (uint64_t)(r->records[r->next].arrival_ns / speed);
+    if (due > now)
+      return due - now;
+    HistRecord(&r->send_lag, now - due);
+    SubmitRecord(r, r->next++, due);
+  }
+  return 0;
+}
+
+void RunOpenLoop(Replay *r, double speed) {
+  uint64_t start = NowNs();
+  while (r->next < r->records_num) {
+    uint64_t wait = SendDue(r, start, speed);
+    /* epoll only sleeps in whole milliseconds: spin for the remainder */
+    int timeout = wait >= 2000000 ? (int)(wait / 1000000) - 1 : 0;
+    if (FactorialClientPoll(r->client, timeout) < 0)
+      break;
+  }
+}
+
+void RunClosedLoop(Replay *r, size_t inflight) {
+  while (r->next < r->records_num || r->outstanding > 0) {
+    while (r->next < r->records_num && r->outstanding < inflight)
+      SubmitRecord(r, r->next++, NowNs());
+    if (FactorialClientPoll(r->client, 100) < 0)
+      break;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *traces[MAX_TRACES];
+  int traces_num = 0;
+  char servers_path[255] = {'\0'};
+  double speed = 1;
+  bool max_speed = false;
+  int inflight = 1024;
+  struct FactorialClientOptions options;
+  FactorialClientDefaults(&options);
+
+  while (true) {
+    static struct option long_options[] = {
+        {"trace", required_argument, 0, 0},
+        {"servers", required_argument, 0, 0},
+        {"speed", required_argument, 0, 0},
+        {"inflight", required_argument, 0, 0},
+        {"timeout-ms", required_argument, 0, 0},
+        {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0: {
+      switch (option_index) {
+      case 0:
+        if (traces_num < MAX_TRACES)
+          traces[traces_num++] = optarg;
+        break;
+      case 1:
+        snprintf(servers_path, sizeof(servers_path), "%s", optarg);
+        break;
+      case 2:
+        if (strcmp(optarg, "max") == 0)
+          max_speed = true;
+        else
+          speed = atof(optarg);
+        break;
+      case 3:
+        inflight = atoi(optarg);
+        break;
+      case 4:
+        options.timeout_ms = atoi(optarg);
+        break;
+      default:
+        printf("Index %d is out of options\n", option_index);
+      }
+    } break;
+
+    case '?':
+      printf("Arguments error\n");
+      break;
+    default:
+      fprintf(stderr, "getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  if (traces_num == 0 || !strlen(servers_path) || speed <= 0 ||
+      inflight <= 0) {
+    fprintf(stderr,
+            "Using: %s --trace trace.bin [--trace trace.bin.1 ...] "
+            "--servers /path/to/file\n"
+            "       [--speed 1|N|max] [--inflight 1024] "
+            "[--timeout-ms 30000]\n"
+            "--speed N sends at N times the recorded rate; max keeps "
+            "--inflight requests outstanding\n",
+            argv[0]);
+    return 1;
+  }
+
+  /* one timeline for all files, starting at the earliest trace */
+  Replay *r = &replay;
+  uint64_t walls[MAX_TRACES];
+  struct TraceRecord *parts[MAX_TRACES];
+  long counts[MAX_TRACES];
+  uint64_t first_wall = UINT64_MAX;
+  for (int t = 0; t < traces_num; t++) {
+    counts[t] = TraceRead(traces[t], &parts[t], &walls[t]);
+    if (counts[t] < 0)
+      return 1;
+    r->records_num += counts[t];
+    if (walls[t] < first_wall)
+      first_wall = walls[t];
+  }
+  if (r->records_num == 0) {
+    fprintf(stderr, "The traces are empty\n");
+    return 1;
+  }
+  r->records = malloc(sizeof(struct TraceRecord) * r->records_num);
+  size_t n = 0;
+  for (int t = 0; t < traces_num; t++) {
+    for (long i = 0; i < counts[t]; i++) {
+      r->records[n] = parts[t][i];
+      r->records[n++].arrival_ns += walls[t] - first_wall;
+    }
+    free(parts[t]);
+  }
+  qsort(r->records, r->records_num, sizeof(struct TraceRecord),
+        CompareArrival);
+  uint64_t first_arrival = r->records[0].arrival_ns;
+  for (size_t i = 0; i < r->records_num; i++) {
+    r->records[i].arrival_ns -= first_arrival;
+    HistRecord(&r->recorded, r->records[i].service_ns);
+  }
+  r->sent_ns = calloc(r->records_num, sizeof(uint64_t));
+
+  r->client = FactorialClientCreate(&options);
+  if (r->client == NULL ||
+      FactorialClientAddServersFromFile(r->client, servers_path) <= 0)
+    return 1;
+  if (FactorialClientConnect(r->client, 2000) == 0) {
+    fprintf(stderr, "No server could be reached\n");
+    return 1;
+  }
+
+  uint64_t start = NowNs();
+  if (max_speed)
+    RunClosedLoop(r, inflight);
+  else
+    RunOpenLoop(r, speed);
+  FactorialClientWaitAll(r->client, -1);
+  double elapsed = (NowNs() - start) / 1e9;
+  double span = r->records[r->records_num - 1].arrival_ns / 1e9;
+
+  char buf[1024];
+  size_t len = 0;
+  len += HistFormatUs(&r->recorded, "recorded service", buf + len,
+                      sizeof(buf) - len);
+  len += HistFormatUs(&r->replayed, "replayed latency", buf + len,
+                      sizeof(buf) - len);
+  if (!max_speed)
+    HistFormatUs(&r->send_lag, "send lag", buf + len, sizeof(buf) - len);
+  if (max_speed)
+    printf("%zu requests recorded over %.2fs replayed at max speed "
+           "(%d in flight) in %.2fs (%.0f/s)\n",
+           r->records_num, span, inflight, elapsed, r->records_num / elapsed);
+  else
+    printf("%zu requests recorded over %.2fs replayed at %gx in %.2fs "
+           "(%.0f/s)\n",
+           r->records_num, span, speed, elapsed, r->records_num / elapsed);
+  printf("%lu completed, %lu failed, %lu (%.1f%%) at least 2x slower than "
+         "recorded\n%s",
+         r->completed, r->failed, r->slower,
+         r->completed ? 100.0 * r->slower / r->completed : 0.0, buf);
+
+  FactorialClientDestroy(r->client);
+  free(r->records);
+  free(r->sent_ns);
+  return 0;
+}
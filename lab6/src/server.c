@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* memmem, sched_setaffinity */
+#include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -5,84 +7,1202 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+
+#include "aggregator.h"
 #include "common.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "pool.h"
+#include "protocol.h"
+#include "shmring.h"
+#include "stats.h"
+#include "trace.h"
+
+#define CONN_IN_SIZE (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+#define MAX_EVENTS 256
+/* a shared-memory session polls its request ring this long before it
+ * sleeps, and wakes up at least this often to notice a detach */
+#define SHM_SPIN_NS 20000ULL
+#define SHM_IDLE_NS 100000000ULL
+/* how often it retries responses held back by a full response ring */
+#define SHM_BACKLOG_NS 200000ULL
+
+/* independent multiply chains per worker, see FactorialInterleaved */
+int factorial_lanes = 4;
+
+/* ranges shorter than this are computed on the event loop thread */
+uint64_t inline_max = 16384;
+
+/* identical requests in flight share one computation */
+bool coalesce = true;
+
+/* print every request and result to stdout (slow, for debugging) */
+bool verbose = false;
+
+/* --trace: every answered request is recorded here */
+struct TraceLog *trace_log = NULL;
+
+/* --shard-dir: where OP_REDUCE finds shard files; NULL refuses them */
+const char *shard_dir = NULL;
+
+struct Histogram small_latency;
+struct Histogram large_latency;
+
+/* SIGUSR1 only raises the flag and wakes the loop, which does the
+ * formatting: snprintf isn't async-signal-safe */
+volatile sig_atomic_t dump_latency = 0;
+int dump_latency_wake_fd = -1;
+
+void RequestLatencyDump(int sig) {
+  (void)sig;
+  int saved = errno;
+  dump_latency = 1;
+  if (dump_latency_wake_fd >= 0) {
+    uint64_t one = 1;
+    ssize_t n = write(dump_latency_wake_fd, &one, sizeof(one));
+    (void)n;
+  }
+  errno = saved;
+}
+
+void DumpLatency(void) {
+  char buf[512];
+  size_t len = HistFormatUs(&small_latency, "small ranges", buf, sizeof(buf));
+  len += HistFormatUs(&large_latency, "large ranges", buf + len,
+                      sizeof(buf) - len);
+  write(STDERR_FILENO, buf, len);
+}
+
+struct Connection;
+struct EventLoop;
+struct ShmSession;
+void ShmSessionStop(struct ShmSession *session);
+
+/* One parsed request; answered with its id as soon as it completes, so
+ * pipelined requests on a connection may finish out of order. */
+struct Request {
+  struct Connection *conn;
+  struct FactorialJob *job;
+  struct ReduceJob *reduce; /* OP_REDUCE instead of job; never coalesced */
+  uint64_t id;
+  uint8_t op;
+  uint64_t start_ns;
+  uint64_t range;
+  struct Request *next_done; /* loop completion list */
+  /* a leader computes; followers (job == NULL) are identical requests that
+   * arrived while it ran and get the same results */
+  bool keyed;
+  struct RequestKey key;
+  struct Request *followers;
+  uint16_t status; /* set when an aggregator could not get the result */
+  uint64_t deadline_ns; /* 0: none */
+  bool cancelled;       /* by OP_CANCEL; gets no answer */
+  /* leaders of long jobs, on the loop's active list until they finish */
+  bool active;
+  struct Request *active_prev;
+  struct Request *active_next;
+};
+
+struct Connection {
+  struct EventLoop *loop;
+  int fd;
+  bool closed;
+  bool want_write;
+  uint8_t in[CONN_IN_SIZE];
+  size_t in_len;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  int pending;
+  bool metrics;          /* a scrape on --metrics-port, not a client */
+  bool close_after_flush;
+  struct ShmSession *shm; /* attached segment, requests bypass the socket */
+  struct Connection *next_closed;
+};
 
-#include "pthread.h"
+/* Owned by the event loop thread, which is also the one that serves the
+ * snapshot, so plain fields suffice; pool workers keep their own counters
+ * in pool.stats. */
+struct LoopMetrics {
+  uint64_t requests;
+  uint64_t multiplies;
+  uint64_t errors;
+  uint64_t coalesced;
+  uint64_t cache_hits;
+  uint64_t inline_requests;
+  uint64_t inline_busy_ns;
+  uint64_t connections;
+  uint64_t connections_total;
+  uint64_t inflight;
+  uint64_t cancelled;
+  uint64_t skipped_multiplies; /* work saved by cancelling */
+  uint64_t reduce_requests;
+  uint64_t reduce_elements;
+  struct Histogram range;
+};
 
-struct FactorialArgs {
-  uint64_t begin;
-  uint64_t end;
-  uint64_t mod;
+struct EventLoop {
+  int epoll_fd;
+  int listen_fd;
+  int metrics_fd;
+  int wake_fd;
+  int tnum;
+  uint64_t mults_per_sec;
+  struct ThreadPool pool;
+  pthread_mutex_t done_lock;
+  struct Request *done_head;
+  struct Connection *closed_head;
+  struct LoopMetrics metrics;
+  struct InflightTable inflight;
+  struct ResultCache cache;
+  struct Aggregator *aggregator; /* --downstream; NULL if computing locally */
+  /* cancellation: jobs nobody waits for any more are stopped */
+  struct Request *active;
+  int deadlines; /* requests in flight that carry a deadline */
+  bool check_abandoned;
+  uint64_t next_deadline_scan_ns;
+  uint64_t shm_sessions;
+  uint64_t shm_requests; /* updated by the session threads */
 };
 
-uint64_t Factorial(const struct FactorialArgs *args) {
-  uint64_t ans = 1;
-  for (uint64_t i = args->begin; i <= args->end; i++) {
-    ans = MultModulo(ans, i, args->mod);
+void SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Runs on the worker that finished the job (or inline on the loop thread):
+ * hand the request back to the loop and wake it through the eventfd. */
+void PostRequest(struct Request *req) {
+  struct EventLoop *loop = req->conn->loop;
+
+  pthread_mutex_lock(&loop->done_lock);
+  bool was_empty = loop->done_head == NULL;
+  req->next_done = loop->done_head;
+  loop->done_head = req;
+  pthread_mutex_unlock(&loop->done_lock);
+
+  if (was_empty) {
+    uint64_t one = 1;
+    write(loop->wake_fd, &one, sizeof(one));
   }
-  return ans;
 }
 
-void *ThreadFactorial(void *args) {
-  struct FactorialArgs *fargs = (struct FactorialArgs *)args;
-  uint64_t *result = malloc(sizeof(uint64_t));
-  *result = Factorial(fargs);
-  return (void *)result;
+void PostCompletion(struct FactorialJob *job) {
+  PostRequest((struct Request *)job->ctx);
 }
 
-int main(int argc, char **argv) {
-  int tnum = -1;
-  int port = -1;
+void PostReduceCompletion(struct ReduceJob *job) {
+  PostRequest((struct Request *)job->ctx);
+}
 
-  while (true) {
-    int current_optind = optind ? optind : 1;
+void CloseConnection(struct Connection *conn) {
+  if (conn->closed)
+    return;
+  conn->closed = true;
+  if (!conn->metrics)
+    conn->loop->metrics.connections--;
+  if (conn->pending > 0)
+    conn->loop->check_abandoned = true;
+  if (conn->shm) {
+    ShmSessionStop(conn->shm);
+    conn->shm = NULL;
+    conn->loop->shm_sessions--;
+  }
+  epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conn->next_closed = conn->loop->closed_head;
+  conn->loop->closed_head = conn;
+}
 
-    static struct option options[] = {{"port", required_argument, 0, 0},
-                                      {"tnum", required_argument, 0, 0},
-                                      {0, 0, 0, 0}};
+/* Closed connections are freed between event batches, and only once the
+ * pool has returned every request that still points at them. */
+void ReapConnections(struct EventLoop *loop) {
+  struct Connection **link = &loop->closed_head;
+  while (*link) {
+    struct Connection *conn = *link;
+    if (conn->pending > 0) {
+      link = &conn->next_closed;
+      continue;
+    }
+    *link = conn->next_closed;
+    free(conn->out);
+    free(conn);
+  }
+}
 
-    int option_index = 0;
-    int c = getopt_long(argc, argv, "", options, &option_index);
+void UpdateInterest(struct Connection *conn) {
+  bool want_write = conn->out_len > 0;
+  if (want_write == conn->want_write)
+    return;
+  conn->want_write = want_write;
 
-    if (c == -1)
-      break;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
 
-    switch (c) {
-    case 0: {
-      switch (option_index) {
-      case 0:
-        port = atoi(optarg);
+/* Writes as much buffered output as the socket accepts right now. */
+void FlushOutput(struct Connection *conn) {
+  size_t sent = 0;
+  while (sent < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + sent, conn->out_len - sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
         break;
-      case 1:
-        tnum = atoi(optarg);
+      fprintf(stderr, "Can't send data to client\n");
+      CloseConnection(conn);
+      return;
+    }
+    sent += (size_t)n;
+  }
+  memmove(conn->out, conn->out + sent, conn->out_len - sent);
+  conn->out_len -= sent;
+  if (conn->out_len == 0 && conn->close_after_flush) {
+    CloseConnection(conn);
+    return;
+  }
+  UpdateInterest(conn);
+}
+
+void AppendOutput(struct Connection *conn, const void *data, size_t len) {
+  if (conn->out_len + len > conn->out_cap) {
+    size_t cap = conn->out_cap ? conn->out_cap * 2 : 256;
+    while (cap < conn->out_len + len)
+      cap *= 2;
+    conn->out = realloc(conn->out, cap);
+    conn->out_cap = cap;
+  }
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+}
+
+void SendResponse(struct Connection *conn, uint8_t op, uint64_t id,
+                  uint16_t status, const uint64_t *results,
+                  size_t results_num) {
+  uint8_t frame[FRAME_HEADER_SIZE + 8 * MAX_MODS];
+  size_t len = EncodeResults(frame, op, id, status, results, results_num);
+  AppendOutput(conn, frame, len);
+  FlushOutput(conn);
+}
+
+/* Sends the results (or just the status) and frees the request, not its
+ * job. */
+void AnswerRequest(struct EventLoop *loop, struct Request *req,
+                   uint16_t status, const uint64_t *results,
+                   size_t results_num) {
+  struct Connection *conn = req->conn;
+  HistRecord(req->range < inline_max ? &small_latency : &large_latency,
+             NowNs() - req->start_ns);
+  conn->pending--;
+  loop->metrics.inflight--;
+  if (req->deadline_ns)
+    loop->deadlines--;
+  /* for a closed connection there is nobody to answer; the reaper frees it */
+  if (!conn->closed && !req->cancelled) {
+    if (status != STATUS_OK)
+      results_num = 0;
+    else if (verbose)
+      printf("Total: %lu\n", results[0]);
+    SendResponse(conn, req->op, req->id, status, results, results_num);
+  }
+  free(req);
+}
+
+void ActiveInsert(struct EventLoop *loop, struct Request *req) {
+  req->active = true;
+  req->active_prev = NULL;
+  req->active_next = loop->active;
+  if (loop->active)
+    loop->active->active_prev = req;
+  loop->active = req;
+}
+
+void ActiveRemove(struct EventLoop *loop, struct Request *req) {
+  if (req->active_prev)
+    req->active_prev->active_next = req->active_next;
+  else
+    loop->active = req->active_next;
+  if (req->active_next)
+    req->active_next->active_prev = req->active_prev;
+  req->active = false;
+}
+
+bool StillWanted(const struct Request *req, uint64_t now) {
+  return !req->cancelled && !req->conn->closed &&
+         (req->deadline_ns == 0 || now < req->deadline_ns);
+}
+
+/* Stops every running job whose leader and followers have all been
+ * cancelled, disconnected or passed their deadlines. The job still comes
+ * back through DrainCompletions, which answers the ones still connected
+ * with STATUS_DEADLINE_EXCEEDED. */
+void CancelAbandoned(struct EventLoop *loop) {
+  uint64_t now = NowNs();
+  loop->check_abandoned = false;
+  loop->next_deadline_scan_ns = now + 5000000;
+
+  struct Request *leader = loop->active;
+  while (leader) {
+    struct Request *next = leader->active_next;
+    int waiting = 0;
+    bool wanted = false;
+    for (struct Request *req = leader; req && !wanted; req = req->followers) {
+      wanted = StillWanted(req, now);
+      waiting++;
+    }
+    if (!wanted) {
+      if (leader->reduce)
+        ReduceJobCancel(leader->reduce);
+      else
+        JobCancel(leader->job);
+      ActiveRemove(loop, leader);
+      /* a new identical request must not join a dead job */
+      if (leader->keyed) {
+        InflightRemove(&loop->inflight, &leader->key);
+        leader->keyed = false;
+      }
+      loop->metrics.cancelled += waiting;
+    }
+    leader = next;
+  }
+}
+
+/* OP_CANCEL: the id may have finished already, then there is nothing to do. */
+void CancelById(struct Connection *conn, uint64_t id) {
+  struct EventLoop *loop = conn->loop;
+  for (struct Request *leader = loop->active; leader;
+       leader = leader->active_next) {
+    for (struct Request *req = leader; req; req = req->followers) {
+      if (req->conn == conn && req->id == id && !req->cancelled) {
+        req->cancelled = true;
+        loop->check_abandoned = true;
+        return;
+      }
+    }
+  }
+}
+
+void FinishReduceRequest(struct EventLoop *loop, struct Request *req) {
+  struct ReduceJob *job = req->reduce;
+  uint16_t status = job->cancelled ? STATUS_DEADLINE_EXCEEDED
+                    : job->failed  ? STATUS_UNAVAILABLE
+                                   : STATUS_OK;
+  if (req->active)
+    ActiveRemove(loop, req);
+  uint64_t words[REDUCE_RESULTS];
+  EncodeReduceStats(&job->stats, words);
+  AnswerRequest(loop, req, status, words, REDUCE_RESULTS);
+  if (job->fd >= 0)
+    close(job->fd);
+  free(job);
+}
+
+void DrainCompletions(struct EventLoop *loop) {
+  uint64_t count;
+  read(loop->wake_fd, &count, sizeof(count));
+
+  pthread_mutex_lock(&loop->done_lock);
+  struct Request *req = loop->done_head;
+  loop->done_head = NULL;
+  pthread_mutex_unlock(&loop->done_lock);
+
+  while (req) {
+    struct Request *next = req->next_done;
+    if (req->reduce) {
+      FinishReduceRequest(loop, req);
+      req = next;
+      continue;
+    }
+    struct FactorialJob *job = req->job;
+    uint16_t status = req->status;
+    if (req->active)
+      ActiveRemove(loop, req);
+    if (job->cancelled) {
+      status = STATUS_DEADLINE_EXCEEDED;
+      loop->metrics.skipped_multiplies += job->skipped * job->mods_num;
+    }
+    if (req->keyed) {
+      InflightRemove(&loop->inflight, &req->key);
+      if (status == STATUS_OK)
+        CacheInsert(&loop->cache, &req->key, job->results);
+    }
+    while (req) {
+      struct Request *follower = req->followers;
+      if (trace_log)
+        TraceAppend(trace_log, req->start_ns, job->begin, job->end, job->mods,
+                    job->mods_num, NowNs() - req->start_ns, status,
+                    req->job ? TRACE_COMPUTED : TRACE_COALESCED);
+      AnswerRequest(loop, req, status, job->results, job->mods_num);
+      req = follower;
+    }
+    free(job);
+    req = next;
+  }
+}
+
+/* The downstream results go through the same completion path as a local
+ * job, so coalescing, caching and latency stats apply unchanged. */
+void FanoutDone(void *ctx, bool ok, const uint64_t *results,
+                size_t results_num) {
+  struct Request *req = (struct Request *)ctx;
+  memcpy(req->job->results, results, sizeof(uint64_t) * results_num);
+  if (!ok)
+    req->status = STATUS_UNAVAILABLE;
+  PostCompletion(req->job);
+}
+
+void StartRequest(struct Connection *conn, uint64_t id,
+                  const struct FactorialRequest *freq) {
+  struct EventLoop *loop = conn->loop;
+  uint64_t begin = freq->begin;
+  uint64_t end = freq->end;
+
+  if (verbose)
+    printf("Receive: %lu %lu %lu (%u moduli)\n", begin, end, freq->mods[0],
+           freq->mods_num);
+
+  struct LoopMetrics *m = &loop->metrics;
+  struct RequestKey key;
+  KeyInit(&key, freq);
+  m->requests++;
+  HistRecord(&m->range, begin <= end ? end - begin + 1 : 0);
+
+  uint64_t results[MAX_MODS];
+  uint64_t lookup_ns = trace_log ? NowNs() : 0;
+  if (CacheLookup(&loop->cache, &key, results)) {
+    m->cache_hits++;
+    if (trace_log)
+      TraceAppend(trace_log, lookup_ns, begin, end, freq->mods, freq->mods_num,
+                  NowNs() - lookup_ns, STATUS_OK, TRACE_CACHED);
+    if (verbose)
+      printf("Total: %lu (cached)\n", results[0]);
+    SendResponse(conn, OP_FACTORIAL, id, STATUS_OK, results, freq->mods_num);
+    return;
+  }
+
+  struct Request *leader =
+      coalesce ? (struct Request *)InflightFind(&loop->inflight, &key) : NULL;
+  struct Request *req = calloc(1, sizeof(struct Request));
+  struct FactorialJob *job =
+      leader ? NULL
+             : JobCreate(begin, end, freq->mods, freq->mods_num, loop->tnum);
+  if (req == NULL || (leader == NULL && job == NULL)) {
+    fprintf(stderr, "Out of memory\n");
+    free(req);
+    free(job);
+    CloseConnection(conn);
+    return;
+  }
+
+  req->conn = conn;
+  req->job = job;
+  req->id = id;
+  req->op = OP_FACTORIAL;
+  req->start_ns = NowNs();
+  req->range = begin <= end ? end - begin + 1 : 0;
+  if (freq->timeout_ms) {
+    req->deadline_ns = req->start_ns + freq->timeout_ms * 1000000ULL;
+    loop->deadlines++;
+  }
+  conn->pending++;
+  m->inflight++;
+
+  if (leader) {
+    req->followers = leader->followers;
+    leader->followers = req;
+    m->coalesced++;
+    return;
+  }
+  if (coalesce) {
+    req->keyed = true;
+    req->key = key;
+    InflightInsert(&loop->inflight, &req->key, req);
+  }
+  job->lanes = factorial_lanes;
+  job->on_done = PostCompletion;
+  job->ctx = req;
+  if (req->range >= inline_max)
+    ActiveInsert(loop, req);
+
+  if (loop->aggregator && req->range >= inline_max) {
+    if (!AggregatorSubmit(loop->aggregator, freq, FanoutDone, req)) {
+      req->status = STATUS_UNAVAILABLE;
+      PostCompletion(job);
+    }
+    return;
+  }
+  m->multiplies += req->range * freq->mods_num;
+  uint64_t range = req->range;
+  uint64_t start_ns = req->start_ns;
+  JobStart(&loop->pool, job, inline_max);
+  if (range < inline_max) {
+    /* computed on this thread before JobStart returned */
+    m->inline_requests++;
+    m->inline_busy_ns += NowNs() - start_ns;
+  }
+}
+
+/* Opens a shard under --shard-dir that holds all of req's elements. Names
+ * are plain file names, so a request can't reach outside the directory. */
+int OpenShard(const struct ReduceRequest *req) {
+  const char *allowed = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                        "0123456789._-";
+  if (shard_dir == NULL || req->shard[0] == '.' ||
+      req->shard[strspn(req->shard, allowed)] != '\0')
+    return -1;
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", shard_dir, req->shard);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 ||
+      (uint64_t)st.st_size / sizeof(int32_t) < req->offset + req->length) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void StartReduce(struct Connection *conn, uint64_t id,
+                 const struct ReduceRequest *rreq) {
+  struct EventLoop *loop = conn->loop;
+  struct LoopMetrics *m = &loop->metrics;
+  m->requests++;
+  m->reduce_requests++;
+  HistRecord(&m->range, rreq->length);
+
+  int fd = -1;
+  if (rreq->source == REDUCE_SHARD && (fd = OpenShard(rreq)) < 0) {
+    m->errors++;
+    SendResponse(conn, OP_REDUCE, id, STATUS_BAD_REQUEST, NULL, 0);
+    return;
+  }
+  struct Request *req = calloc(1, sizeof(struct Request));
+  struct ReduceJob *job = ReduceJobCreate(rreq, fd, loop->tnum);
+  if (req == NULL || job == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    free(req);
+    free(job);
+    if (fd >= 0)
+      close(fd);
+    CloseConnection(conn);
+    return;
+  }
+
+  req->conn = conn;
+  req->reduce = job;
+  req->id = id;
+  req->op = OP_REDUCE;
+  req->start_ns = NowNs();
+  req->range = rreq->length;
+  if (rreq->timeout_ms) {
+    req->deadline_ns = req->start_ns + rreq->timeout_ms * 1000000ULL;
+    loop->deadlines++;
+  }
+  conn->pending++;
+  m->inflight++;
+  m->reduce_elements += rreq->length;
+
+  job->on_done = PostReduceCompletion;
+  job->ctx = req;
+  if (req->range >= inline_max)
+    ActiveInsert(loop, req);
+  ReduceJobStart(&loop->pool, job, inline_max);
+}
+
+/* A client on the same host that attached a segment gets its own thread,
+ * which takes frames off the request ring and runs them on the shared pool
+ * (short ranges inline, like the loop does). Responses are pushed straight
+ * from whichever thread finishes the job, so these requests never touch
+ * the event loop: they skip coalescing, the result cache and deadlines.
+ * If the client lets its response ring fill up, responses wait in a
+ * backlog that the session thread flushes, so a pool worker never waits
+ * for a slow client. */
+struct ShmBacklogEntry {
+  struct ShmBacklogEntry *next;
+  size_t len;
+  uint8_t frame[FRAME_HEADER_SIZE + 8 * MAX_MODS];
+};
+
+struct ShmSession {
+  struct EventLoop *loop;
+  struct ShmSegment *seg;
+  bool stop;   /* set by the loop when the TCP connection goes away */
+  int pending; /* jobs still on the pool */
+  pthread_mutex_t backlog_lock;
+  struct ShmBacklogEntry *backlog_head;
+  struct ShmBacklogEntry *backlog_tail;
+};
+
+struct ShmRequest {
+  struct ShmSession *session;
+  uint64_t id;
+  uint64_t start_ns;
+};
+
+void ShmRespond(struct ShmSession *session, uint64_t id, uint16_t status,
+                const uint64_t *results, size_t results_num) {
+  uint8_t frame[FRAME_HEADER_SIZE + 8 * MAX_MODS];
+  size_t len = EncodeResults(frame, OP_FACTORIAL, id, status, results,
+                             results_num);
+  /* responses carry their id, so one overtaking the backlog is fine */
+  if (__atomic_load_n(&session->backlog_head, __ATOMIC_ACQUIRE) == NULL &&
+      ShmPush(&session->seg->responses, frame, len))
+    return;
+  if (__atomic_load_n(&session->stop, __ATOMIC_ACQUIRE))
+    return;
+  struct ShmBacklogEntry *entry = malloc(sizeof(*entry));
+  if (entry == NULL)
+    return;
+  entry->next = NULL;
+  entry->len = len;
+  memcpy(entry->frame, frame, len);
+  pthread_mutex_lock(&session->backlog_lock);
+  if (session->backlog_tail)
+    session->backlog_tail->next = entry;
+  else
+    __atomic_store_n(&session->backlog_head, entry, __ATOMIC_RELEASE);
+  session->backlog_tail = entry;
+  pthread_mutex_unlock(&session->backlog_lock);
+}
+
+/* Session thread: moves held-back responses into the ring as it drains.
+ * Returns true if some are still waiting. */
+bool ShmFlushBacklog(struct ShmSession *session) {
+  pthread_mutex_lock(&session->backlog_lock);
+  struct ShmBacklogEntry *entry;
+  while ((entry = session->backlog_head) != NULL &&
+         ShmPush(&session->seg->responses, entry->frame, entry->len)) {
+    __atomic_store_n(&session->backlog_head, entry->next, __ATOMIC_RELEASE);
+    if (entry->next == NULL)
+      session->backlog_tail = NULL;
+    free(entry);
+  }
+  bool left = session->backlog_head != NULL;
+  pthread_mutex_unlock(&session->backlog_lock);
+  return left;
+}
+
+void ShmJobDone(struct FactorialJob *job) {
+  struct ShmRequest *req = (struct ShmRequest *)job->ctx;
+  struct ShmSession *session = req->session;
+  if (trace_log)
+    TraceAppend(trace_log, req->start_ns, job->begin, job->end, job->mods,
+                job->mods_num, NowNs() - req->start_ns, STATUS_OK, TRACE_SHM);
+  ShmRespond(session, req->id, STATUS_OK, job->results, job->mods_num);
+  free(req);
+  free(job);
+  __atomic_sub_fetch(&session->pending, 1, __ATOMIC_RELEASE);
+}
+
+void ShmHandleFrame(struct ShmSession *session, const uint8_t *frame,
+                    size_t len) {
+  struct EventLoop *loop = session->loop;
+  struct FrameHeader header;
+  struct FactorialRequest freq;
+  if (!DecodeHeader(frame, &header) || FRAME_HEADER_SIZE + header.length != len)
+    return;
+  if (header.op != OP_FACTORIAL) {
+    ShmRespond(session, header.id, STATUS_UNKNOWN_OP, NULL, 0);
+    return;
+  }
+  if (!DecodeFactorialRequest(frame + FRAME_HEADER_SIZE, header.length,
+                              &freq)) {
+    ShmRespond(session, header.id, STATUS_BAD_REQUEST, NULL, 0);
+    return;
+  }
+  __atomic_add_fetch(&loop->shm_requests, 1, __ATOMIC_RELAXED);
+
+  struct ShmRequest *req = malloc(sizeof(struct ShmRequest));
+  struct FactorialJob *job = JobCreate(freq.begin, freq.end, freq.mods,
+                                       freq.mods_num, loop->tnum);
+  if (req == NULL || job == NULL) {
+    free(req);
+    free(job);
+    ShmRespond(session, header.id, STATUS_UNAVAILABLE, NULL, 0);
+    return;
+  }
+  req->session = session;
+  req->id = header.id;
+  req->start_ns = NowNs();
+  job->lanes = factorial_lanes;
+  job->on_done = ShmJobDone;
+  job->ctx = req;
+  __atomic_add_fetch(&session->pending, 1, __ATOMIC_RELAXED);
+  JobStart(&loop->pool, job, inline_max);
+}
+
+void *ShmSessionThread(void *arg) {
+  struct ShmSession *session = (struct ShmSession *)arg;
+  uint8_t frame[SHM_SLOT_SIZE];
+  while (!__atomic_load_n(&session->stop, __ATOMIC_ACQUIRE)) {
+    bool backlog = __atomic_load_n(&session->backlog_head, __ATOMIC_ACQUIRE) &&
+                   ShmFlushBacklog(session);
+    size_t len = ShmPop(&session->seg->requests, frame);
+    if (len > 0)
+      ShmHandleFrame(session, frame, len);
+    else
+      ShmWait(&session->seg->requests, SHM_SPIN_NS,
+              backlog ? SHM_BACKLOG_NS : SHM_IDLE_NS);
+  }
+  /* jobs on the pool still write to the segment */
+  while (__atomic_load_n(&session->pending, __ATOMIC_ACQUIRE) > 0)
+    usleep(1000);
+  while (session->backlog_head) {
+    struct ShmBacklogEntry *entry = session->backlog_head;
+    session->backlog_head = entry->next;
+    free(entry);
+  }
+  pthread_mutex_destroy(&session->backlog_lock);
+  ShmClose(session->seg);
+  free(session);
+  return NULL;
+}
+
+/* OP_SHM_ATTACH: map the client's segment and start serving it. An
+ * aggregator declines, since its work has to go through the loop. */
+void AttachShm(struct Connection *conn, uint64_t id, const uint8_t *payload,
+               uint32_t length) {
+  char name[SHM_NAME_MAX];
+  uint64_t nonce;
+  if (conn->shm ||
+      !DecodeShmAttach(payload, length, name, sizeof(name), &nonce)) {
+    SendResponse(conn, OP_SHM_ATTACH, id, STATUS_BAD_REQUEST, NULL, 0);
+    return;
+  }
+
+  struct ShmSegment *seg =
+      conn->loop->aggregator ? NULL : ShmOpen(name, nonce);
+  struct ShmSession *session = seg ? calloc(1, sizeof(*session)) : NULL;
+  pthread_t thread;
+  if (session) {
+    session->loop = conn->loop;
+    session->seg = seg;
+    pthread_mutex_init(&session->backlog_lock, NULL);
+    if (pthread_create(&thread, NULL, ShmSessionThread, session) != 0) {
+      pthread_mutex_destroy(&session->backlog_lock);
+      free(session);
+      session = NULL;
+    }
+  }
+  if (session == NULL) {
+    if (seg)
+      ShmClose(seg);
+    SendResponse(conn, OP_SHM_ATTACH, id, STATUS_UNAVAILABLE, NULL, 0);
+    return;
+  }
+  pthread_detach(thread);
+  conn->shm = session;
+  conn->loop->shm_sessions++;
+  SendResponse(conn, OP_SHM_ATTACH, id, STATUS_OK, NULL, 0);
+}
+
+void ShmSessionStop(struct ShmSession *session) {
+  __atomic_store_n(&session->stop, true, __ATOMIC_RELEASE);
+  ShmWake(&session->seg->requests);
+}
+
+/* Latency and compute time buckets, in ns: 1us .. 10s in 1-2.5-5 steps. */
+static const uint64_t kTimeBounds[] = {
+    1000,      2500,      5000,       10000,      25000,      50000,
+    100000,    250000,    500000,     1000000,    2500000,    5000000,
+    10000000,  25000000,  50000000,   100000000,  250000000,  500000000,
+    1000000000, 2500000000, 5000000000, 10000000000};
+
+/* Range size buckets: powers of 4 up to 2^40. */
+static const uint64_t kRangeBounds[] = {
+    1,          4,          16,          64,          256,
+    1024,       4096,       16384,       65536,       262144,
+    1048576,    4194304,    16777216,    67108864,    268435456,
+    1073741824, 4294967296, 17179869184, 68719476736, 274877906944,
+    1099511627776};
+
+#define BOUNDS_NUM(bounds) (sizeof(bounds) / sizeof((bounds)[0]))
+
+void WriteMetrics(struct EventLoop *loop, struct MetricsText *out) {
+  struct LoopMetrics *m = &loop->metrics;
+  PromHeader(out, "factorial_requests_total", "counter",
+             "Factorial requests accepted.");
+  PromValue(out, "factorial_requests_total", NULL, m->requests);
+  PromHeader(out, "factorial_request_errors_total", "counter",
+             "Frames answered with a non-OK status.");
+  PromValue(out, "factorial_request_errors_total", NULL, m->errors);
+  PromHeader(out, "factorial_multiplies_total", "counter",
+             "Modular multiplications computed (range x moduli).");
+  PromValue(out, "factorial_multiplies_total", NULL, m->multiplies);
+  PromHeader(out, "factorial_coalesced_requests_total", "counter",
+             "Requests that joined an identical one already in flight.");
+  PromValue(out, "factorial_coalesced_requests_total", NULL, m->coalesced);
+  PromHeader(out, "factorial_cache_hits_total", "counter",
+             "Requests answered from the recent results cache.");
+  PromValue(out, "factorial_cache_hits_total", NULL, m->cache_hits);
+  PromHeader(out, "factorial_cache_evictions_total", "counter",
+             "Results dropped from the cache to make room.");
+  PromValue(out, "factorial_cache_evictions_total", NULL,
+            loop->cache.evictions);
+  PromHeader(out, "factorial_cache_entries", "gauge",
+             "Results currently cached.");
+  PromValue(out, "factorial_cache_entries", NULL, loop->cache.size);
+  PromHeader(out, "factorial_inline_requests_total", "counter",
+             "Requests short enough to run on the event loop thread.");
+  PromValue(out, "factorial_inline_requests_total", NULL, m->inline_requests);
+  PromHeader(out, "factorial_requests_inflight", "gauge",
+             "Requests accepted but not answered yet.");
+  PromValue(out, "factorial_requests_inflight", NULL, m->inflight);
+  PromHeader(out, "factorial_pool_queue_depth", "gauge",
+             "Request parts waiting for a pool worker.");
+  PromValue(out, "factorial_pool_queue_depth", NULL,
+            PoolQueueDepth(&loop->pool));
+  PromHeader(out, "factorial_connections", "gauge", "Open client connections.");
+  PromValue(out, "factorial_connections", NULL, m->connections);
+  PromHeader(out, "factorial_connections_total", "counter",
+             "Client connections accepted.");
+  PromValue(out, "factorial_connections_total", NULL, m->connections_total);
+  PromHeader(out, "factorial_shm_sessions", "gauge",
+             "Clients attached over shared memory.");
+  PromValue(out, "factorial_shm_sessions", NULL, loop->shm_sessions);
+  PromHeader(out, "factorial_shm_requests_total", "counter",
+             "Requests received over shared memory (not in requests_total).");
+  PromValue(out, "factorial_shm_requests_total", NULL,
+            __atomic_load_n(&loop->shm_requests, __ATOMIC_RELAXED));
+  if (trace_log) {
+    PromHeader(out, "factorial_trace_records_total", "counter",
+               "Requests written to the --trace file.");
+    PromValue(out, "factorial_trace_records_total", NULL,
+              __atomic_load_n(&trace_log->written, __ATOMIC_RELAXED));
+    PromHeader(out, "factorial_trace_dropped_total", "counter",
+               "Requests not traced because the flusher fell behind.");
+    PromValue(out, "factorial_trace_dropped_total", NULL,
+              __atomic_load_n(&trace_log->dropped, __ATOMIC_RELAXED));
+  }
+  PromHeader(out, "factorial_cancelled_requests_total", "counter",
+             "Requests dropped after a disconnect, OP_CANCEL or deadline.");
+  PromValue(out, "factorial_cancelled_requests_total", NULL, m->cancelled);
+  /* estimated from the startup benchmark: skipped multiplies at the rate
+   * of one worker */
+  double per_thread = loop->mults_per_sec ? (double)loop->mults_per_sec /
+                                                loop->tnum
+                                          : 0;
+  PromHeader(out, "factorial_cancelled_cpu_seconds_total", "counter",
+             "Worker time saved by stopping cancelled jobs early.");
+  PromValue(out, "factorial_cancelled_cpu_seconds_total", NULL,
+            per_thread > 0 ? m->skipped_multiplies / per_thread : 0);
+  PromHeader(out, "factorial_reduce_requests_total", "counter",
+             "OP_REDUCE requests (min/max, sum, stats over an array).");
+  PromValue(out, "factorial_reduce_requests_total", NULL, m->reduce_requests);
+  PromHeader(out, "factorial_reduce_elements_total", "counter",
+             "Array elements those requests covered.");
+  PromValue(out, "factorial_reduce_elements_total", NULL, m->reduce_elements);
+  if (loop->aggregator) {
+    const struct Aggregator *agg = loop->aggregator;
+    PromHeader(out, "factorial_fanouts_total", "counter",
+               "Requests split across downstream servers.");
+    PromValue(out, "factorial_fanouts_total", NULL, agg->fanouts);
+    PromHeader(out, "factorial_fanout_pieces_total", "counter",
+               "Pieces sent downstream, retries included.");
+    PromValue(out, "factorial_fanout_pieces_total", NULL, agg->pieces);
+    PromHeader(out, "factorial_fanout_retries_total", "counter",
+               "Pieces resent after a downstream failure or timeout.");
+    PromValue(out, "factorial_fanout_retries_total", NULL, agg->retries);
+    PromHeader(out, "factorial_fanout_failures_total", "counter",
+               "Pieces that failed on every attempt.");
+    PromValue(out, "factorial_fanout_failures_total", NULL, agg->failures);
+    PromHeader(out, "factorial_downstream_threads", "gauge",
+               "Threads advertised by ready downstream servers.");
+    PromValue(out, "factorial_downstream_threads", NULL,
+              AggregatorThreads(agg));
+  }
+
+  PromHeader(out, "factorial_request_latency_seconds", "histogram",
+             "Time from parsing a request to queueing its response.");
+  PromHistogram(out, "factorial_request_latency_seconds", "class=\"small\"",
+                &small_latency, kTimeBounds, BOUNDS_NUM(kTimeBounds), 1e-9);
+  PromHistogram(out, "factorial_request_latency_seconds", "class=\"large\"",
+                &large_latency, kTimeBounds, BOUNDS_NUM(kTimeBounds), 1e-9);
+  PromHeader(out, "factorial_request_range", "histogram",
+             "Number of factors per request.");
+  PromHistogram(out, "factorial_request_range", NULL, &m->range, kRangeBounds,
+                BOUNDS_NUM(kRangeBounds), 1);
+
+  /* worker slots are summed here rather than shared while recording */
+  struct Histogram *compute = calloc(1, sizeof(struct Histogram));
+  char labels[32];
+  PromHeader(out, "factorial_worker_busy_seconds_total", "counter",
+             "Time each thread spent computing request parts.");
+  PromValue(out, "factorial_worker_busy_seconds_total", "worker=\"loop\"",
+            m->inline_busy_ns / 1e9);
+  for (int i = 0; i < loop->pool.threads_num; i++) {
+    struct WorkerStats *w = &loop->pool.stats[i];
+    snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+    PromValue(out, "factorial_worker_busy_seconds_total", labels,
+              __atomic_load_n(&w->busy_ns, __ATOMIC_RELAXED) / 1e9);
+  }
+  PromHeader(out, "factorial_worker_tasks_total", "counter",
+             "Request parts run by each pool worker.");
+  for (int i = 0; i < loop->pool.threads_num; i++) {
+    struct WorkerStats *w = &loop->pool.stats[i];
+    snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+    PromValue(out, "factorial_worker_tasks_total", labels,
+              __atomic_load_n(&w->tasks, __ATOMIC_RELAXED));
+    HistMerge(compute, &w->task_ns);
+  }
+  PromHeader(out, "factorial_part_compute_seconds", "histogram",
+             "Compute time of one request part on a pool worker.");
+  PromHistogram(out, "factorial_part_compute_seconds", NULL, compute,
+                kTimeBounds, BOUNDS_NUM(kTimeBounds), 1e-9);
+  free(compute);
+}
+
+/* Answers once the HTTP request head has arrived; the body is ignored. */
+void HandleMetricsReadable(struct Connection *conn) {
+  while (!conn->closed && !conn->close_after_flush) {
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                     CONN_IN_SIZE - conn->in_len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      CloseConnection(conn);
+      return;
+    }
+    conn->in_len += (size_t)n;
+    bool complete = memmem(conn->in, conn->in_len, "\r\n\r\n", 4) ||
+                    memmem(conn->in, conn->in_len, "\n\n", 2) ||
+                    conn->in_len == CONN_IN_SIZE;
+    if (!complete)
+      continue;
+
+    struct MetricsText body = {0};
+    WriteMetrics(conn->loop, &body);
+    char head[160];
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\n\r\n",
+                       body.len);
+    AppendOutput(conn, head, (size_t)len);
+    AppendOutput(conn, body.buf, body.len);
+    MetricsFree(&body);
+    conn->in_len = 0;
+    conn->close_after_flush = true;
+    FlushOutput(conn);
+  }
+}
+
+void HandleReadable(struct Connection *conn) {
+  while (!conn->closed) {
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                     CONN_IN_SIZE - conn->in_len, 0);
+    if (n == 0) {
+      CloseConnection(conn);
+      return;
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "Client read failed\n");
+        CloseConnection(conn);
+      }
+      return;
+    }
+    conn->in_len += (size_t)n;
+
+    size_t off = 0;
+    while (conn->in_len - off >= FRAME_HEADER_SIZE) {
+      struct FrameHeader header;
+      if (!DecodeHeader(conn->in + off, &header)) {
+        fprintf(stderr, "Client send wrong data format\n");
+        CloseConnection(conn);
+        return;
+      }
+      if (conn->in_len - off < FRAME_HEADER_SIZE + header.length)
         break;
-      default:
-        printf("Index %d is out of options\n", option_index);
+      const uint8_t *payload = conn->in + off + FRAME_HEADER_SIZE;
+      off += FRAME_HEADER_SIZE + header.length;
+
+      struct FactorialRequest freq;
+      struct ReduceRequest rreq;
+      if (header.op != OP_HELLO && header.op != OP_FACTORIAL &&
+          header.op != OP_CANCEL && header.op != OP_SHM_ATTACH &&
+          header.op != OP_REDUCE)
+        conn->loop->metrics.errors++;
+      if (header.op == OP_REDUCE) {
+        if (DecodeReduceRequest(payload, header.length, &rreq)) {
+          StartReduce(conn, header.id, &rreq);
+        } else {
+          conn->loop->metrics.errors++;
+          SendResponse(conn, header.op, header.id, STATUS_BAD_REQUEST, NULL,
+                       0);
+        }
+      } else if (header.op == OP_SHM_ATTACH) {
+        AttachShm(conn, header.id, payload, header.length);
+      } else if (header.op == OP_CANCEL) {
+        CancelById(conn, header.id);
+      } else if (header.op == OP_HELLO) {
+        uint8_t frame[FRAME_HEADER_SIZE + 16];
+        /* an aggregator speaks for its whole subtree */
+        struct Aggregator *agg = conn->loop->aggregator;
+        size_t len = EncodeHelloResponse(
+            frame, header.id,
+            agg ? AggregatorThreads(agg) : (uint32_t)conn->loop->tnum,
+            agg ? AggregatorRate(agg) : conn->loop->mults_per_sec);
+        AppendOutput(conn, frame, len);
+        FlushOutput(conn);
+      } else if (header.op != OP_FACTORIAL) {
+        SendResponse(conn, header.op, header.id, STATUS_UNKNOWN_OP, NULL, 0);
+      } else if (!DecodeFactorialRequest(payload, header.length, &freq)) {
+        conn->loop->metrics.errors++;
+        SendResponse(conn, header.op, header.id, STATUS_BAD_REQUEST, NULL, 0);
+      } else {
+        StartRequest(conn, header.id, &freq);
       }
-    } break;
+      if (conn->closed)
+        return;
+    }
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+  }
+}
 
-    case '?':
-      printf("Unknown argument\n");
-      break;
-    default:
-      fprintf(stderr, "getopt returned character code 0%o?\n", c);
+void AcceptClients(struct EventLoop *loop, int listen_fd) {
+  while (true) {
+    struct sockaddr_in client;
+    socklen_t client_len = sizeof(client);
+    int client_fd = accept(listen_fd, (struct sockaddr *)&client, &client_len);
+    if (client_fd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "Could not establish new connection\n");
+      return;
+    }
+    SetNonBlocking(client_fd);
+
+    struct Connection *conn = calloc(1, sizeof(struct Connection));
+    if (conn == NULL) {
+      close(client_fd);
+      continue;
+    }
+    conn->loop = loop;
+    conn->fd = client_fd;
+    conn->metrics = listen_fd == loop->metrics_fd;
+
+    /* EPOLLRDHUP: a client that hung up mid-request frees its workers */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+      close(client_fd);
+      free(conn);
+      continue;
+    }
+    if (!conn->metrics) {
+      loop->metrics.connections++;
+      loop->metrics.connections_total++;
     }
   }
+}
 
-  if (port == -1 || tnum == -1) {
-    fprintf(stderr, "Using: %s --port 20001 --tnum 4\n", argv[0]);
-    return 1;
+int RunEventLoop(struct EventLoop *loop) {
+  struct epoll_event ev;
+  /* the listening socket and the eventfd are told apart by these markers */
+  ev.events = EPOLLIN;
+  ev.data.ptr = &loop->listen_fd;
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev);
+  ev.data.ptr = &loop->wake_fd;
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+  if (loop->metrics_fd >= 0) {
+    ev.data.ptr = &loop->metrics_fd;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->metrics_fd, &ev);
+  }
+  /* the downstream connections live in the dispatcher's own epoll set,
+   * which becomes readable whenever one of them has an event */
+  if (loop->aggregator) {
+    ev.data.ptr = loop->aggregator;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, AggregatorFd(loop->aggregator),
+              &ev);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    /* with downstream servers or request deadlines, wake up regularly to
+     * expire them */
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS,
+                       loop->aggregator || loop->deadlines > 0 ? 5 : -1);
+    if (dump_latency) {
+      dump_latency = 0;
+      DumpLatency();
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "epoll_wait failed\n");
+      return 1;
+    }
+
+    if (n == 0 && loop->aggregator)
+      AggregatorPoll(loop->aggregator);
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == loop->aggregator) {
+        AggregatorPoll(loop->aggregator);
+      } else if (ptr == &loop->listen_fd) {
+        AcceptClients(loop, loop->listen_fd);
+      } else if (ptr == &loop->metrics_fd) {
+        AcceptClients(loop, loop->metrics_fd);
+      } else if (ptr == &loop->wake_fd) {
+        DrainCompletions(loop);
+      } else {
+        struct Connection *conn = (struct Connection *)ptr;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          CloseConnection(conn);
+          continue;
+        }
+        if (events[i].events & EPOLLOUT)
+          FlushOutput(conn);
+        if (!conn->closed && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+          if (conn->metrics)
+            HandleMetricsReadable(conn);
+          else
+            HandleReadable(conn);
+        }
+      }
+    }
+    if (loop->check_abandoned ||
+        (loop->deadlines > 0 && NowNs() >= loop->next_deadline_scan_ns))
+      CancelAbandoned(loop);
+    ReapConnections(loop);
   }
+}
 
+/* Returns a non-blocking listening socket on port, or -1. With reuse_port
+ * several processes bind the same port and the kernel spreads incoming
+ * connections across them. */
+int ListenOn(int port, bool reuse_port) {
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
     fprintf(stderr, "Can not create server socket!");
-    return 1;
+    return -1;
   }
 
   struct sockaddr_in server;
@@ -92,97 +1212,421 @@ int main(int argc, char **argv) {
 
   int opt_val = 1;
   setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+  if (reuse_port &&
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt_val,
+                 sizeof(opt_val)) < 0) {
+    perror("SO_REUSEPORT");
+    close(server_fd);
+    return -1;
+  }
 
   int err = bind(server_fd, (struct sockaddr *)&server, sizeof(server));
   if (err < 0) {
     fprintf(stderr, "Can not bind to socket!");
-    return 1;
+    close(server_fd);
+    return -1;
   }
 
-  err = listen(server_fd, 128);
+  err = listen(server_fd, SOMAXCONN);
   if (err < 0) {
     fprintf(stderr, "Could not listen on socket\n");
+    close(server_fd);
+    return -1;
+  }
+  SetNonBlocking(server_fd);
+  return server_fd;
+}
+
+/* Times one large request on the whole pool; the rate is advertised to
+ * clients in the OP_HELLO handshake. */
+uint64_t MeasureCapacity(struct ThreadPool *pool, int tnum) {
+  const uint64_t range = 1 << 22;
+  const uint64_t mod = 1000003;
+  struct FactorialJob *job = JobCreate(1, range, &mod, 1, tnum);
+  if (job == NULL)
+    return 0;
+  job->lanes = factorial_lanes;
+
+  uint64_t start = NowNs();
+  JobRunSync(pool, job, 0);
+  uint64_t elapsed = NowNs() - start;
+  free(job);
+  return elapsed ? range * 1000000000ull / elapsed : 0;
+}
+
+struct ServerConfig {
+  int port;
+  int metrics_port;
+  int tnum;
+  int workers;      /* 0: serve from this process, no supervisor */
+  size_t cache_size; /* recent results kept per process */
+  const char *downstream; /* servers file for the aggregator role */
+  int downstream_timeout_ms;
+  const char *trace_path; /* one file per worker: path.N */
+  int cpus[CPU_SETSIZE];
+  int cpus_num;
+};
+
+/* Parses a CPU list such as "0-3,8,10-11". */
+int ParseCpuList(const char *str, int *cpus) {
+  int cpus_num = 0;
+  const char *p = str;
+  while (*p) {
+    char *end = NULL;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p)
+      return -1;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p)
+        return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE ||
+        (*end != ',' && *end != '\0'))
+      return -1;
+    for (long cpu = first; cpu <= last && cpus_num < CPU_SETSIZE; cpu++)
+      cpus[cpus_num++] = (int)cpu;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cpus_num;
+}
+
+/* Worker i gets every N-th CPU of the list starting at i, or a single CPU
+ * when there are fewer CPUs than workers. Threads inherit the mask. */
+void PinWorker(const struct ServerConfig *config, int worker) {
+  if (config->cpus_num == 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  int n = config->workers > 0 ? config->workers : 1;
+  if (config->cpus_num < n) {
+    CPU_SET(config->cpus[worker % config->cpus_num], &set);
+  } else {
+    for (int i = worker; i < config->cpus_num; i += n)
+      CPU_SET(config->cpus[i], &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    perror("sched_setaffinity");
+}
+
+/* One complete server: pool, listeners and event loop. In --workers mode
+ * every worker process runs this on the shared port; worker i serves
+ * metrics on metrics_port + i. */
+int RunServer(const struct ServerConfig *config, int worker) {
+  bool reuse_port = config->workers > 0;
+  int metrics_port =
+      config->metrics_port > 0 ? config->metrics_port + worker : -1;
+  PinWorker(config, worker);
+
+  struct EventLoop loop;
+  memset(&loop, 0, sizeof(loop));
+  loop.tnum = config->tnum;
+  pthread_mutex_init(&loop.done_lock, NULL);
+  InflightInit(&loop.inflight);
+  CacheInit(&loop.cache, config->cache_size);
+  if (PoolInit(&loop.pool, config->tnum) < 0)
     return 1;
+  if (config->downstream) {
+    /* the local pool only serves ranges below --inline-max */
+    loop.aggregator = malloc(sizeof(struct Aggregator));
+    if (AggregatorInit(loop.aggregator, config->downstream,
+                       config->downstream_timeout_ms * 1000000ULL) < 0)
+      return 1;
+  } else {
+    loop.mults_per_sec = MeasureCapacity(&loop.pool, config->tnum);
   }
 
-  printf("Server listening at %d\n", port);
+  if (config->trace_path) {
+    char path[PATH_MAX];
+    if (config->workers > 0)
+      snprintf(path, sizeof(path), "%s.%d", config->trace_path, worker);
+    else
+      snprintf(path, sizeof(path), "%s", config->trace_path);
+    trace_log = malloc(sizeof(struct TraceLog));
+    if (TraceOpen(trace_log, path) < 0)
+      return 1;
+  }
 
-  while (true) {
-    struct sockaddr_in client;
-    socklen_t client_len = sizeof(client);
-    int client_fd = accept(server_fd, (struct sockaddr *)&client, &client_len);
+  loop.listen_fd = ListenOn(config->port, reuse_port);
+  loop.metrics_fd = metrics_port > 0 ? ListenOn(metrics_port, false) : -1;
+  if (loop.listen_fd < 0 || (metrics_port > 0 && loop.metrics_fd < 0))
+    return 1;
+  loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop.epoll_fd < 0 || loop.wake_fd < 0) {
+    fprintf(stderr, "Could not create epoll instance\n");
+    return 1;
+  }
+  dump_latency_wake_fd = loop.wake_fd;
 
-    if (client_fd < 0) {
-      fprintf(stderr, "Could not establish new connection\n");
+  if (loop.aggregator)
+    printf("Aggregator listening at %d (%d downstream servers, %u threads, "
+           "%lu mults/sec)\n",
+           config->port, loop.aggregator->net.servers_num,
+           AggregatorThreads(loop.aggregator), AggregatorRate(loop.aggregator));
+  else if (config->workers > 0)
+    printf("Worker %d (pid %d) listening at %d (%d threads, %lu mults/sec)\n",
+           worker, getpid(), config->port, config->tnum, loop.mults_per_sec);
+  else
+    printf("Server listening at %d (%d threads, %lu mults/sec)\n",
+           config->port, config->tnum, loop.mults_per_sec);
+  fflush(stdout);
+
+  return RunEventLoop(&loop);
+}
+
+volatile sig_atomic_t supervisor_stop = 0;
+
+void StopSupervisor(int sig) {
+  (void)sig;
+  supervisor_stop = 1;
+}
+
+pid_t StartWorker(const struct ServerConfig *config, int worker) {
+  pid_t supervisor = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    /* don't outlive the supervisor; if it died before the prctl, no
+     * signal is coming, so check for that by hand */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor)
+      _exit(1);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    exit(RunServer(config, worker));
+  }
+  return pid;
+}
+
+/* Starts every worker that isn't running and whose retry time has come;
+ * a failed fork is retried a second later. */
+void StartDue(const struct ServerConfig *config, pid_t *pids,
+              uint64_t *started_ns, uint64_t *retry_ns) {
+  for (int i = 0; i < config->workers; i++) {
+    if (pids[i] > 0 || NowNs() < retry_ns[i])
       continue;
-    }
+    pids[i] = StartWorker(config, i);
+    started_ns[i] = NowNs();
+    if (pids[i] < 0)
+      retry_ns[i] = started_ns[i] + 1000000000ull;
+  }
+}
 
-    while (true) {
-      unsigned int buffer_size = sizeof(uint64_t) * 3;
-      char from_client[buffer_size];
-      int read = recv(client_fd, from_client, buffer_size, 0);
+/* Forks the workers and restarts any that die until SIGTERM/SIGINT, which
+ * is passed on to all of them. A worker that crashes within a second of
+ * starting is restarted after a pause so a broken setup can't spin. If no
+ * worker has been running for 10 seconds the supervisor gives up. */
+int Supervise(const struct ServerConfig *config) {
+  pid_t *pids = calloc(config->workers, sizeof(pid_t));
+  uint64_t *started_ns = calloc(config->workers, sizeof(uint64_t));
+  uint64_t *retry_ns = calloc(config->workers, sizeof(uint64_t));
+  int result = 0;
 
-      if (!read)
-        break;
-      if (read < 0) {
-        fprintf(stderr, "Client read failed\n");
-        break;
-      }
-      if (read < buffer_size) {
-        fprintf(stderr, "Client send wrong data format\n");
-        break;
-      }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = StopSupervisor;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
 
-      pthread_t threads[tnum];
+  uint64_t none_since_ns = 0;
+  while (!supervisor_stop) {
+    StartDue(config, pids, started_ns, retry_ns);
+    int running = 0;
+    for (int i = 0; i < config->workers; i++)
+      running += pids[i] > 0;
+    if (running > 0) {
+      none_since_ns = 0;
+    } else if (none_since_ns == 0) {
+      none_since_ns = NowNs();
+    } else if (NowNs() - none_since_ns >= 10000000000ull) {
+      fprintf(stderr, "No worker could be started, giving up\n");
+      result = 1;
+      break;
+    }
 
-      uint64_t begin = 0;
-      uint64_t end = 0;
-      uint64_t mod = 0;
-      memcpy(&begin, from_client, sizeof(uint64_t));
-      memcpy(&end, from_client + sizeof(uint64_t), sizeof(uint64_t));
-      memcpy(&mod, from_client + 2 * sizeof(uint64_t), sizeof(uint64_t));
+    /* with a start pending, poll so it is retried on time */
+    bool pending = running < config->workers;
+    int status;
+    pid_t pid = waitpid(-1, &status, pending ? WNOHANG : 0);
+    if (pid == 0 || (pid < 0 && errno == ECHILD && pending)) {
+      usleep(100000);
+      continue;
+    }
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("waitpid");
+      result = 1;
+      break;
+    }
+    int worker = -1;
+    for (int i = 0; i < config->workers; i++)
+      if (pids[i] == pid)
+        worker = i;
+    if (worker < 0 || supervisor_stop)
+      continue;
 
-      fprintf(stdout, "Receive: %llu %llu %llu\n", begin, end, mod);
+    if (WIFSIGNALED(status))
+      fprintf(stderr, "Worker %d (pid %d) killed by signal %d, restarting\n",
+              worker, pid, WTERMSIG(status));
+    else
+      fprintf(stderr, "Worker %d (pid %d) exited with %d, restarting\n",
+              worker, pid, WEXITSTATUS(status));
+    pids[worker] = -1;
+    retry_ns[worker] = NowNs() - started_ns[worker] < 1000000000ull
+                           ? started_ns[worker] + 1000000000ull
+                           : 0;
+  }
 
-      struct FactorialArgs args[tnum];
-      uint64_t range = end - begin + 1;
-      uint64_t step = range / tnum;
-      uint64_t current = begin;
+  for (int i = 0; i < config->workers; i++)
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+  }
+  free(pids);
+  free(started_ns);
+  free(retry_ns);
+  return result;
+}
 
-      for (uint32_t i = 0; i < tnum; i++) {
-        args[i].begin = current;
-        args[i].end = (i == tnum - 1) ? end : (current + step - 1);
-        args[i].mod = mod;
-        current = args[i].end + 1;
+int main(int argc, char **argv) {
+  static struct ServerConfig config;
+  config.tnum = -1;
+  config.port = -1;
+  config.metrics_port = -1;
+  config.cache_size = 1024;
+  config.downstream_timeout_ms = 30000;
 
-        if (pthread_create(&threads[i], NULL, ThreadFactorial, (void *)&args[i])) {
-          printf("Error: pthread_create failed!\n");
-          return 1;
-        }
-      }
+  while (true) {
+    static struct option options[] = {{"port", required_argument, 0, 0},
+                                      {"tnum", required_argument, 0, 0},
+                                      {"lanes", required_argument, 0, 0},
+                                      {"inline-max", required_argument, 0, 0},
+                                      {"metrics-port", required_argument, 0, 0},
+                                      {"verbose", no_argument, 0, 0},
+                                      {"workers", required_argument, 0, 0},
+                                      {"cpus", required_argument, 0, 0},
+                                      {"cache-size", required_argument, 0, 0},
+                                      {"no-coalesce", no_argument, 0, 0},
+                                      {"downstream", required_argument, 0, 0},
+                                      {"downstream-timeout-ms",
+                                       required_argument, 0, 0},
+                                      {"trace", required_argument, 0, 0},
+                                      {"shard-dir", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
 
-      uint64_t total = 1;
-      for (uint32_t i = 0; i < tnum; i++) {
-        uint64_t *result;
-        pthread_join(threads[i], (void **)&result);
-        total = MultModulo(total, *result, mod);
-        free(result);
-      }
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
 
-      printf("Total: %llu\n", total);
+    if (c == -1)
+      break;
 
-      char buffer[sizeof(total)];
-      memcpy(buffer, &total, sizeof(total));
-      err = send(client_fd, buffer, sizeof(total), 0);
-      if (err < 0) {
-        fprintf(stderr, "Can't send data to client\n");
+    switch (c) {
+    case 0: {
+      switch (option_index) {
+      case 0:
+        config.port = atoi(optarg);
         break;
+      case 1:
+        config.tnum = atoi(optarg);
+        break;
+      case 2:
+        factorial_lanes = atoi(optarg);
+        /* FactorialInterleaved only has these widths */
+        if (factorial_lanes != 1 && factorial_lanes != 2 &&
+            factorial_lanes != 4 && factorial_lanes != 8) {
+          fprintf(stderr, "lanes must be 1, 2, 4 or 8\n");
+          return 1;
+        }
+        break;
+      case 3:
+        inline_max = strtoull(optarg, NULL, 10);
+        break;
+      case 4:
+        config.metrics_port = atoi(optarg);
+        break;
+      case 5:
+        verbose = true;
+        break;
+      case 6:
+        config.workers = atoi(optarg);
+        break;
+      case 7:
+        config.cpus_num = ParseCpuList(optarg, config.cpus);
+        if (config.cpus_num <= 0) {
+          fprintf(stderr, "Bad CPU list: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 8:
+        config.cache_size = strtoull(optarg, NULL, 10);
+        break;
+      case 9:
+        coalesce = false;
+        break;
+      case 10:
+        config.downstream = optarg;
+        break;
+      case 11:
+        config.downstream_timeout_ms = atoi(optarg);
+        break;
+      case 12:
+        config.trace_path = optarg;
+        break;
+      case 13:
+        shard_dir = optarg;
+        break;
+      default:
+        printf("Index %d is out of options\n", option_index);
       }
+    } break;
+
+    case '?':
+      printf("Unknown argument\n");
+      break;
+    default:
+      fprintf(stderr, "getopt returned character code 0%o?\n", c);
     }
+  }
 
-    shutdown(client_fd, SHUT_RDWR);
-    close(client_fd);
+  if (config.port == -1 || config.tnum <= 0 || config.workers < 0) {
+    fprintf(stderr,
+            "Using: %s --port 20001 --tnum 4 [--lanes 4] [--inline-max 16384]\n"
+            "       [--metrics-port 9100] [--verbose] [--workers N] "
+            "[--cpus 0-3,8]\n"
+            "       [--cache-size 1024] [--no-coalesce]\n"
+            "       [--downstream servers.txt] [--downstream-timeout-ms "
+            "30000]\n"
+            "       [--trace trace.bin] [--shard-dir DIR]\n"
+            "SIGUSR1 prints request latency percentiles to stderr; "
+            "--metrics-port serves\nPrometheus text over HTTP, --verbose "
+            "logs every request\n"
+            "--workers forks N processes sharing the port (SO_REUSEPORT) "
+            "under a supervisor\nthat restarts them; --cpus pins them\n"
+            "identical requests in flight share one computation unless "
+            "--no-coalesce;\n--cache-size recent results are kept (0 "
+            "disables)\n"
+            "with --downstream the server is an aggregator: ranges from "
+            "--inline-max up are\nsplit across the listed servers and the "
+            "partial products combined\n"
+            "--trace records every request for ./replay (trace.bin.N per "
+            "worker)\n"
+            "--shard-dir holds int32 array shards that OP_REDUCE requests "
+            "may name\n",
+            argv[0]);
+    return 1;
   }
 
-  return 0;
+  signal(SIGUSR1, RequestLatencyDump);
+  signal(SIGPIPE, SIG_IGN);
+  if (config.workers > 0)
+    return Supervise(&config);
+  return RunServer(&config, 0);
 }
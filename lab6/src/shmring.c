@@ -0,0 +1,164 @@
+#include "shmring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "stats.h"
+
+#define SHM_MAGIC 0x46414354 /* "FACT" */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CpuRelax() __builtin_ia32_pause()
+#else
+#define CpuRelax() ((void)0)
+#endif
+
+/* not FUTEX_PRIVATE: the waiter and the waker live in different processes */
+static void FutexWait(uint32_t *addr, uint32_t value, uint64_t timeout_ns) {
+  struct timespec ts = {(time_t)(timeout_ns / 1000000000ULL),
+                        (long)(timeout_ns % 1000000000ULL)};
+  syscall(SYS_futex, addr, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void FutexWake(uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static struct ShmSegment *Map(int fd) {
+  void *addr = mmap(NULL, sizeof(struct ShmSegment), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  return addr == MAP_FAILED ? NULL : (struct ShmSegment *)addr;
+}
+
+struct ShmSegment *ShmCreate(char *name, size_t name_size) {
+  static int counter = 0;
+  uint64_t nonce;
+  if (getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+    perror("getrandom");
+    return NULL;
+  }
+  snprintf(name, name_size, SHM_NAME_PREFIX "%d-%d", (int)getpid(),
+           counter++);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror("shm_open");
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(struct ShmSegment)) < 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  /* a fresh object reads as zeros, which is an empty ring */
+  struct ShmSegment *seg = Map(fd);
+  if (seg == NULL) {
+    shm_unlink(name);
+    return NULL;
+  }
+  seg->magic = SHM_MAGIC;
+  seg->size = sizeof(struct ShmSegment);
+  seg->nonce = nonce;
+  return seg;
+}
+
+struct ShmSegment *ShmOpen(const char *name, uint64_t nonce) {
+  size_t prefix_len = strlen(SHM_NAME_PREFIX);
+  if (strncmp(name, SHM_NAME_PREFIX, prefix_len) != 0 ||
+      strchr(name + prefix_len, '/') != NULL)
+    return NULL;
+  int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size != sizeof(struct ShmSegment)) {
+    close(fd);
+    return NULL;
+  }
+  struct ShmSegment *seg = Map(fd);
+  uint32_t unclaimed = 0;
+  if (seg && (seg->magic != SHM_MAGIC || seg->size != sizeof(*seg) ||
+              seg->nonce != nonce ||
+              !__atomic_compare_exchange_n(&seg->attached, &unclaimed, 1,
+                                           false, __ATOMIC_ACQ_REL,
+                                           __ATOMIC_RELAXED))) {
+    ShmClose(seg);
+    return NULL;
+  }
+  return seg;
+}
+
+void ShmUnlink(const char *name) { shm_unlink(name); }
+
+void ShmClose(struct ShmSegment *seg) {
+  munmap(seg, sizeof(struct ShmSegment));
+}
+
+bool ShmPush(struct ShmRing *ring, const uint8_t *frame, size_t len) {
+  while (__atomic_exchange_n(&ring->lock, 1, __ATOMIC_ACQUIRE))
+    CpuRelax();
+  uint32_t tail = ring->tail;
+  bool full = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+              SHM_SLOTS;
+  if (!full) {
+    struct ShmSlot *slot = &ring->slots[tail % SHM_SLOTS];
+    slot->len = (uint32_t)len;
+    memcpy(slot->frame, frame, len);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+  }
+  __atomic_store_n(&ring->lock, 0, __ATOMIC_RELEASE);
+
+  /* pairs with ShmWait: either it sees the new tail or we see it asleep */
+  if (!full && __atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+    ShmWake(ring);
+  return !full;
+}
+
+size_t ShmPop(struct ShmRing *ring, uint8_t *frame) {
+  uint32_t head = ring->head;
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    return 0;
+  struct ShmSlot *slot = &ring->slots[head % SHM_SLOTS];
+  size_t len = slot->len < SHM_SLOT_SIZE ? slot->len : SHM_SLOT_SIZE;
+  memcpy(frame, slot->frame, len);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return len;
+}
+
+bool ShmEmpty(struct ShmRing *ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) ==
+         __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+}
+
+void ShmWait(struct ShmRing *ring, uint64_t spin_ns, uint64_t timeout_ns) {
+  uint64_t spin_until = NowNs() + spin_ns;
+  for (int i = 0;; i++) {
+    if (!ShmEmpty(ring))
+      return;
+    if ((i & 63) == 63 && NowNs() >= spin_until)
+      break;
+    CpuRelax();
+  }
+
+  __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+  uint32_t value = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+  if (ShmEmpty(ring))
+    FutexWait(&ring->futex, value, timeout_ns);
+  __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+void ShmWake(struct ShmRing *ring) {
+  __atomic_fetch_add(&ring->futex, 1, __ATOMIC_SEQ_CST);
+  FutexWake(&ring->futex);
+}
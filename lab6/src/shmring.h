@@ -0,0 +1,78 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* Local transport between a client and a server on the same host: a
+ * segment in /dev/shm holding a request ring (client -> server) and a
+ * response ring (server -> client). Each slot carries one protocol frame,
+ * so both sides reuse the TCP encoders and decoders. A ring has a single
+ * consumer; producers are serialized by a spinlock, since pool workers
+ * post responses concurrently. A consumer with nothing to do spins for a
+ * few microseconds, then sleeps on a futex that producers only wake when
+ * it is actually asleep.
+ *
+ * The client creates the segment, names it in OP_SHM_ATTACH over its TCP
+ * connection and unlinks it once the server has mapped it. The TCP
+ * connection stays open: its loss tells either side the other is gone.
+ *
+ * Segment names are predictable, so the attach also carries a random nonce
+ * that only the creator knows (the segment is mode 0600). The server maps
+ * only names with SHM_NAME_PREFIX whose header holds that nonce, and only
+ * once, so no other peer can become a second consumer of a client's
+ * rings. */
+
+#define SHM_SLOTS 256
+#define SHM_SLOT_SIZE (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+#define SHM_NAME_MAX 64
+#define SHM_NAME_PREFIX "/factorial-"
+
+struct ShmSlot {
+  uint32_t len;
+  uint8_t frame[SHM_SLOT_SIZE];
+};
+
+struct ShmRing {
+  uint32_t head __attribute__((aligned(64))); /* next slot to consume */
+  uint32_t tail __attribute__((aligned(64))); /* next slot to fill */
+  uint32_t lock;
+  uint32_t futex __attribute__((aligned(64))); /* bumped to wake */
+  uint32_t sleeping;
+  struct ShmSlot slots[SHM_SLOTS];
+};
+
+struct ShmSegment {
+  uint32_t magic;
+  uint32_t size;
+  uint64_t nonce;    /* echoed in OP_SHM_ATTACH */
+  uint32_t attached; /* set by the first server to map it */
+  struct ShmRing requests;
+  struct ShmRing responses;
+};
+
+/* Creates and maps a fresh segment; name receives its /dev/shm name.
+ * Returns NULL on failure. */
+struct ShmSegment *ShmCreate(char *name, size_t name_size);
+/* Maps a segment made by ShmCreate and claims it; NULL if it is missing,
+ * not ours, the nonce doesn't match or another server got it first. */
+struct ShmSegment *ShmOpen(const char *name, uint64_t nonce);
+void ShmUnlink(const char *name);
+void ShmClose(struct ShmSegment *seg);
+
+/* Returns false if the ring is full. Wakes the consumer if it sleeps. */
+bool ShmPush(struct ShmRing *ring, const uint8_t *frame, size_t len);
+/* Copies the oldest frame into frame and returns its length, or 0 if the
+ * ring is empty. Consumer only. */
+size_t ShmPop(struct ShmRing *ring, uint8_t *frame);
+bool ShmEmpty(struct ShmRing *ring);
+/* Consumer only: spins for spin_ns, then sleeps until a push, a ShmWake or
+ * timeout_ns. Returns early if the ring is not empty. */
+void ShmWait(struct ShmRing *ring, uint64_t spin_ns, uint64_t timeout_ns);
+/* Wakes the consumer unconditionally, e.g. to make it notice a shutdown. */
+void ShmWake(struct ShmRing *ring);
+
+#endif
@@ -0,0 +1,92 @@
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t BucketOf(uint64_t value) {
+  if (value < HIST_SUB_BUCKETS)
+    return (size_t)value;
+  int exp = 63 - __builtin_clzll(value);
+  size_t sub = (size_t)(value >> (exp - 3)) & (HIST_SUB_BUCKETS - 1);
+  return (size_t)(exp - 2) * HIST_SUB_BUCKETS + sub;
+}
+
+static uint64_t BucketUpperBound(size_t bucket) {
+  if (bucket < HIST_SUB_BUCKETS)
+    return bucket;
+  int exp = (int)(bucket / HIST_SUB_BUCKETS) + 2;
+  uint64_t sub = bucket % HIST_SUB_BUCKETS;
+  uint64_t lower = (HIST_SUB_BUCKETS + sub) << (exp - 3);
+  return lower + (1ull << (exp - 3)) - 1;
+}
+
+void HistRecord(struct Histogram *hist, uint64_t value) {
+  __atomic_fetch_add(&hist->counts[BucketOf(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->total, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+
+  uint64_t cur = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (value > cur &&
+         !__atomic_compare_exchange_n(&hist->max, &cur, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+uint64_t HistPercentile(const struct Histogram *hist, double q) {
+  uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+  if (total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(q * (double)total);
+  if (rank >= total)
+    rank = total - 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < HIST_BUCKETS; b++) {
+    seen += __atomic_load_n(&hist->counts[b], __ATOMIC_RELAXED);
+    if (seen > rank) {
+      uint64_t bound = BucketUpperBound(b);
+      uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+      return bound < max ? bound : max;
+    }
+  }
+  return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+uint64_t HistCountAtMost(const struct Histogram *hist, uint64_t value) {
+  size_t last = BucketOf(value);
+  uint64_t count = 0;
+  for (size_t b = 0; b <= last; b++)
+    count += __atomic_load_n(&hist->counts[b], __ATOMIC_RELAXED);
+  return count;
+}
+
+void HistMerge(struct Histogram *dst, const struct Histogram *src) {
+  for (size_t b = 0; b < HIST_BUCKETS; b++)
+    dst->counts[b] += __atomic_load_n(&src->counts[b], __ATOMIC_RELAXED);
+  dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  if (max > dst->max)
+    dst->max = max;
+}
+
+size_t HistFormatUs(const struct Histogram *hist, const char *name, char *buf,
+                    size_t size) {
+  int n = snprintf(
+      buf, size,
+      "%s: n=%lu p50=%.1fus p90=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+      name, __atomic_load_n(&hist->total, __ATOMIC_RELAXED),
+      HistPercentile(hist, 0.5) / 1e3, HistPercentile(hist, 0.9) / 1e3,
+      HistPercentile(hist, 0.99) / 1e3, HistPercentile(hist, 0.999) / 1e3,
+      __atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1e3);
+  if (n < 0)
+    return 0;
+  return (size_t)n < size ? (size_t)n : size - 1;
+}
@@ -0,0 +1,34 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-linear histogram: values below 8 are exact, above that every power of
+ * two is split into 8 sub-buckets (relative error <= 12.5%). Recording is a
+ * relaxed atomic increment, so any thread may record without a lock. */
+#define HIST_SUB_BUCKETS 8
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct Histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+uint64_t NowNs(void);
+
+void HistRecord(struct Histogram *hist, uint64_t value);
+/* Upper bound of the bucket holding quantile q (0 < q <= 1). */
+uint64_t HistPercentile(const struct Histogram *hist, double q);
+/* Number of recorded values whose bucket lies at or below value's bucket. */
+uint64_t HistCountAtMost(const struct Histogram *hist, uint64_t value);
+/* Adds src into dst; used to sum per-thread histograms for a snapshot. */
+void HistMerge(struct Histogram *dst, const struct Histogram *src);
+/* Appends "name: n=.. p50=..us p90=..us p99=..us p999=..us max=..us\n"
+ * (values in ns are printed as us) to buf; returns bytes written. */
+size_t HistFormatUs(const struct Histogram *hist, const char *name, char *buf,
+                    size_t size);
+
+#endif
@@ -0,0 +1,227 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "stats.h"
+
+#define TRACE_SLOTS 65536
+/* the flusher sleeps this long when the queue is empty */
+#define TRACE_IDLE_US 10000
+
+static void EncodeRecord(uint8_t *buf, const struct TraceRecord *r) {
+  PutU64(buf, r->arrival_ns);
+  PutU64(buf + 8, r->begin);
+  PutU64(buf + 16, r->end);
+  PutU64(buf + 24, r->mod);
+  PutU64(buf + 32, r->service_ns);
+  PutU32(buf + 40, r->mods_num);
+  PutU16(buf + 44, r->status);
+  buf[46] = r->source;
+  buf[47] = 0;
+}
+
+static void DecodeRecord(const uint8_t *buf, struct TraceRecord *r) {
+  r->arrival_ns = GetU64(buf);
+  r->begin = GetU64(buf + 8);
+  r->end = GetU64(buf + 16);
+  r->mod = GetU64(buf + 24);
+  r->service_ns = GetU64(buf + 32);
+  r->mods_num = GetU32(buf + 40);
+  r->status = GetU16(buf + 44);
+  r->source = buf[46];
+}
+
+/* Moves up to max queued records into buf; returns how many. */
+static size_t Drain(struct TraceLog *log, uint8_t *buf, size_t max) {
+  size_t n = 0;
+  while (n < max) {
+    struct TraceSlot *slot = &log->slots[log->tail & log->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log->tail + 1)
+      break;
+    EncodeRecord(buf + n * TRACE_RECORD_SIZE, &slot->record);
+    /* hand the slot back for the lap after this one */
+    __atomic_store_n(&slot->seq, log->tail + log->mask + 1, __ATOMIC_RELEASE);
+    log->tail++;
+    n++;
+  }
+  return n;
+}
+
+static void *Flusher(void *arg) {
+  struct TraceLog *log = (struct TraceLog *)arg;
+  enum { kBatch = 1024 };
+  static uint8_t buf[kBatch * TRACE_RECORD_SIZE];
+  while (true) {
+    bool stopping = __atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE);
+    size_t n = Drain(log, buf, kBatch);
+    if (n > 0) {
+      fwrite(buf, TRACE_RECORD_SIZE, n, log->file);
+      __atomic_store_n(&log->written, log->written + n, __ATOMIC_RELAXED);
+      if (n == kBatch)
+        continue;
+    }
+    /* at most one idle period is lost if the process is killed */
+    fflush(log->file);
+    if (stopping)
+      break;
+    usleep(TRACE_IDLE_US);
+  }
+  return NULL;
+}
+
+static bool IsHeader(const uint8_t *buf) {
+  return GetU32(buf) == TRACE_MAGIC &&
+         buf[TRACE_HEADER_SIZE - 1] == TRACE_SEGMENT_MARK;
+}
+
+/* Opens path for appending a segment. Whatever a killed writer left after
+ * its last whole record is cut off; a file that is not a current trace is
+ * started over. */
+static FILE *OpenForAppend(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  uint8_t header[TRACE_HEADER_SIZE];
+  off_t keep = 0;
+  if (fstat(fd, &st) == 0 &&
+      pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+      IsHeader(header) && GetU32(header + 4) == TRACE_VERSION)
+    keep = st.st_size - st.st_size % TRACE_RECORD_SIZE;
+  if (ftruncate(fd, keep) < 0 || lseek(fd, 0, SEEK_END) < 0) {
+    close(fd);
+    return NULL;
+  }
+  FILE *file = fdopen(fd, "ab");
+  if (!file)
+    close(fd);
+  return file;
+}
+
+int TraceOpen(struct TraceLog *log, const char *path) {
+  memset(log, 0, sizeof(*log));
+  log->file = OpenForAppend(path);
+  if (!log->file) {
+    perror("Cannot open trace file");
+    return -1;
+  }
+  log->slots = malloc(sizeof(struct TraceSlot) * TRACE_SLOTS);
+  log->mask = TRACE_SLOTS - 1;
+  for (uint64_t i = 0; i < TRACE_SLOTS; i++)
+    log->slots[i].seq = i;
+  log->start_ns = NowNs();
+
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  uint8_t header[TRACE_HEADER_SIZE] = {0};
+  PutU32(header, TRACE_MAGIC);
+  PutU32(header + 4, TRACE_VERSION);
+  PutU32(header + 8, TRACE_RECORD_SIZE);
+  PutU64(header + 16, wall.tv_sec * 1000000000ULL + wall.tv_nsec);
+  header[TRACE_HEADER_SIZE - 1] = TRACE_SEGMENT_MARK;
+  fwrite(header, 1, sizeof(header), log->file);
+
+  if (pthread_create(&log->flusher, NULL, Flusher, log) != 0) {
+    fclose(log->file);
+    free(log->slots);
+    return -1;
+  }
+  return 0;
+}
+
+void TraceClose(struct TraceLog *log) {
+  __atomic_store_n(&log->stopping, true, __ATOMIC_RELEASE);
+  pthread_join(log->flusher, NULL);
+  fclose(log->file);
+  free(log->slots);
+}
+
+void TraceAppend(struct TraceLog *log, uint64_t arrival_ns, uint64_t begin,
+                 uint64_t end, const uint64_t *mods, uint32_t mods_num,
+                 uint64_t service_ns, uint16_t status, uint8_t source) {
+  uint64_t pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+  struct TraceSlot *slot;
+  while (true) {
+    slot = &log->slots[pos & log->mask];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&log->head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (seq < pos) {
+      /* the flusher is a whole lap behind */
+      __atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  struct TraceRecord *r = &slot->record;
+  r->arrival_ns = arrival_ns - log->start_ns;
+  r->begin = begin;
+  r->end = end;
+  r->mod = mods_num > 0 ? mods[0] : 0;
+  r->service_ns = service_ns;
+  r->mods_num = mods_num;
+  r->status = status;
+  r->source = source;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+long TraceRead(const char *path, struct TraceRecord **out,
+               uint64_t *wall_start_ns) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("Cannot open trace file");
+    return -1;
+  }
+  /* version 1 had a 32-byte header, so only that much is read first */
+  enum { kV1HeaderSize = 32 };
+  uint8_t buf[TRACE_RECORD_SIZE];
+  uint32_t version = 0;
+  if (fread(buf, 1, kV1HeaderSize, file) == kV1HeaderSize &&
+      GetU32(buf) == TRACE_MAGIC &&
+      GetU32(buf + 8) == TRACE_RECORD_SIZE)
+    version = GetU32(buf + 4);
+  if (version == TRACE_VERSION &&
+      (fread(buf + kV1HeaderSize, 1, sizeof(buf) - kV1HeaderSize, file) !=
+           sizeof(buf) - kV1HeaderSize ||
+       !IsHeader(buf)))
+    version = 0;
+  if (version != 1 && version != TRACE_VERSION) {
+    fprintf(stderr, "%s is not a version %d trace\n", path, TRACE_VERSION);
+    fclose(file);
+    return -1;
+  }
+  *wall_start_ns = GetU64(buf + 16);
+
+  size_t cap = 4096;
+  size_t n = 0;
+  struct TraceRecord *records = malloc(sizeof(*records) * cap);
+  /* later segments are shifted onto the first one's clock */
+  uint64_t shift = 0;
+  /* a torn last record (killed mid-write) is ignored */
+  while (fread(buf, 1, sizeof(buf), file) == sizeof(buf)) {
+    if (version == TRACE_VERSION && IsHeader(buf)) {
+      uint64_t wall = GetU64(buf + 16);
+      shift = wall > *wall_start_ns ? wall - *wall_start_ns : 0;
+      continue;
+    }
+    if (n == cap) {
+      cap *= 2;
+      records = realloc(records, sizeof(*records) * cap);
+    }
+    DecodeRecord(buf, &records[n]);
+    records[n++].arrival_ns += shift;
+  }
+  fclose(file);
+  *out = records;
+  return (long)n;
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Binary request trace written by `server --trace FILE` and read by
+ * `replay`. The file is one or more segments, each a header followed by
+ * fixed-size records, all integers little-endian:
+ *
+ *   header (48 bytes): u32 magic "FTRC", u32 version, u32 record size,
+ *                      u32 reserved, u64 wall-clock start (ns since epoch),
+ *                      zeros, u8 TRACE_SEGMENT_MARK as the last byte
+ *   record (48 bytes): u64 arrival (ns since segment start), u64 begin,
+ *                      u64 end, u64 first modulus, u64 service time (ns),
+ *                      u32 mods_num, u16 status, u8 source, u8 reserved (0)
+ *
+ * A worker restarted by the supervisor appends a new segment rather than
+ * truncating the trace of the run that crashed. Headers and records are
+ * the same size and told apart by the last byte, so a torn record left by
+ * the crash is cut off before appending.
+ *
+ * Records are appended when a request is answered, so they are ordered by
+ * completion, not arrival. Version 1 files (one segment, 32-byte header)
+ * can still be read. */
+
+#define TRACE_MAGIC 0x43525446 /* "FTRC" */
+#define TRACE_VERSION 2
+#define TRACE_HEADER_SIZE 48
+#define TRACE_RECORD_SIZE 48
+#define TRACE_SEGMENT_MARK 0xff
+
+/* how the server produced the answer */
+#define TRACE_COMPUTED 0
+#define TRACE_CACHED 1
+#define TRACE_COALESCED 2 /* joined an identical request already running */
+#define TRACE_SHM 3       /* arrived over shared memory */
+
+struct TraceRecord {
+  uint64_t arrival_ns;
+  uint64_t begin;
+  uint64_t end;
+  uint64_t mod;
+  uint64_t service_ns;
+  uint32_t mods_num;
+  uint16_t status;
+  uint8_t source;
+};
+
+struct TraceSlot {
+  uint64_t seq;
+  struct TraceRecord record;
+};
+
+/* Bounded lock-free queue between the threads answering requests and one
+ * flusher thread that encodes and writes the records. A full queue drops
+ * the record instead of making a request wait. */
+struct TraceLog {
+  uint64_t head __attribute__((aligned(64))); /* next slot to fill */
+  uint64_t dropped;
+  uint64_t tail __attribute__((aligned(64))); /* flusher only */
+  uint64_t written;
+  struct TraceSlot *slots;
+  size_t mask;
+  uint64_t start_ns; /* NowNs() when the trace began */
+  FILE *file;
+  bool stopping;
+  pthread_t flusher;
+};
+
+/* Starts a new segment at the end of path, creating it if needed, and
+ * starts the flusher. Returns -1 on failure. */
+int TraceOpen(struct TraceLog *log, const char *path);
+/* Stops the flusher after it has written everything queued. */
+void TraceClose(struct TraceLog *log);
+/* Safe from any thread; never blocks. arrival_ns is a NowNs() value. */
+void TraceAppend(struct TraceLog *log, uint64_t arrival_ns, uint64_t begin,
+                 uint64_t end, const uint64_t *mods, uint32_t mods_num,
+                 uint64_t service_ns, uint16_t status, uint8_t source);
+
+/* Reads a whole trace file. Returns the record count (records in *out,
+ * malloc'ed) or -1 if the file is missing or not a trace. Arrivals of all
+ * segments are relative to *wall_start_ns, the first segment's start,
+ * which also lets traces of several workers be put on one timeline. */
+long TraceRead(const char *path, struct TraceRecord **out,
+               uint64_t *wall_start_ns);
+
+#endif
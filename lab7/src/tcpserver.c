@@ -1,37 +1,203 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define SADDR struct sockaddr
+#define MAX_EVENTS 256
+
+/* Whatever a client sent that doesn't end in a newline yet, so output from
+ * many clients at once is interleaved by whole lines, not by reads. */
+struct Connection {
+  int fd;
+  size_t used;
+  char buf[];
+};
+
+static size_t BUFSIZE = 4096;
+static int spare_fd = -1;
+static long connections = 0;
+
+void WriteAll(const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(1, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      perror("write");
+      exit(1);
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+void CloseConnection(struct Connection *conn) {
+  /* whatever is left is a last line without its newline */
+  if (conn->used > 0) {
+    WriteAll(conn->buf, conn->used);
+    WriteAll("\n", 1);
+  }
+  close(conn->fd);
+  free(conn);
+  connections--;
+}
+
+/* Edge-triggered: read until EAGAIN or the next event may never come. */
+void HandleReadable(struct Connection *conn) {
+  while (true) {
+    ssize_t nread = read(conn->fd, conn->buf + conn->used,
+                         BUFSIZE - conn->used);
+    if (nread == 0) {
+      CloseConnection(conn);
+      return;
+    }
+    if (nread < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      perror("read");
+      CloseConnection(conn);
+      return;
+    }
+    conn->used += nread;
+
+    char *end = memrchr(conn->buf, '\n', conn->used);
+    if (end == NULL && conn->used < BUFSIZE)
+      continue;
+    /* a line longer than the buffer goes out in pieces */
+    size_t lines = end ? (size_t)(end - conn->buf) + 1 : conn->used;
+    WriteAll(conn->buf, lines);
+    memmove(conn->buf, conn->buf + lines, conn->used - lines);
+    conn->used -= lines;
+  }
+}
+
+void AcceptAll(int lfd, int efd) {
+  while (true) {
+    struct sockaddr_in cliaddr;
+    socklen_t clilen = sizeof(cliaddr);
+    int cfd = accept4(lfd, (SADDR *)&cliaddr, &clilen,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+        /* out of descriptors: refuse the client instead of leaving it in
+         * the queue, where edge-triggering would never report it again */
+        close(spare_fd);
+        cfd = accept(lfd, NULL, NULL);
+        if (cfd >= 0)
+          close(cfd);
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        /* EMFILE comes before EAGAIN, so this is how an empty queue shows */
+        if (cfd < 0)
+          return;
+        fprintf(stderr, "accept: too many open files, dropping a client\n");
+        continue;
+      }
+      perror("accept");
+      return;
+    }
+
+    struct Connection *conn = malloc(sizeof(struct Connection) + BUFSIZE);
+    if (conn == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      close(cfd);
+      continue;
+    }
+    conn->fd = cfd;
+    conn->used = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+      perror("epoll_ctl");
+      close(cfd);
+      free(conn);
+      continue;
+    }
+    connections++;
+    printf("connection established (%ld open)\n", connections);
+    fflush(stdout);
+    /* data may have arrived before the socket was registered */
+    HandleReadable(conn);
+  }
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    printf("Usage: %s <port>\n", argv[0]);
+  int backlog = SOMAXCONN;
+
+  while (true) {
+    static struct option options[] = {{"backlog", required_argument, 0, 0},
+                                      {"bufsize", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0:
+      switch (option_index) {
+      case 0:
+        backlog = atoi(optarg);
+        break;
+      case 1:
+        BUFSIZE = (size_t)atol(optarg);
+        break;
+      }
+      break;
+    case '?':
+      break;
+    default:
+      printf("getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  if (optind >= argc || backlog <= 0 || BUFSIZE == 0) {
+    printf("Usage: %s [--backlog %d] [--bufsize 4096] <port>\n", argv[0],
+           SOMAXCONN);
     exit(1);
   }
 
-  int SERV_PORT = atoi(argv[1]);
+  int SERV_PORT = atoi(argv[optind]);
   const size_t kSize = sizeof(struct sockaddr_in);
 
-  int lfd, cfd;
-  int nread;
-  char *buf;
-  int BUFSIZE = 100;
-
-  buf = malloc(BUFSIZE);
+  /* one descriptor per client: take all the hard limit allows */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
+  int lfd;
   struct sockaddr_in servaddr;
-  struct sockaddr_in cliaddr;
 
-  if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+  if ((lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) <
+      0) {
     perror("socket");
     exit(1);
   }
+  int opt = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
   memset(&servaddr, 0, kSize);
   servaddr.sin_family = AF_INET;
@@ -43,28 +209,40 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  if (listen(lfd, 5) < 0) {
+  if (listen(lfd, backlog) < 0) {
     perror("listen");
     exit(1);
   }
 
-  while (1) {
-    unsigned int clilen = kSize;
+  int efd = epoll_create1(EPOLL_CLOEXEC);
+  if (efd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL; /* the listening socket */
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
 
-    if ((cfd = accept(lfd, (SADDR *)&cliaddr, &clilen)) < 0) {
-      perror("accept");
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    int n = epoll_wait(efd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
       exit(1);
     }
-    printf("connection established\n");
-
-    while ((nread = read(cfd, buf, BUFSIZE)) > 0) {
-      write(1, buf, nread);
-    }
-
-    if (nread == -1) {
-      perror("read");
-      exit(1);
+    for (int i = 0; i < n; i++) {
+      struct Connection *conn = events[i].data.ptr;
+      if (conn == NULL)
+        AcceptAll(lfd, efd);
+      else
+        /* errors and hangups surface as a failed or empty read */
+        HandleReadable(conn);
     }
-    close(cfd);
   }
 }
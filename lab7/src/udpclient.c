@@ -1,28 +1,340 @@
+#define _GNU_SOURCE
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SADDR struct sockaddr
 #define SLEN sizeof(struct sockaddr_in)
 
-int main(int argc, char **argv) {
-  if (argc < 4) {
-    printf("Usage: %s <IP> <port> <bufsize>\n", argv[0]);
+/* Benchmark datagrams start with the sequence number and the send time;
+ * the rest of --size is filler the server echoes back untouched. */
+#define HEADER_SIZE 16
+
+/* Log-linear RTT histogram: 16 sub-buckets per power of two of ns, so a
+ * percentile is off by at most 1/16. */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct Histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+struct Bench {
+  int sockfd;
+  int size;
+  double rate;         /* packets/s, 0 = as fast as the window allows */
+  uint64_t count;      /* packets to send */
+  uint64_t timeout_ns; /* unanswered this long: lost */
+  uint64_t inflight;   /* most packets outstanding at once */
+  uint64_t outstanding;
+  /* seqs in [oldest, next) are tracked in a ring of window slots. It is far
+   * larger than inflight, so a lost packet waiting out its timeout holds
+   * one inflight slot rather than the whole window */
+  uint64_t window;
+  uint64_t *sent_ns;
+  bool *answered;
+  uint64_t oldest;
+  uint64_t next;
+  uint64_t received;
+  uint64_t lost;
+  uint64_t late;       /* answered after being counted lost */
+  uint64_t duplicates;
+  uint64_t reordered;  /* arrived after a higher seq */
+  uint64_t highest;    /* highest seq received + 1 */
+  uint64_t refused;
+  uint64_t stalls;     /* packets delayed by a full window or inflight */
+  uint64_t stalled_seq;
+  uint64_t last_send_ns;
+  uint64_t last_recv_ns;
+  struct Histogram rtt;
+};
+
+uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int HistBucket(uint64_t v) {
+  if (v < HIST_SUB)
+    return (int)v;
+  int log = 63 - __builtin_clzll(v);
+  int sub = (int)((v >> (log - 4)) & (HIST_SUB - 1));
+  return (log - 3) * HIST_SUB + sub;
+}
+
+uint64_t HistBucketValue(int bucket) {
+  if (bucket < HIST_SUB)
+    return bucket;
+  int log = bucket / HIST_SUB + 3;
+  return ((uint64_t)(HIST_SUB + bucket % HIST_SUB)) << (log - 4);
+}
+
+void HistRecord(struct Histogram *h, uint64_t v) {
+  h->counts[HistBucket(v)]++;
+  if (h->total == 0 || v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+  h->total++;
+}
+
+uint64_t HistPercentile(const struct Histogram *h, double p) {
+  uint64_t rank = (uint64_t)(p * h->total);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank)
+      return HistBucketValue(i);
+  }
+  return h->max;
+}
+
+void PutU64(char *p, uint64_t v) { memcpy(p, &v, sizeof(v)); }
+
+uint64_t GetU64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Counts every packet in the window that timed out, and slides the window
+ * past them and past answered ones. Returns the ns until the oldest
+ * outstanding packet times out. */
+uint64_t ExpireLost(struct Bench *b, uint64_t now) {
+  while (b->oldest < b->next) {
+    uint64_t slot = b->oldest % b->window;
+    if (!b->answered[slot]) {
+      uint64_t deadline = b->sent_ns[slot] + b->timeout_ns;
+      if (deadline > now)
+        return deadline - now;
+      b->lost++;
+      b->outstanding--;
+    }
+    b->oldest++;
+  }
+  return UINT64_MAX;
+}
+
+void ReceiveAll(struct Bench *b, char *buf) {
+  while (true) {
+    ssize_t n = recv(b->sockfd, buf, b->size, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ECONNREFUSED) {
+        /* an ICMP port unreachable; the packet itself will time out */
+        b->refused++;
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("recv");
+      return;
+    }
+    if (n < HEADER_SIZE)
+      continue;
+    uint64_t now = NowNs();
+    uint64_t seq = GetU64(buf);
+    uint64_t sent = GetU64(buf + 8);
+    if (seq >= b->next)
+      continue;
+    if (seq < b->oldest) {
+      /* already counted lost, or a duplicate of an answered one */
+      b->late++;
+      continue;
+    }
+    uint64_t slot = seq % b->window;
+    if (b->answered[slot]) {
+      b->duplicates++;
+      continue;
+    }
+    b->answered[slot] = true;
+    b->outstanding--;
+    b->received++;
+    if (seq + 1 < b->highest)
+      b->reordered++;
+    else
+      b->highest = seq + 1;
+    HistRecord(&b->rtt, now - sent);
+    b->last_recv_ns = now;
+  }
+}
+
+/* Sends everything that is due and fits in the window; returns the ns until
+ * the next packet is due. */
+uint64_t SendDue(struct Bench *b, char *buf, uint64_t start, uint64_t now) {
+  while (b->next < b->count) {
+    uint64_t due = b->rate > 0 ? start + (uint64_t)(b->next * 1e9 / b->rate)
+                               : now;
+    if (due > now)
+      return due - now;
+    if (b->outstanding >= b->inflight || b->next - b->oldest >= b->window) {
+      if (b->stalled_seq != b->next)
+        b->stalls++;
+      b->stalled_seq = b->next;
+      return UINT64_MAX;
+    }
+    uint64_t slot = b->next % b->window;
+    b->sent_ns[slot] = NowNs();
+    b->answered[slot] = false;
+    PutU64(buf, b->next);
+    PutU64(buf + 8, b->sent_ns[slot]);
+    if (send(b->sockfd, buf, b->size, 0) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        return 0;
+      if (errno != ECONNREFUSED && errno != EINTR) {
+        perror("send");
+        exit(1);
+      }
+      if (errno == ECONNREFUSED)
+        b->refused++;
+    }
+    b->next++;
+    b->outstanding++;
+    b->last_send_ns = b->sent_ns[slot];
+  }
+  return UINT64_MAX;
+}
+
+void RunBench(struct Bench *b) {
+  char *sendbuf = malloc(b->size);
+  char *recvbuf = malloc(b->size);
+  b->window = b->inflight * 64 > (1 << 20) ? b->inflight * 64 : (1 << 20);
+  b->sent_ns = calloc(b->window, sizeof(uint64_t));
+  b->answered = calloc(b->window, sizeof(bool));
+  if (!sendbuf || !recvbuf || !b->sent_ns || !b->answered) {
+    fprintf(stderr, "Out of memory\n");
     exit(1);
   }
+  memset(sendbuf, 'x', b->size);
 
-  int SERV_PORT = atoi(argv[2]);
-  int BUFSIZE = atoi(argv[3]);
+  uint64_t start = NowNs();
+  while (b->oldest < b->count) {
+    uint64_t now = NowNs();
+    uint64_t send_wait = SendDue(b, sendbuf, start, now);
+    uint64_t lost_wait = ExpireLost(b, now);
+    uint64_t wait = send_wait < lost_wait ? send_wait : lost_wait;
+    if (b->oldest >= b->count)
+      break;
+    /* poll sleeps in whole milliseconds: spin for the remainder */
+    int timeout = wait >= 2000000 ? (int)(wait / 1000000) - 1 : 0;
+    struct pollfd pfd = {b->sockfd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) > 0)
+      ReceiveAll(b, recvbuf);
+  }
+  /* the tail waiting out the last timeouts would understate the rates */
+  double sending = b->next ? (b->last_send_ns - start) / 1e9 : 0;
+  double receiving = b->received ? (b->last_recv_ns - start) / 1e9 : 0;
 
-  char *sendline = malloc(BUFSIZE);
-  char *recvline = malloc(BUFSIZE + 1);
+  printf("sent %lu, received %lu, lost %lu (%.3f%%), late %lu, "
+         "duplicates %lu, reordered %lu (%.3f%%)\n",
+         b->next, b->received, b->lost,
+         b->next ? 100.0 * b->lost / b->next : 0.0, b->late, b->duplicates,
+         b->reordered, b->received ? 100.0 * b->reordered / b->received : 0.0);
+  printf("%.0f pkt/s sent over %.2fs, %.0f pkt/s (%.2f MB/s) received over "
+         "%.2fs",
+         sending > 0 ? b->next / sending : 0.0, sending,
+         receiving > 0 ? b->received / receiving : 0.0,
+         receiving > 0 ? b->received * (double)b->size / receiving / 1e6 : 0.0,
+         receiving);
+  if (b->stalls)
+    printf(", %lu held back by --inflight", b->stalls);
+  if (b->refused)
+    printf(", %lu refused", b->refused);
+  printf("\n");
+  if (b->rtt.total)
+    printf("rtt: min=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+           b->rtt.min / 1e3, HistPercentile(&b->rtt, 0.5) / 1e3,
+           HistPercentile(&b->rtt, 0.99) / 1e3,
+           HistPercentile(&b->rtt, 0.999) / 1e3, b->rtt.max / 1e3);
+  free(sendbuf);
+  free(recvbuf);
+}
+
+int main(int argc, char **argv) {
+  bool bench = false;
+  struct Bench b;
+  memset(&b, 0, sizeof(b));
+  b.size = 64;
+  b.count = 100000;
+  b.inflight = 1024;
+  int timeout_ms = 1000;
+
+  while (true) {
+    static struct option options[] = {{"bench", no_argument, 0, 0},
+                                      {"rate", required_argument, 0, 0},
+                                      {"size", required_argument, 0, 0},
+                                      {"count", required_argument, 0, 0},
+                                      {"inflight", required_argument, 0, 0},
+                                      {"timeout-ms", required_argument, 0, 0},
+                                      {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0:
+      switch (option_index) {
+      case 0:
+        bench = true;
+        break;
+      case 1:
+        b.rate = atof(optarg);
+        break;
+      case 2:
+        b.size = atoi(optarg);
+        break;
+      case 3:
+        b.count = strtoull(optarg, NULL, 10);
+        break;
+      case 4:
+        b.inflight = strtoull(optarg, NULL, 10);
+        break;
+      case 5:
+        timeout_ms = atoi(optarg);
+        break;
+      }
+      break;
+    case '?':
+      break;
+    default:
+      printf("getopt returned character code 0%o?\n", c);
+    }
+  }
+
+  if (argc - optind < (bench ? 2 : 3) || b.size < HEADER_SIZE ||
+      b.rate < 0 || b.inflight == 0 || timeout_ms <= 0) {
+    printf("Usage: %s <IP> <port> <bufsize>\n"
+           "       %s --bench [--rate 0] [--size 64] [--count 100000] "
+           "[--inflight 1024]\n"
+           "          [--timeout-ms 1000] <IP> <port>\n"
+           "--bench sends numbered, timestamped datagrams at --rate per "
+           "second (0: as fast\nas --inflight allows); a reply missing "
+           "after --timeout-ms counts as lost\n",
+           argv[0], argv[0]);
+    exit(1);
+  }
+
+  int SERV_PORT = atoi(argv[optind + 1]);
 
   int sockfd, n;
   struct sockaddr_in servaddr;
@@ -31,10 +343,30 @@ int main(int argc, char **argv) {
   servaddr.sin_family = AF_INET;
   servaddr.sin_port = htons(SERV_PORT);
 
-  if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) < 0) {
-    perror("inet_pton problem");
+  if (inet_pton(AF_INET, argv[optind], &servaddr.sin_addr) <= 0) {
+    fprintf(stderr, "bad address %s\n", argv[optind]);
     exit(1);
   }
+
+  if (bench) {
+    /* connected, so only the server's replies and errors come back */
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 ||
+        connect(sockfd, (SADDR *)&servaddr, SLEN) < 0) {
+      perror("socket problem");
+      exit(1);
+    }
+    b.sockfd = sockfd;
+    b.timeout_ns = timeout_ms * 1000000ULL;
+    RunBench(&b);
+    close(sockfd);
+    return 0;
+  }
+
+  int BUFSIZE = atoi(argv[optind + 2]);
+
+  char *sendline = malloc(BUFSIZE);
+  char *recvline = malloc(BUFSIZE + 1);
+
   if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
     perror("socket problem");
     exit(1);
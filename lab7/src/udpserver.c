@@ -1,65 +1,350 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SADDR struct sockaddr
 #define SLEN sizeof(struct sockaddr_in)
 
-int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    printf("Usage: %s <port> <bufsize>\n", argv[0]);
+/* --batch: datagrams move through recvmmsg/sendmmsg, batch at a time, and
+ * instead of a printf per packet there are counters printed every
+ * --stats-interval seconds plus one packet in --sample logged. */
+struct Counters {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t batches;
+  uint64_t send_errors;
+};
+
+struct Batch {
+  int size;
+  char *data; /* size buffers of bufsize + 1 bytes */
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_in *addrs;
+};
+
+static int BUFSIZE;
+
+uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void LogPacket(const char *mesg, const struct sockaddr_in *cliaddr) {
+  char ipadr[16];
+  printf("REQUEST %s FROM %s : %d\n", mesg,
+         inet_ntop(AF_INET, (void *)&cliaddr->sin_addr.s_addr, ipadr, 16),
+         ntohs(cliaddr->sin_port));
+}
+
+void BatchInit(struct Batch *b, int size) {
+  b->size = size;
+  b->data = malloc((size_t)size * (BUFSIZE + 1));
+  b->msgs = calloc(size, sizeof(struct mmsghdr));
+  b->iovs = calloc(size, sizeof(struct iovec));
+  b->addrs = calloc(size, sizeof(struct sockaddr_in));
+  if (!b->data || !b->msgs || !b->iovs || !b->addrs) {
+    fprintf(stderr, "Out of memory\n");
     exit(1);
   }
+}
 
-  int SERV_PORT = atoi(argv[1]);
-  int BUFSIZE = atoi(argv[2]);
+/* recvmmsg and the echo overwrite the lengths of the first n headers, so
+ * those are reset before the next call. */
+void BatchReset(struct Batch *b, int n) {
+  for (int i = 0; i < n; i++) {
+    b->iovs[i].iov_base = b->data + (size_t)i * (BUFSIZE + 1);
+    b->iovs[i].iov_len = BUFSIZE;
+    b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = SLEN;
+    b->msgs[i].msg_hdr.msg_control = NULL;
+    b->msgs[i].msg_hdr.msg_controllen = 0;
+    b->msgs[i].msg_hdr.msg_flags = 0;
+  }
+}
+
+void Add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Echoes the n datagrams received into b; a datagram the kernel refuses is
+ * skipped rather than retried. */
+void EchoBatch(int sockfd, struct Batch *b, int n, struct Counters *c) {
+  for (int i = 0; i < n; i++)
+    b->iovs[i].iov_len = b->msgs[i].msg_len;
+  int sent = 0;
+  while (sent < n) {
+    int r = sendmmsg(sockfd, b->msgs + sent, n - sent, 0);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      Add(&c->send_errors, 1);
+      sent++;
+      continue;
+    }
+    sent += r;
+  }
+}
+
+/* --threads: one socket per thread, all bound to the port with
+ * SO_REUSEPORT so the kernel spreads clients over them. A worker writes
+ * only its own cache line of counters; main reads them for the stats. */
+struct Worker {
+  pthread_t thread;
+  int sockfd;
+  int cpu; /* -1: not pinned */
+  int batch;
+  long sample;
+  struct Counters c;
+} __attribute__((aligned(64)));
 
+void *RunBatched(void *arg) {
+  struct Worker *w = (struct Worker *)arg;
+  struct Batch b;
+  BatchInit(&b, w->batch);
+  BatchReset(&b, w->batch);
+
+  if (w->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  uint64_t next_sample = w->sample;
+  while (1) {
+    int n = recvmmsg(w->sockfd, b.msgs, w->batch, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("recvmmsg");
+      exit(1);
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++)
+      bytes += b.msgs[i].msg_len;
+    Add(&w->c.batches, 1);
+    Add(&w->c.packets, n);
+    Add(&w->c.bytes, bytes);
+    if (w->sample > 0 && w->c.packets >= next_sample) {
+      /* at most one line per batch, however small sample is */
+      int i = (int)(next_sample - 1 - (w->c.packets - n));
+      char *mesg = b.iovs[i].iov_base;
+      mesg[b.msgs[i].msg_len] = 0;
+      LogPacket(mesg, &b.addrs[i]);
+      while (next_sample <= w->c.packets)
+        next_sample += w->sample;
+    }
+    EchoBatch(w->sockfd, &b, n, &w->c);
+    BatchReset(&b, n);
+  }
+  return NULL;
+}
+
+void Snapshot(struct Worker *w, struct Counters *c) {
+  c->packets = __atomic_load_n(&w->c.packets, __ATOMIC_RELAXED);
+  c->bytes = __atomic_load_n(&w->c.bytes, __ATOMIC_RELAXED);
+  c->batches = __atomic_load_n(&w->c.batches, __ATOMIC_RELAXED);
+  c->send_errors = __atomic_load_n(&w->c.send_errors, __ATOMIC_RELAXED);
+}
+
+/* Prints the totals every interval, and with several threads how many
+ * packets each of them took, which shows how evenly the port is spread. */
+void PrintStats(struct Worker *workers, int threads, double interval) {
+  struct Counters *last = calloc(threads, sizeof(struct Counters));
+  uint64_t last_ns = NowNs();
+  while (1) {
+    usleep((useconds_t)(interval * 1e6));
+    uint64_t now = NowNs();
+    double sec = (now - last_ns) / 1e9;
+    struct Counters total;
+    memset(&total, 0, sizeof(total));
+    char per_thread[1024];
+    size_t len = 0;
+    per_thread[0] = '\0';
+    for (int t = 0; t < threads; t++) {
+      struct Counters c;
+      Snapshot(&workers[t], &c);
+      total.packets += c.packets - last[t].packets;
+      total.bytes += c.bytes - last[t].bytes;
+      total.batches += c.batches - last[t].batches;
+      total.send_errors += c.send_errors - last[t].send_errors;
+      if (threads > 1 && len < sizeof(per_thread))
+        len += snprintf(per_thread + len, sizeof(per_thread) - len, " %.0f",
+                        (c.packets - last[t].packets) / sec);
+      last[t] = c;
+    }
+    last_ns = now;
+    printf("%.0f pkt/s, %.1f MB/s, %.1f pkt/batch, %lu send errors",
+           total.packets / sec, total.bytes / sec / 1e6,
+           total.batches ? (double)total.packets / total.batches : 0.0,
+           (unsigned long)total.send_errors);
+    if (threads > 1)
+      printf(" (per thread:%s)", per_thread);
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
+void RunSimple(int sockfd) {
   char *mesg = malloc(BUFSIZE + 1);
-  char ipadr[16];
+  int n;
+  struct sockaddr_in cliaddr;
+
+  while (1) {
+    unsigned int len = SLEN;
 
-  int sockfd, n;
+    if ((n = recvfrom(sockfd, mesg, BUFSIZE, 0, (SADDR *)&cliaddr, &len)) < 0) {
+      perror("recvfrom");
+      exit(1);
+    }
+    mesg[n] = 0;
+
+    LogPacket(mesg, &cliaddr);
+
+    if (sendto(sockfd, mesg, n, 0, (SADDR *)&cliaddr, len) < 0) {
+      perror("sendto");
+      exit(1);
+    }
+  }
+}
+
+int OpenSocket(int port, bool reuseport) {
+  int sockfd;
   struct sockaddr_in servaddr;
-  struct sockaddr_in cliaddr;
 
   if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
     perror("socket problem");
     exit(1);
   }
+  int opt = 1;
+  if (reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    perror("setsockopt SO_REUSEPORT");
+    exit(1);
+  }
 
   memset(&servaddr, 0, SLEN);
   servaddr.sin_family = AF_INET;
   servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  servaddr.sin_port = htons(SERV_PORT);
+  servaddr.sin_port = htons(port);
 
   if (bind(sockfd, (SADDR *)&servaddr, SLEN) < 0) {
     perror("bind problem");
     exit(1);
   }
-  printf("SERVER starts...\n");
+  return sockfd;
+}
 
-  while (1) {
-    unsigned int len = SLEN;
+int main(int argc, char *argv[]) {
+  int batch = 0;
+  long sample = 0;
+  double interval = 1;
+  int threads = 0;
 
-    if ((n = recvfrom(sockfd, mesg, BUFSIZE, 0, (SADDR *)&cliaddr, &len)) < 0) {
-      perror("recvfrom");
-      exit(1);
+  while (true) {
+    static struct option options[] = {
+        {"batch", required_argument, 0, 0},
+        {"sample", required_argument, 0, 0},
+        {"stats-interval", required_argument, 0, 0},
+        {"threads", required_argument, 0, 0},
+        {0, 0, 0, 0}};
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0:
+      switch (option_index) {
+      case 0:
+        batch = atoi(optarg);
+        break;
+      case 1:
+        sample = atol(optarg);
+        break;
+      case 2:
+        interval = atof(optarg);
+        break;
+      case 3:
+        threads = atoi(optarg);
+        break;
+      }
+      break;
+    case '?':
+      break;
+    default:
+      printf("getopt returned character code 0%o?\n", c);
     }
-    mesg[n] = 0;
+  }
+
+  if (argc - optind < 2 || batch < 0 || sample < 0 || interval <= 0 ||
+      threads < 0) {
+    printf("Usage: %s [--batch N] [--threads N] [--sample N] "
+           "[--stats-interval 1] <port> <bufsize>\n"
+           "--batch echoes up to N datagrams per recvmmsg/sendmmsg and "
+           "prints counters\ninstead of every request; --sample logs one "
+           "request in N\n"
+           "--threads runs N pinned threads, each with its own socket on the "
+           "port (batch 32\nunless --batch says otherwise)\n",
+           argv[0]);
+    exit(1);
+  }
 
-    printf("REQUEST %s FROM %s : %d\n",
-           mesg,
-           inet_ntop(AF_INET, (void *)&cliaddr.sin_addr.s_addr, ipadr, 16),
-           ntohs(cliaddr.sin_port));
+  int SERV_PORT = atoi(argv[optind]);
+  BUFSIZE = atoi(argv[optind + 1]);
 
-    if (sendto(sockfd, mesg, n, 0, (SADDR *)&cliaddr, len) < 0) {
-      perror("sendto");
+  if (threads > 0 && batch == 0)
+    batch = 32;
+  if (batch == 0) {
+    int sockfd = OpenSocket(SERV_PORT, false);
+    printf("SERVER starts...\n");
+    RunSimple(sockfd);
+  }
+
+  /* every socket is bound before any thread runs, so a busy port fails
+   * the start rather than one of the threads */
+  bool pin = threads > 0;
+  if (threads == 0)
+    threads = 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct Worker *workers = aligned_alloc(64, sizeof(struct Worker) * threads);
+  if (workers == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memset(workers, 0, sizeof(struct Worker) * threads);
+  for (int t = 0; t < threads; t++) {
+    workers[t].sockfd = OpenSocket(SERV_PORT, threads > 1);
+    workers[t].cpu = pin ? (int)(t % (cpus > 0 ? cpus : 1)) : -1;
+    workers[t].batch = batch;
+    workers[t].sample = sample;
+  }
+  printf("SERVER starts...\n");
+  for (int t = 0; t < threads; t++) {
+    if (pthread_create(&workers[t].thread, NULL, RunBatched, &workers[t])) {
+      fprintf(stderr, "pthread_create failed\n");
       exit(1);
     }
   }
+  PrintStats(workers, threads, interval);
 }